@@ -0,0 +1,642 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * Implementation of the loop idiom recognizer
+ *
+ * Loop_new runs the body once symbolically, describing every register
+ * in terms of the registers' values at the head:
+ *   LINEAR   c + the sum of k[r] * (head value of r), mod 2^32, which
+ *            covers ADD, multiplication by a constant and NAND of a value
+ *            with itself (~x is -1 - x)
+ *   BITWISE  a bitwise function of two linear forms, kept as the truth
+ *            table of one bit, since NANDs of NANDs build the XOR that
+ *            course-assembled code uses for !=; a form and its
+ *            complement count as one operand
+ *   SELECT   a CMOV of two linear forms on a linear or bitwise condition
+ *   LOADED   the word read by the body's one SLOAD
+ *   OPAQUE   anything else
+ * A register that ends the body with its head value is invariant, and
+ * one that ends it with its head value plus a form of invariants is an
+ * induction. The forms the loop depends on may only use inductions, so
+ * every iteration is known in closed form, and the first iteration that
+ * leaves the loop is the first root of a linear congruence.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "idioms.h"
+#include "mem.h"
+#include "assert.h"
+#include "bitpack.h"
+
+#define NUM_REGS 8
+#define MAX_BODY 64     /* longer bodies are not analyzed */
+#define MIN_BULK 8      /* shorter runs are left to the interpreter */
+#define NEVER UINT64_MAX
+
+enum { CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV, NAND, LOADP = 12, LV };
+
+/* truth tables of one bit, indexed by (x bit << 1) | y bit */
+#define TABLE_X 0xc
+#define TABLE_Y 0xa
+#define TABLE_XOR 0x6
+#define TABLE_XNOR 0x9
+
+typedef struct Form {
+        uint32_t c;
+        uint32_t k[NUM_REGS];
+} Form;
+
+typedef enum Kind { LINEAR, BITWISE, SELECT, LOADED, OPAQUE } Kind;
+
+/*
+ * LINEAR is x; BITWISE is table applied to x and y; SELECT is nz if its
+ * condition (x, or table of x and y if bitwise_cond) is nonzero, else z
+ */
+typedef struct Value {
+        Kind kind;
+        Form x, y;
+        unsigned table;
+        bool bitwise_cond;
+        Form nz, z;
+} Value;
+
+struct Loop_T {
+        uint32_t head, len;             /* len words from head, tail last */
+        uint32_t *body;
+
+        Value final[NUM_REGS];          /* registers at the tail */
+        bool invariant[NUM_REGS];
+        bool induction[NUM_REGS];       /* invariants included */
+        Form step[NUM_REGS];            /* of inductions, of invariants */
+
+        Form origin;                    /* LOADP's segment, must be 0 */
+        Form target, exit;              /* LOADP's target */
+        bool conditional;               /* or it always jumps to target */
+        Form cond;                      /* jumps to target while nonzero */
+
+        Form dst_seg, dst_index;        /* the one store */
+        Value stored;
+        bool copy;                      /* stores what the SLOAD loaded */
+        Form src_seg, src_index;
+};
+
+static Form constant(uint32_t c)
+{
+        Form f;
+        memset(&f, 0, sizeof(f));
+        f.c = c;
+        return f;
+}
+
+static Form entry(int r)
+{
+        Form f = constant(0);
+        f.k[r] = 1;
+        return f;
+}
+
+static Value of_kind(Kind kind)
+{
+        Value v;
+        memset(&v, 0, sizeof(v));
+        v.kind = kind;
+        return v;
+}
+
+static Value linear(Form f)
+{
+        Value v = of_kind(LINEAR);
+        v.x = f;
+        return v;
+}
+
+static bool is_constant(Form f)
+{
+        for (int r = 0; r < NUM_REGS; ++r) {
+                if (f.k[r] != 0)
+                        return false;
+        }
+        return true;
+}
+
+static bool same_form(Form a, Form b)
+{
+        return memcmp(&a, &b, sizeof(Form)) == 0;
+}
+
+/* a * f + b * g + c */
+static Form combine(uint32_t a, Form f, uint32_t b, Form g, uint32_t c)
+{
+        Form result = constant(a * f.c + b * g.c + c);
+        for (int r = 0; r < NUM_REGS; ++r) {
+                result.k[r] = a * f.k[r] + b * g.k[r];
+        }
+        return result;
+}
+
+static Form complement(Form f)
+{
+        return combine(-1, f, 0, f, -1);
+}
+
+static uint32_t eval(Form f, const uint32_t *regs)
+{
+        uint32_t result = f.c;
+        for (int r = 0; r < NUM_REGS; ++r) {
+                result += f.k[r] * regs[r];
+        }
+        return result;
+}
+
+/* applies a one-bit truth table to every bit of x and y */
+static uint32_t apply_table(unsigned table, uint32_t x, uint32_t y)
+{
+        return ((table & 8) ? (x & y) : 0) | ((table & 4) ? (x & ~y) : 0)
+             | ((table & 2) ? (~x & y) : 0) | ((table & 1) ? ~(x | y) : 0);
+}
+
+/* the bitwise function table of x and y, as LINEAR when it can be */
+static Value bitwise(Form x, Form y, unsigned table)
+{
+        if (is_constant(x) && is_constant(y)) {
+                return linear(constant(apply_table(table, x.c, y.c)));
+        }
+        if (same_form(x, y)) {
+                /* only the entries where the bits agree can happen */
+                table = ((table & 8) ? TABLE_X : 0)
+                      | ((table & 1) ? (TABLE_X ^ 0xf) : 0);
+        }
+
+        bool x_only = ((table >> 1) & 5) == (table & 5);
+        bool y_only = ((table >> 2) & 3) == (table & 3);
+        if (x_only || y_only) {
+                Form f = x_only ? x : y;
+                bool when_set = table & 8;
+                bool when_clear = x_only ? (table & 2) : (table & 1);
+                if (when_set == when_clear)
+                        return linear(constant(when_set ? ~0u : 0));
+                return linear(when_set ? f : complement(f));
+        }
+
+        Value v = of_kind(BITWISE);
+        v.x = x;
+        v.y = y;
+        v.table = table;
+        return v;
+}
+
+/* which of x (0) and y (1) f is, or is the complement of; -1 if neither */
+static int operand(Form f, Form x, Form y, bool *negated)
+{
+        for (int i = 0; i < 2; ++i) {
+                Form base = i == 0 ? x : y;
+                *negated = same_form(f, complement(base));
+                if (*negated || same_form(f, base))
+                        return i;
+        }
+        return -1;
+}
+
+/* the truth table of v over the forms x and y; false if it has none */
+static bool table_over(const Value *v, Form x, Form y, unsigned *table)
+{
+        Form forms[2] = { v->x, v->kind == BITWISE ? v->y : v->x };
+        unsigned own = v->kind == BITWISE ? v->table : TABLE_X;
+        int which[2];
+        bool negated[2];
+        for (int i = 0; i < 2; ++i) {
+                which[i] = operand(forms[i], x, y, &negated[i]);
+                if (which[i] < 0)
+                        return false;
+        }
+
+        *table = 0;
+        for (unsigned index = 0; index < 4; ++index) {
+                unsigned bits[2] = { index >> 1, index & 1 };
+                unsigned a = bits[which[0]] ^ negated[0];
+                unsigned b = bits[which[1]] ^ negated[1];
+                if ((own >> ((a << 1) | b)) & 1)
+                        *table |= 1u << index;
+        }
+        return true;
+}
+
+static Value nand(const Value *a, const Value *b)
+{
+        if ((a->kind != LINEAR && a->kind != BITWISE)
+            || (b->kind != LINEAR && b->kind != BITWISE))
+                return of_kind(OPAQUE);
+
+        /* between them the operands may only use two forms */
+        Form forms[4] = { a->x, a->y, b->x, b->y };
+        bool used[4] = { true, a->kind == BITWISE, true, b->kind == BITWISE };
+        Form base[2];
+        int bases = 0;
+        for (int i = 0; i < 4; ++i) {
+                bool negated;
+                if (!used[i] || (bases > 0 && operand(forms[i], base[0],
+                                     base[bases - 1], &negated) >= 0))
+                        continue;
+                if (bases == 2)
+                        return of_kind(OPAQUE);
+                base[bases++] = forms[i];
+        }
+        if (bases == 1)
+                base[1] = base[0];
+
+        unsigned ta = 0, tb = 0;
+        table_over(a, base[0], base[1], &ta);
+        table_over(b, base[0], base[1], &tb);
+        return bitwise(base[0], base[1], ~(ta & tb) & 0xf);
+}
+
+static Value cmov(const Value *ra, const Value *rb, const Value *rc)
+{
+        if (rc->kind == LINEAR && is_constant(rc->x)) {
+                return rc->x.c != 0 ? *rb : *ra;
+        }
+        if ((rc->kind != LINEAR && rc->kind != BITWISE)
+            || ra->kind != LINEAR || rb->kind != LINEAR)
+                return of_kind(OPAQUE);
+
+        Value v = *rc;
+        v.kind = SELECT;
+        v.bitwise_cond = rc->kind == BITWISE;
+        v.nz = rb->x;
+        v.z = ra->x;
+        return v;
+}
+
+/* value of v in the iteration whose head registers are regs */
+static uint32_t value_at(const Value *v, const uint32_t *regs)
+{
+        uint32_t cond;
+        switch (v->kind) {
+        case LINEAR:
+                return eval(v->x, regs);
+        case BITWISE:
+                return apply_table(v->table, eval(v->x, regs),
+                                   eval(v->y, regs));
+        case SELECT:
+                cond = v->bitwise_cond
+                        ? apply_table(v->table, eval(v->x, regs),
+                                      eval(v->y, regs))
+                        : eval(v->x, regs);
+                return eval(cond != 0 ? v->nz : v->z, regs);
+        default:
+                assert(0);
+                return 0;
+        }
+}
+
+/* whether f only uses inductions, or only invariants */
+static bool closed(Loop_T loop, Form f, bool invariant)
+{
+        for (int r = 0; r < NUM_REGS; ++r) {
+                if (f.k[r] != 0 && !(invariant ? loop->invariant[r]
+                                               : loop->induction[r]))
+                        return false;
+        }
+        return true;
+}
+
+static bool closed_value(Loop_T loop, const Value *v, bool invariant)
+{
+        switch (v->kind) {
+        case LINEAR:
+                return closed(loop, v->x, invariant);
+        case BITWISE:
+                return closed(loop, v->x, invariant)
+                    && closed(loop, v->y, invariant);
+        case SELECT:
+                return closed(loop, v->x, invariant)
+                    && closed(loop, v->y, invariant)
+                    && closed(loop, v->nz, invariant)
+                    && closed(loop, v->z, invariant);
+        case LOADED:
+                return !invariant;
+        default:
+                return false;
+        }
+}
+
+/* change of the form f from one iteration to the next, given steps */
+static uint32_t delta(Form f, const uint32_t *step)
+{
+        uint32_t result = 0;
+        for (int r = 0; r < NUM_REGS; ++r) {
+                result += f.k[r] * step[r];
+        }
+        return result;
+}
+
+/* runs the body once symbolically; false at anything but copy or fill */
+static bool run_body(Loop_T loop, Value *regs)
+{
+        bool loaded = false, stored = false;
+        for (int r = 0; r < NUM_REGS; ++r) {
+                regs[r] = linear(entry(r));
+        }
+
+        for (uint32_t i = 0; i + 1 < loop->len; ++i) {
+                uint32_t word = loop->body[i];
+                unsigned op = Bitpack_getu(word, 4, 28);
+                Value *ra = &regs[Bitpack_getu(word, 3, 6)];
+                Value *rb = &regs[Bitpack_getu(word, 3, 3)];
+                Value *rc = &regs[Bitpack_getu(word, 3, 0)];
+                bool linear_bc = rb->kind == LINEAR && rc->kind == LINEAR;
+
+                switch (op) {
+                case CMOV:
+                        *ra = cmov(ra, rb, rc);
+                        break;
+                case SLOAD:
+                        if (loaded || stored || !linear_bc)
+                                return false;
+                        loaded = true;
+                        loop->src_seg = rb->x;
+                        loop->src_index = rc->x;
+                        *ra = of_kind(LOADED);
+                        break;
+                case SSTORE:
+                        if (stored || ra->kind != LINEAR
+                            || rb->kind != LINEAR)
+                                return false;
+                        stored = true;
+                        loop->dst_seg = ra->x;
+                        loop->dst_index = rb->x;
+                        loop->stored = *rc;
+                        break;
+                case ADD:
+                        *ra = linear_bc
+                                ? linear(combine(1, rb->x, 1, rc->x, 0))
+                                : of_kind(OPAQUE);
+                        break;
+                case MUL:
+                        if (linear_bc && is_constant(rb->x))
+                                *ra = linear(combine(rb->x.c, rc->x,
+                                                     0, rc->x, 0));
+                        else if (linear_bc && is_constant(rc->x))
+                                *ra = linear(combine(rc->x.c, rb->x,
+                                                     0, rb->x, 0));
+                        else
+                                *ra = of_kind(OPAQUE);
+                        break;
+                case DIV:
+                        if (linear_bc && is_constant(rb->x)
+                            && is_constant(rc->x) && rc->x.c != 0)
+                                *ra = linear(constant(rb->x.c / rc->x.c));
+                        else
+                                *ra = of_kind(OPAQUE);
+                        break;
+                case NAND:
+                        *ra = nand(rb, rc);
+                        break;
+                case LV:
+                        regs[Bitpack_getu(word, 3, 25)] =
+                                linear(constant(Bitpack_getu(word, 25, 0)));
+                        break;
+                default:
+                        /* halt, map, unmap, I/O or a jump elsewhere */
+                        return false;
+                }
+        }
+
+        loop->copy = loaded;
+        return stored;
+}
+
+/* checks that the body is a copy or fill loop and records how it runs */
+static bool analyze(Loop_T loop)
+{
+        Value regs[NUM_REGS];
+        if (!run_body(loop, regs))
+                return false;
+
+        for (int r = 0; r < NUM_REGS; ++r) {
+                loop->final[r] = regs[r];
+                loop->invariant[r] = regs[r].kind == LINEAR
+                                     && same_form(regs[r].x, entry(r));
+                loop->step[r] = constant(0);
+        }
+        for (int r = 0; r < NUM_REGS; ++r) {
+                Form step = regs[r].x;
+                step.k[r] -= 1;
+                loop->induction[r] = loop->invariant[r]
+                        || (regs[r].kind == LINEAR && regs[r].x.k[r] == 1
+                            && closed(loop, step, true));
+                if (loop->induction[r])
+                        loop->step[r] = step;
+        }
+        for (int r = 0; r < NUM_REGS; ++r) {
+                /* a register that is not an induction is recomputed by
+                   every iteration from inductions only */
+                if (!loop->induction[r]
+                    && !closed_value(loop, &regs[r], false))
+                        return false;
+        }
+
+        uint32_t tail = loop->body[loop->len - 1];
+        const Value *origin = &regs[Bitpack_getu(tail, 3, 3)];
+        const Value *target = &regs[Bitpack_getu(tail, 3, 0)];
+        if (Bitpack_getu(tail, 4, 28) != LOADP || origin->kind != LINEAR
+            || !closed(loop, origin->x, true))
+                return false;
+        loop->origin = origin->x;
+
+        if (target->kind == LINEAR) {
+                loop->conditional = false;
+                loop->target = target->x;
+        } else if (target->kind == SELECT) {
+                loop->conditional = true;
+                loop->target = target->nz;
+                loop->exit = target->z;
+                /* x xor y is nonzero when x - y is, x xnor y when x - ~y is */
+                if (!target->bitwise_cond) {
+                        loop->cond = target->x;
+                } else if (target->table == TABLE_XOR) {
+                        loop->cond = combine(1, target->x, -1, target->y, 0);
+                } else if (target->table == TABLE_XNOR) {
+                        loop->cond = combine(1, target->x, 1, target->y, 1);
+                } else {
+                        return false;
+                }
+        } else {
+                return false;
+        }
+        if (!closed(loop, loop->target, true)
+            || !closed(loop, loop->exit, true)
+            || !closed(loop, loop->cond, false))
+                return false;
+
+        if (!closed(loop, loop->dst_seg, true)
+            || !closed(loop, loop->dst_index, false))
+                return false;
+        if (loop->copy) {
+                return loop->stored.kind == LOADED
+                    && closed(loop, loop->src_seg, true)
+                    && closed(loop, loop->src_index, false);
+        }
+        return closed_value(loop, &loop->stored, true);
+}
+
+Loop_T Loop_new(const uint32_t *program, uint32_t head, uint32_t tail)
+{
+        assert(program);
+        if (tail < head || tail - head >= MAX_BODY)
+                return NULL;
+
+        Loop_T loop;
+        NEW0(loop);
+        loop->head = head;
+        loop->len = tail - head + 1;
+        loop->body = CALLOC(loop->len, sizeof(uint32_t));
+        memcpy(loop->body, program + head, loop->len * sizeof(uint32_t));
+
+        if (!analyze(loop))
+                Loop_free(&loop);
+        return loop;
+}
+
+bool Loop_matches(Loop_T loop, const uint32_t *program, uint32_t head)
+{
+        assert(loop && program);
+        return loop->head == head && memcmp(loop->body, program + head,
+                                      loop->len * sizeof(uint32_t)) == 0;
+}
+
+/* first t >= 0 with c + t * d == 0 (mod 2^32), or NEVER */
+static uint64_t first_root(uint32_t c, uint32_t d)
+{
+        if (c == 0)
+                return 0;
+        if (d == 0)
+                return NEVER;
+
+        /* d = odd * 2^z: c must be a multiple of 2^z too */
+        int z = __builtin_ctz(d);
+        if (c & ((1u << z) - 1))
+                return NEVER;
+        uint32_t odd = d >> z;
+        uint32_t inverse = odd;         /* right in the low 3 bits */
+        for (int i = 0; i < 4; ++i) {
+                inverse *= 2 - odd * inverse;
+        }
+        uint32_t t = ((0u - c) >> z) * inverse;
+        return z == 0 ? t : (t & ((1u << (32 - z)) - 1));
+}
+
+/* iterations from index on before leaving a segment of size words */
+static uint32_t in_bounds(uint32_t index, uint32_t stride, uint32_t size)
+{
+        if (index >= size)
+                return 0;
+        return stride == 1 ? size - index : index + 1;
+}
+
+uint32_t Loop_run(Loop_T loop, uint32_t *registers, Segments_T segments,
+                  seg_id *stored, uint32_t *lo, uint32_t *hi)
+{
+        assert(loop && registers && segments && stored && lo && hi);
+        uint32_t step[NUM_REGS];
+        for (int r = 0; r < NUM_REGS; ++r) {
+                step[r] = eval(loop->step[r], registers);
+        }
+
+        /* one word per iteration, walking up or down */
+        uint32_t stride = delta(loop->dst_index, step);
+        if ((stride != 1 && stride != (uint32_t)-1) || (loop->copy
+            && delta(loop->src_index, step) != stride))
+                return 0;
+
+        /* how many iterations jump back to the head */
+        if (eval(loop->origin, registers) != 0
+            || eval(loop->target, registers) != loop->head)
+                return 0;
+        uint64_t count = NEVER;
+        if (loop->conditional && eval(loop->exit, registers) != loop->head)
+                count = first_root(eval(loop->cond, registers),
+                                   delta(loop->cond, step));
+
+        /* and how many of those stay inside the segments */
+        seg_id dst_id = eval(loop->dst_seg, registers);
+        uint32_t dst_first = eval(loop->dst_index, registers);
+        if (!Segments_valid(segments, dst_id))
+                return 0;
+        uint64_t m = in_bounds(dst_first, stride,
+                               Segments_size(segments, dst_id));
+        seg_id src_id = 0;
+        uint32_t src_first = 0;
+        if (loop->copy) {
+                src_id = eval(loop->src_seg, registers);
+                src_first = eval(loop->src_index, registers);
+                if (!Segments_valid(segments, src_id))
+                        return 0;
+                uint32_t n = in_bounds(src_first, stride,
+                                       Segments_size(segments, src_id));
+                m = n < m ? n : m;
+        }
+        m = count < m ? count : m;
+        if (m < MIN_BULK)
+                return 0;
+
+        uint32_t dst_last = dst_first + (m - 1) * stride;
+        uint32_t dst_low = stride == 1 ? dst_first : dst_last;
+        /* the loop must not rewrite itself */
+        if (dst_id == 0 && dst_low < loop->head + loop->len
+            && dst_low + m > loop->head)
+                return 0;
+        *stored = dst_id;
+        *lo = dst_low;
+        *hi = dst_low + m - 1;
+
+        uint32_t *dst = Segments_get_mem(segments, dst_id);
+        if (loop->copy) {
+                uint32_t *src = Segments_get_mem(segments, src_id);
+                uint32_t src_low = stride == 1 ? src_first
+                                               : src_first - (m - 1);
+                /* distance the source is ahead of the destination */
+                int64_t ahead = ((int64_t)src_first - dst_first)
+                                * (int32_t)stride;
+                if (src == dst && ahead < 0 && -ahead < (int64_t)m) {
+                        /* reads words this loop wrote: go word by word */
+                        for (uint32_t i = 0; i < m; ++i) {
+                                dst[dst_first + i * stride] =
+                                        src[src_first + i * stride];
+                        }
+                } else {
+                        memmove(dst + dst_low, src + src_low,
+                                m * sizeof(uint32_t));
+                }
+        } else {
+                uint32_t word = value_at(&loop->stored, registers);
+                for (uint32_t i = 0; i < m; ++i) {
+                        dst[dst_low + i] = word;
+                }
+        }
+
+        /* registers as the last iteration, which began at last, left them */
+        uint32_t last[NUM_REGS];
+        for (int r = 0; r < NUM_REGS; ++r) {
+                last[r] = registers[r] + (m - 1) * step[r];
+        }
+        for (int r = 0; r < NUM_REGS; ++r) {
+                if (loop->induction[r])
+                        registers[r] += m * step[r];
+                else if (loop->final[r].kind == LOADED)
+                        registers[r] = dst[dst_last];
+                else
+                        registers[r] = value_at(&loop->final[r], last);
+        }
+        return m;
+}
+
+void Loop_free(Loop_T *loop)
+{
+        assert(loop && *loop);
+        FREE((*loop)->body);
+        FREE(*loop);
+}
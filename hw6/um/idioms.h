@@ -0,0 +1,48 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * Interface of the loop idiom recognizer
+ *
+ * A Loop_T is a straight-line loop body in segment 0, from a head to the
+ * LOADP at its tail that jumps back to the head, that stores to one word
+ * per iteration walking up or down a segment: a fill (the value stored
+ * does not depend on memory) or a copy (the value is loaded, walking the
+ * same way, in the same iteration). Loop_run performs the iterations
+ * that are certain to jump back to the head and stay in bounds as one
+ * bulk operation, leaving registers and memory exactly as the loop would
+ * have left them at the head; the machine then runs the rest normally,
+ * including the last iteration and any bounds fault.
+ */
+
+#ifndef IDIOMS_H_
+#define IDIOMS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "segments.h"
+
+typedef struct Loop_T *Loop_T;
+
+/*
+ * analyzes program[head..tail]; returns NULL unless it is a copy or
+ * fill loop
+ */
+Loop_T Loop_new(const uint32_t *program, uint32_t head, uint32_t tail);
+
+/* whether loop was built from these words at this head */
+bool Loop_matches(Loop_T loop, const uint32_t *program, uint32_t head);
+
+/*
+ * runs as many whole iterations as possible in bulk, starting from the
+ * head with registers; returns the number run. If that is not 0, the
+ * words written are [*lo, *hi] of segment *stored, so the caller can
+ * forget what it knew about them.
+ */
+uint32_t Loop_run(Loop_T loop, uint32_t *registers, Segments_T segments,
+                  seg_id *stored, uint32_t *lo, uint32_t *hi);
+
+void Loop_free(Loop_T *loop);
+
+#endif
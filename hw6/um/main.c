@@ -4,20 +4,327 @@
  *
  * main function for um
  *
+ * usage: um [-r] [-m words] [-i instructions] [-c dir] program
+ *        um [-r] [-m words] [-i instructions] [-c dir] -p "a.um | b.um ..."
+ *
+ * The machine reads its input straight from file descriptor 0. When no
+ * input is waiting, Um_run stops at the IN; that is a quiet point, so
+ * the machine is compacted (Um_compact) before main waits for more. With
+ * -r, every quiet point also prints the time since start and the
+ * resident set size before and after compacting to stderr.
+ *
+ * -m and -i set the machine's quotas (Um_set_quota): a MAP that would
+ * leave more than words mapped, or a jump after more than instructions,
+ * stops the machine with a message and exit status 2, in place of the
+ * mem-limited and cpu-limited wrappers.
+ *
+ * -c keeps a cache of unpacked machines in dir (see umcache.h): if the
+ * program has been run with the same dir before and unpacked itself
+ * into segment 0 before any IN or OUT, the machine starts from there.
+ *
+ * -p runs a pipeline of programs, as the shell would run "um a.um | um
+ * b.um", but in one process: every stage's machine runs on a thread of
+ * its own, and each one's output goes to the next one's input through
+ * an Umpipe, a ring in memory. The first stage reads file descriptor 0
+ * and the last writes stdout; a stage that halts or passes a quota
+ * closes its output, so the next one's IN gets EOF (all ones) once it
+ * has read the rest, and drops its input, so the one before never waits
+ * on it again. Quotas and the cache apply to every stage.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "um.h"
+#include "umcache.h"
+#include "umpipe.h"
 #include "assert.h"
+#include "mem.h"
 
-int main(int argc, char *argv[]) 
+#define INPUT_CHUNK 65536
+
+static struct {
+        unsigned char bytes[INPUT_CHUNK];
+        ssize_t start, len;
+        bool eof;
+} input;
+
+/* input source of the machine: blocks it when no byte is waiting */
+static int stdin_get(void *cl)
+{
+        (void)cl;
+        if (input.start == input.len && !input.eof) {
+                struct pollfd ready = { 0, POLLIN, 0 };
+                if (poll(&ready, 1, 0) == 0) {
+                        return UM_NO_INPUT;
+                }
+                ssize_t n = read(0, input.bytes, INPUT_CHUNK);
+                if (n < 0 && errno == EINTR) {
+                        return UM_NO_INPUT;
+                }
+                input.start = 0;
+                input.len = n > 0 ? n : 0;
+                input.eof = n <= 0;
+        }
+        if (input.start < input.len) {
+                return input.bytes[input.start++];
+        }
+        return EOF;
+}
+
+static void stdout_put(int c, void *cl)
+{
+        (void)cl;
+        putchar_unlocked(c);
+}
+
+/* resident set size of this process in kB */
+static long rss_kb(void)
+{
+        long pages = 0, resident = 0;
+        FILE *statm = fopen("/proc/self/statm", "r");
+        if (statm != NULL) {
+                if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+                        resident = 0;
+                fclose(statm);
+        }
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double seconds_since(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec)
+               + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* a program run as a machine, and where its input and output go */
+typedef struct Stage {
+        const char *path;
+        Um machine;
+        Umcache cache;          /* NULL without -c */
+        Umpipe in, out;         /* NULL for fd 0 and stdout */
+        Um_status status;
+        pthread_t thread;
+} Stage;
+
+static bool report;
+static struct timespec start;
+
+static int pipe_get(void *cl)
+{
+        return Umpipe_get(((Stage *)cl)->in);
+}
+
+static void pipe_put(int c, void *cl)
+{
+        Umpipe_put(((Stage *)cl)->out, c);
+}
+
+/* the machine for stage's program, from the cache in dir if it has one */
+static void start_stage(Stage *stage, const char *dir, uint64_t words,
+                        uint64_t instructions)
 {
-        assert(argc == 2);
-        FILE *program = fopen(argv[1], "r");
-        assert(program);
-        Um machine = Um_new(program);
-        while (run_next(machine)){
-                ;
+        FILE *program = fopen(stage->path, "r");
+        if (program == NULL) {
+                perror(stage->path);
+                exit(1);
+        }
+        stage->cache = NULL;
+        stage->machine = NULL;
+        if (dir != NULL) {
+                stage->cache = Umcache_new(dir, program);
+                stage->machine = Umcache_load(stage->cache);
+        }
+        if (stage->machine == NULL) {
+                stage->machine = Um_new(program);
+                if (stage->cache != NULL) {
+                        Um_stop_at_unpack(stage->machine);
+                }
         }
-        Um_free(&machine);
         fclose(program);
+        Um_set_quota(stage->machine, words, instructions);
+
+        Um_io io = { stage->in ? pipe_get : stdin_get,
+                     stage->out ? pipe_put : stdout_put, stage };
+        Um_set_io(stage->machine, &io);
+}
+
+/* runs a stage until it halts or passes a quota */
+static void *run_stage(void *arg)
+{
+        Stage *stage = arg;
+        Um machine = stage->machine;
+        Um_status status;
+        while ((status = Um_run(machine)) == UM_BLOCKED
+               || status == UM_UNPACKED) {
+                if (status == UM_UNPACKED) {
+                        Umcache_save(stage->cache, machine);
+                        continue;
+                }
+                if (stage->out != NULL) {
+                        Umpipe_flush(stage->out);
+                } else {
+                        fflush(stdout);
+                }
+                long before = report ? rss_kb() : 0;
+                Um_compact(machine);
+                if (report) {
+                        fprintf(stderr, "%8.2fs %s: rss %ld kB, %ld kB "
+                                "after compacting\n", seconds_since(&start),
+                                stage->path, before, rss_kb());
+                }
+                if (stage->in != NULL) {
+                        Umpipe_wait(stage->in);
+                } else {
+                        struct pollfd ready = { 0, POLLIN, 0 };
+                        poll(&ready, 1, -1);
+                }
+        }
+        if (stage->out != NULL) {
+                Umpipe_close(stage->out);
+        } else {
+                fflush(stdout);
+        }
+        if (stage->in != NULL) {
+                Umpipe_drop(stage->in);
+        }
+        stage->status = status;
+        return NULL;
+}
+
+/*
+ * splits spec in place at every '|', trimming blanks from each path;
+ * NULL, with spec untouched, if any path would be empty
+ */
+static char **split_spec(char *spec, int *n)
+{
+        int count = 1;
+        bool blank = true;
+        for (char *c = spec; *c != '\0'; ++c) {
+                if (*c == '|') {
+                        if (blank) {
+                                return NULL;
+                        }
+                        ++count;
+                        blank = true;
+                } else if (*c != ' ' && *c != '\t') {
+                        blank = false;
+                }
+        }
+        if (blank) {
+                return NULL;
+        }
+        char **paths = ALLOC(count * sizeof(char *));
+        for (int i = 0; i < count; ++i) {
+                char *bar = strchr(spec, '|');
+                if (bar != NULL) {
+                        *bar = '\0';
+                }
+                spec += strspn(spec, " \t");
+                char *end = spec + strlen(spec);
+                while (end > spec && (end[-1] == ' ' || end[-1] == '\t')) {
+                        *--end = '\0';
+                }
+                paths[i] = spec;
+                spec = bar + 1;
+        }
+        *n = count;
+        return paths;
+}
+
+int main(int argc, char *argv[]) 
+{
+        uint64_t words = 0, instructions = 0;
+        const char *cache_dir = NULL;
+        char *spec = NULL;
+        int opt;
+        while ((opt = getopt(argc, argv, "rm:i:c:p:")) != -1) {
+                if (opt == 'r') {
+                        report = true;
+                } else if (opt == 'm') {
+                        words = strtoull(optarg, NULL, 0);
+                } else if (opt == 'i') {
+                        instructions = strtoull(optarg, NULL, 0);
+                } else if (opt == 'c') {
+                        cache_dir = optarg;
+                } else if (opt == 'p') {
+                        spec = optarg;
+                } else {
+                        break;
+                }
+        }
+        int n = 1;
+        char **paths = &argv[optind];
+        if (spec != NULL && argc == optind) {
+                paths = split_spec(spec, &n);
+                if (paths == NULL) {
+                        fprintf(stderr, "%s: empty stage in -p \"%s\"\n",
+                                argv[0], spec);
+                }
+        }
+        if (argc - optind != (spec == NULL) || paths == NULL) {
+                fprintf(stderr, "usage: %s [-r] [-m words] "
+                        "[-i instructions] [-c dir] program\n"
+                        "       %s [-r] [-m words] [-i instructions] "
+                        "[-c dir] -p \"a.um | b.um ...\"\n", argv[0],
+                        argv[0]);
+                return 1;
+        }
+        Stage *stages = CALLOC(n, sizeof(Stage));
+        for (int i = 0; i < n; ++i) {
+                stages[i].path = paths[i];
+                stages[i].in = i > 0 ? stages[i - 1].out : NULL;
+                stages[i].out = i < n - 1 ? Umpipe_new() : NULL;
+                start_stage(&stages[i], cache_dir, words, instructions);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (n == 1) {
+                run_stage(&stages[0]);
+        }
+        for (int i = 0; n > 1 && i < n; ++i) {
+                int made = pthread_create(&stages[i].thread, NULL,
+                                          run_stage, &stages[i]);
+                assert(made == 0);
+        }
+        for (int i = 0; n > 1 && i < n; ++i) {
+                pthread_join(stages[i].thread, NULL);
+        }
+        int failed = 0;
+        for (int i = 0; i < n; ++i) {
+                Stage *stage = &stages[i];
+                if (stage->status != UM_HALTED) {
+                        fprintf(stderr, "%s: %s%sstopped after %llu "
+                                "instructions: over its %s quota\n",
+                                argv[0], spec ? stage->path : "",
+                                spec ? ": " : "", (unsigned long long)
+                                Um_executed(stage->machine),
+                                stage->status == UM_OVER_MEMORY
+                                ? "memory" : "instruction");
+                        failed = 2;
+                }
+                Um_free(&stage->machine);
+                if (stage->cache != NULL) {
+                        Umcache_free(&stage->cache);
+                }
+                if (stage->out != NULL) {
+                        Umpipe_free(&stage->out);
+                }
+        }
+        FREE(stages);
+        if (spec != NULL) {
+                FREE(paths);
+        }
+        return failed;
 }
@@ -0,0 +1,203 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * Implementation of Reclaim module
+ *
+ * Blocks are anonymous mappings of a power of two bytes, the class of
+ * the block. Each Reclaim_T is one owner's pair of ring sets: a released
+ * block goes into its dirty ring, which only the owner writes and only
+ * the reclaimer reads; the reclaimer drops its pages with madvise, after
+ * which they read as zero and cost nothing until touched, and puts the
+ * block in the clean ring of its class, which only it writes and only
+ * Reclaim_alloc reads. Neither side ever waits on the other: a full
+ * dirty ring is unmapped in place, and a full clean ring by the
+ * reclaimer. There is one reclaimer thread for the whole process,
+ * started with the first Reclaim_T, however many machines it serves; it
+ * drains every Reclaim_T on the list when a release posts the semaphore.
+ * The list's mutex is only taken to add and remove a Reclaim_T and by
+ * the reclaimer while it drains, never on the alloc or release path.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "reclaim.h"
+
+#define DIRTY_BLOCKS 64         /* released, not yet reclaimed */
+#define CLEAN_BLOCKS 4          /* of each class, ready to allocate */
+#define CLASSES 64
+
+typedef struct Block {
+        void *addr;
+        int class;
+} Block;
+
+typedef struct Clean {
+        void *blocks[CLEAN_BLOCKS];
+        uint64_t head, tail;    /* moved by the reclaimer, by the owner */
+} Clean;
+
+struct Reclaim_T {
+        Reclaim_T next, prev;   /* on the reclaimer's list */
+        Block dirty[DIRTY_BLOCKS];
+        uint64_t head, tail;    /* moved by the owner, by the reclaimer */
+        Clean clean[CLASSES];
+};
+
+/* the reclaimer and the owners it serves, each on the list once */
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static pthread_mutex_t owners_lock = PTHREAD_MUTEX_INITIALIZER;
+static Reclaim_T owners;
+static sem_t work;
+
+static int class_of(size_t bytes)
+{
+        int class = 0;
+        while (((size_t)1 << class) < bytes) {
+                ++class;
+        }
+        assert(class < CLASSES);
+        return class;
+}
+
+/* empties one owner's dirty blocks into its clean rings */
+static void reclaim_dirty(Reclaim_T reclaim)
+{
+        uint64_t head = __atomic_load_n(&reclaim->head, __ATOMIC_ACQUIRE);
+        for (uint64_t i = reclaim->tail; i < head; ++i) {
+                Block block = reclaim->dirty[i % DIRTY_BLOCKS];
+                size_t len = (size_t)1 << block.class;
+                Clean *clean = &reclaim->clean[block.class];
+                uint64_t taken = __atomic_load_n(&clean->tail,
+                                                 __ATOMIC_ACQUIRE);
+                if (clean->head - taken == CLEAN_BLOCKS) {
+                        munmap(block.addr, len);
+                } else {
+                        madvise(block.addr, len, MADV_DONTNEED);
+                        clean->blocks[clean->head % CLEAN_BLOCKS]
+                                = block.addr;
+                        __atomic_store_n(&clean->head, clean->head + 1,
+                                         __ATOMIC_RELEASE);
+                }
+                __atomic_store_n(&reclaim->tail, i + 1, __ATOMIC_RELEASE);
+        }
+}
+
+/* the reclaimer: runs for the life of the process */
+static void *reclaim_blocks(void *arg)
+{
+        (void)arg;
+        for (;;) {
+                while (sem_wait(&work) != 0 && errno == EINTR) {
+                }
+                pthread_mutex_lock(&owners_lock);
+                for (Reclaim_T r = owners; r != NULL; r = r->next) {
+                        reclaim_dirty(r);
+                }
+                pthread_mutex_unlock(&owners_lock);
+        }
+        return NULL;
+}
+
+static void start_reclaimer(void)
+{
+        int ready = sem_init(&work, 0, 0);
+        assert(ready == 0);
+        pthread_t thread;
+        int made = pthread_create(&thread, NULL, reclaim_blocks, NULL);
+        assert(made == 0);
+        pthread_detach(thread);
+}
+
+Reclaim_T Reclaim_new(void)
+{
+        pthread_once(&started, start_reclaimer);
+        Reclaim_T reclaim;
+        NEW0(reclaim);
+        pthread_mutex_lock(&owners_lock);
+        reclaim->next = owners;
+        if (owners != NULL) {
+                owners->prev = reclaim;
+        }
+        owners = reclaim;
+        pthread_mutex_unlock(&owners_lock);
+        return reclaim;
+}
+
+void *Reclaim_alloc(Reclaim_T reclaim, size_t bytes)
+{
+        assert(reclaim);
+        int class = class_of(bytes);
+        Clean *clean = &reclaim->clean[class];
+        uint64_t ready = __atomic_load_n(&clean->head, __ATOMIC_ACQUIRE);
+        if (clean->tail < ready) {
+                void *block = clean->blocks[clean->tail % CLEAN_BLOCKS];
+                __atomic_store_n(&clean->tail, clean->tail + 1,
+                                 __ATOMIC_RELEASE);
+                return block;
+        }
+        void *block = mmap(NULL, (size_t)1 << class, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                           0);
+        assert(block != MAP_FAILED);
+        return block;
+}
+
+void Reclaim_release(Reclaim_T reclaim, void *block, size_t bytes)
+{
+        assert(reclaim && block);
+        int class = class_of(bytes);
+        uint64_t done = __atomic_load_n(&reclaim->tail, __ATOMIC_ACQUIRE);
+        if (reclaim->head - done == DIRTY_BLOCKS) {
+                munmap(block, (size_t)1 << class);
+                return;
+        }
+        Block *next = &reclaim->dirty[reclaim->head % DIRTY_BLOCKS];
+        next->addr = block;
+        next->class = class;
+        __atomic_store_n(&reclaim->head, reclaim->head + 1,
+                         __ATOMIC_RELEASE);
+        sem_post(&work);
+}
+
+/* 
+ * once off the list, which the reclaimer only walks holding the lock,
+ * the blocks are the caller's alone to unmap
+ */
+void Reclaim_free(Reclaim_T *reclaim)
+{
+        assert(reclaim && *reclaim);
+        Reclaim_T r = *reclaim;
+        pthread_mutex_lock(&owners_lock);
+        if (r->prev != NULL) {
+                r->prev->next = r->next;
+        } else {
+                owners = r->next;
+        }
+        if (r->next != NULL) {
+                r->next->prev = r->prev;
+        }
+        pthread_mutex_unlock(&owners_lock);
+
+        for (uint64_t i = r->tail; i < r->head; ++i) {
+                Block block = r->dirty[i % DIRTY_BLOCKS];
+                munmap(block.addr, (size_t)1 << block.class);
+        }
+        for (int class = 0; class < CLASSES; ++class) {
+                Clean *clean = &r->clean[class];
+                for (uint64_t i = clean->tail; i < clean->head; ++i) {
+                        munmap(clean->blocks[i % CLEAN_BLOCKS],
+                               (size_t)1 << class);
+                }
+        }
+        FREE(*reclaim);
+}
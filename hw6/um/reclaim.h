@@ -0,0 +1,44 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * reclaim.h
+ *
+ * Interface of the Reclaim module: memory for large segments, mapped
+ * from the OS and given back to it by a reclaimer thread, one for the
+ * whole process, so that freeing a multi-megabyte segment never runs
+ * between two instructions
+ *
+ */
+
+#ifndef RECLAIM_H_
+#define RECLAIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Reclaim_T *Reclaim_T;
+
+/* 
+ * a new owner's rings, served by the reclaimer, which the first call
+ * starts
+ */
+Reclaim_T Reclaim_new(void);
+
+/*
+ * zeroed memory of at least bytes: a block of the same power-of-two
+ * size that the reclaimer has emptied, if there is one, or else a new
+ * mapping; only one thread may alloc and release with a Reclaim_T
+ */
+void *Reclaim_alloc(Reclaim_T reclaim, size_t bytes);
+
+/*
+ * hands back a block Reclaim_alloc returned for bytes; the reclaimer
+ * returns its pages to the OS and keeps it to be allocated again
+ */
+void Reclaim_release(Reclaim_T reclaim, void *block, size_t bytes);
+
+/* takes the rings from the reclaimer and unmaps every block in them */
+void Reclaim_free(Reclaim_T *reclaim);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * segbench: benchmarks the Segments ADT on its own
+ *
+ * usage: segbench replay trace
+ *        segbench [-s seed] [-l live] [-L largest] random ops [trace]
+ *
+ * Built against each backend of segments.c, with the same flags: as
+ * segbench, segbench-flat (-DSEGMENTS_FLAT) and segbench-pool
+ * (-DSEGMENTS_POOL), so the same workload runs on each; segcompare.sh
+ * runs them all.
+ * replay runs a trace recorded by um-trace (see segments.c): segment 0
+ * is made its recorded size, and every map, unmap, copy and run of
+ * Segments_get_mem is done again, with ids translated to the ones this
+ * backend hands out; each get also reads and writes a word of the
+ * segment. random makes up ops operations instead: about live segments
+ * are kept mapped, maps and unmaps come in turn at random, each followed
+ * by a run of gets on a random live segment, and one op in 10000 copies
+ * a segment to segment 0. Sizes are drawn from the maps of trace if one
+ * is given, or else mostly tiny, some up to 64 words, a few up to 1024
+ * and one in a hundred up to 64K (or largest). The workload is built in
+ * memory before anything is timed. Prints, for each kind of operation,
+ * how many ran and their median, 99th percentile and worst time (a
+ * get's is its run's time over its length), the operations per second
+ * over the whole run (each get counting as one) and the peak RSS.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "segments.h"
+#if defined SEGMENTS_FLAT && defined SEGMENTS_POOL
+#define BACKEND "segments.c (flat, pool)"
+#elif defined SEGMENTS_FLAT
+#define BACKEND "segments.c (flat)"
+#elif defined SEGMENTS_POOL
+#define BACKEND "segments.c (pool)"
+#else
+#define BACKEND "segments.c"
+#endif
+
+typedef struct Op {
+        char kind;              /* p, m, u, c or g as in a trace */
+        uint32_t a, b;          /* size or id, then id */
+        uint64_t n;             /* gets in the run */
+} Op;
+
+typedef struct Ops {
+        Op *ops;
+        size_t len, cap;
+} Ops;
+
+static void add_op(Ops *ops, Op op)
+{
+        if (ops->ops == NULL) {
+                ops->cap = 1024;
+                ops->ops = ALLOC(ops->cap * sizeof(Op));
+        } else if (ops->len == ops->cap) {
+                ops->cap *= 2;
+                RESIZE(ops->ops, ops->cap * sizeof(Op));
+        }
+        ops->ops[ops->len++] = op;
+}
+
+static void read_trace(Ops *ops, const char *path)
+{
+        FILE *fp = fopen(path, "r");
+        assert(fp);
+        char line[128];
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                Op op = { line[0], 0, 0, 0 };
+                if (sscanf(line + 1, "%" SCNu32 " %" SCNu32, &op.a,
+                           &op.b) < 1) {
+                        continue;
+                }
+                if (op.kind == 'g') {
+                        op.n = op.b;
+                        op.b = 0;
+                }
+                add_op(ops, op);
+        }
+        fclose(fp);
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+        return rng_state;
+}
+
+static uint32_t largest = 65536;
+
+/* a size in [lo, hi], log-uniformly */
+static uint32_t log_uniform(uint32_t lo, uint32_t hi)
+{
+        int bits = 0;
+        while ((hi >> bits) > lo) {
+                ++bits;
+        }
+        uint32_t top = lo << (rng() % (bits + 1));
+        top = top > hi ? hi : top;
+        return lo + rng() % (top - lo + 1);
+}
+
+static uint32_t some_size(const uint32_t *sizes, size_t n)
+{
+        if (n > 0) {
+                return sizes[rng() % n];
+        }
+        uint32_t pick = rng() % 100;
+        if (pick < 60) {
+                return rng() % 9;
+        }
+        if (pick < 90) {
+                return log_uniform(9, 64);
+        }
+        return pick < 99 ? log_uniform(65, 1024) : log_uniform(1025, largest);
+}
+
+/* ops random operations on about live segments, with ids as mapped */
+static void make_random(Ops *ops, uint64_t count, uint32_t live,
+                        const char *trace)
+{
+        uint32_t *sizes = NULL;
+        size_t nsizes = 0;
+        if (trace) {
+                Ops recorded = { NULL, 0, 0 };
+                read_trace(&recorded, trace);
+                sizes = CALLOC(recorded.len + 1, sizeof(uint32_t));
+                for (size_t i = 0; i < recorded.len; ++i) {
+                        if (recorded.ops[i].kind == 'm') {
+                                sizes[nsizes++] = recorded.ops[i].a;
+                        }
+                }
+                FREE(recorded.ops);
+        }
+
+        /* ids as the trace would number them: lowest free first */
+        seg_id *mapped = CALLOC(2 * (size_t)live + 2, sizeof(seg_id));
+        seg_id *free_ids = CALLOC(2 * (size_t)live + 2, sizeof(seg_id));
+        uint32_t nmapped = 0, nfree = 0, next_id = 1;
+
+        add_op(ops, (Op){ 'p', 1024, 0, 0 });
+        for (uint64_t i = 0; i < count; ++i) {
+                bool map = nmapped < live / 2 || (nmapped < 2 * live
+                           && rng() % 2 == 0);
+                if (nmapped == 0 || map) {
+                        seg_id id = nfree ? free_ids[--nfree] : next_id++;
+                        mapped[nmapped++] = id;
+                        add_op(ops, (Op){ 'm', some_size(sizes, nsizes), id,
+                                          0 });
+                } else {
+                        uint32_t k = rng() % nmapped;
+                        seg_id id = mapped[k];
+                        mapped[k] = mapped[--nmapped];
+                        free_ids[nfree++] = id;
+                        add_op(ops, (Op){ 'u', id, 0, 0 });
+                }
+                if (nmapped > 0) {
+                        add_op(ops, (Op){ 'g', mapped[rng() % nmapped], 0,
+                                          1 + rng() % 16 });
+                }
+                if (nmapped > 0 && rng() % 10000 == 0) {
+                        add_op(ops, (Op){ 'c', mapped[rng() % nmapped], 0,
+                                          0 });
+                }
+        }
+        FREE(mapped);
+        FREE(free_ids);
+        FREE(sizes);
+}
+
+/* segment 0 of size words, read from a file of zeros */
+static Segments_T new_segments(uint32_t size)
+{
+        FILE *program = tmpfile();
+        assert(program);
+        uint32_t zero = 0;
+        for (uint32_t i = 0; i < size; ++i) {
+                fwrite(&zero, sizeof(zero), 1, program);
+        }
+        rewind(program);
+        Segments_T segments = Segments_new();
+        Segments_read_program(segments, program);
+        fclose(program);
+        return segments;
+}
+
+static double now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* times of one kind of operation, in ns */
+typedef struct Samples {
+        const char *name;
+        double *times;
+        size_t len, cap;
+        uint64_t calls;
+} Samples;
+
+static void add_sample(Samples *s, double ns, uint64_t calls)
+{
+        if (s->times == NULL) {
+                s->cap = 1024;
+                s->times = ALLOC(s->cap * sizeof(double));
+        } else if (s->len == s->cap) {
+                s->cap *= 2;
+                RESIZE(s->times, s->cap * sizeof(double));
+        }
+        s->times[s->len++] = ns;
+        s->calls += calls;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+        double x = *(const double *)a, y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+static void report(Samples *s)
+{
+        if (s->len == 0) {
+                return;
+        }
+        qsort(s->times, s->len, sizeof(double), compare_doubles);
+        printf("  %-6s %10" PRIu64 "  p50 %8.1f ns  p99 %8.1f ns  "
+               "max %10.1f ns\n", s->name, s->calls, s->times[s->len / 2],
+               s->times[s->len * 99 / 100], s->times[s->len - 1]);
+        FREE(s->times);
+}
+
+static long peak_rss_kb(void)
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+}
+
+/* backend ids and sizes, indexed by the ids of the workload */
+typedef struct Table {
+        seg_id *ids;
+        uint32_t *sizes;
+        size_t cap;
+} Table;
+
+static void grow(Table *table, uint32_t id)
+{
+        if (id < table->cap) {
+                return;
+        }
+        size_t cap = table->cap ? table->cap : 1024;
+        while (cap <= id) {
+                cap *= 2;
+        }
+        seg_id *ids = CALLOC(cap, sizeof(seg_id));
+        uint32_t *sizes = CALLOC(cap, sizeof(uint32_t));
+        if (table->cap > 0) {
+                memcpy(ids, table->ids, table->cap * sizeof(seg_id));
+                memcpy(sizes, table->sizes, table->cap * sizeof(uint32_t));
+                FREE(table->ids);
+                FREE(table->sizes);
+        }
+        table->ids = ids;
+        table->sizes = sizes;
+        table->cap = cap;
+}
+
+static void run(Ops *ops)
+{
+        Samples maps = { "map", NULL, 0, 0, 0 };
+        Samples unmaps = { "unmap", NULL, 0, 0, 0 };
+        Samples copies = { "copy", NULL, 0, 0, 0 };
+        Samples gets = { "get", NULL, 0, 0, 0 };
+        Table table = { NULL, NULL, 0 };
+        grow(&table, 0);
+
+        long base_kb = peak_rss_kb();
+        assert(ops->len > 0 && ops->ops[0].kind == 'p');
+        Segments_T segments = new_segments(ops->ops[0].a);
+        table.sizes[0] = ops->ops[0].a;
+        uint64_t total = 0, touched = 0;
+        double start = now_ns();
+
+        for (size_t i = 1; i < ops->len; ++i) {
+                Op op = ops->ops[i];
+                double t0 = now_ns();
+                switch (op.kind) {
+                case 'm': {
+                        seg_id id = Segments_map(segments, op.a);
+                        add_sample(&maps, now_ns() - t0, 1);
+                        grow(&table, op.b);
+                        table.ids[op.b] = id;
+                        table.sizes[op.b] = op.a;
+                        break;
+                }
+                case 'u':
+                        Segments_unmap(segments, table.ids[op.a]);
+                        add_sample(&unmaps, now_ns() - t0, 1);
+                        break;
+                case 'c':
+                        Segments_copy(segments, table.ids[op.a],
+                                      table.ids[op.b]);
+                        add_sample(&copies, now_ns() - t0, 1);
+                        table.sizes[op.b] = table.sizes[op.a];
+                        break;
+                case 'g': {
+                        seg_id id = table.ids[op.a];
+                        uint32_t size = table.sizes[op.a];
+                        for (uint64_t k = 0; k < op.n; ++k) {
+                                uint32_t *mem = Segments_get_mem(segments,
+                                                                 id);
+                                if (size > 0) {
+                                        mem[touched % size] += 1;
+                                }
+                                ++touched;
+                        }
+                        add_sample(&gets, (now_ns() - t0) / op.n, op.n);
+                        total += op.n - 1;
+                        break;
+                }
+                default:
+                        continue;
+                }
+                ++total;
+        }
+        double seconds = (now_ns() - start) / 1e9;
+
+        printf("%s: %" PRIu64 " operations in %.3f s, %.0f ops/s, peak rss "
+               "%ld kB (%ld kB before the first segment)\n", BACKEND, total,
+               seconds, total / seconds, peak_rss_kb(), base_kb);
+        report(&maps);
+        report(&unmaps);
+        report(&copies);
+        report(&gets);
+        Segments_free(&segments);
+        FREE(table.ids);
+        FREE(table.sizes);
+}
+
+int main(int argc, char *argv[])
+{
+        uint32_t live = 10000;
+        int opt;
+        while ((opt = getopt(argc, argv, "s:l:L:")) != -1) {
+                if (opt == 's') {
+                        rng_state = strtoull(optarg, NULL, 0) | 1;
+                } else if (opt == 'l') {
+                        live = strtoul(optarg, NULL, 0);
+                } else if (opt == 'L') {
+                        largest = strtoul(optarg, NULL, 0);
+                } else {
+                        break;
+                }
+        }
+        Ops ops = { NULL, 0, 0 };
+        int args = argc - optind;
+        if (args == 2 && strcmp(argv[optind], "replay") == 0) {
+                read_trace(&ops, argv[optind + 1]);
+        } else if ((args == 2 || args == 3) && live > 0 && largest > 1024
+                   && strcmp(argv[optind], "random") == 0) {
+                make_random(&ops, strtoull(argv[optind + 1], NULL, 0), live,
+                            args == 3 ? argv[optind + 2] : NULL);
+        } else {
+                fprintf(stderr, "usage: %s replay trace\n"
+                        "       %s [-s seed] [-l live] [-L largest] random "
+                        "ops [trace]\n", argv[0], argv[0]);
+                return 1;
+        }
+        run(&ops);
+        FREE(ops.ops);
+        return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# compares the backends of segments.c: usage segcompare.sh [ops [trace ...]]
+#
+# Runs segbench, segbench-flat and segbench-pool on the same random
+# workloads (the default sizes, then with segments up to 4M words) and
+# on each trace recorded by um-trace, then times um-special, um-flat
+# and um-pool (user seconds) on midmark and sandmark. Needs make first.
+
+ops=${1:-2000000}
+[ $# -gt 0 ] && shift
+
+for bench in segbench segbench-flat segbench-pool
+do
+        echo "----------- $bench -----------"
+        ./$bench random $ops
+        ./$bench -l 200 -L 4194304 random $((ops / 10))
+        for trace in "$@"
+        do
+                ./$bench replay $trace
+        done
+done
+
+for um in um-special um-flat um-pool
+do
+        echo "----------- $um -----------"
+        for prog in midmark.um sandmark.umz
+        do
+                TIMEFORMAT="$prog %Us"
+                time ./$um umbin/$prog >/dev/null
+        done
+done
@@ -4,16 +4,32 @@
  *
  * Implementation of Segments ADT
  *
+ * The backend is chosen when this file is compiled, with no call
+ * through a pointer on the way to a segment:
+ *   (default)        segments.o: the table of segments by id, and the
+ *                    stack of unmapped ids, are Hanson Seq_Ts
+ *   -DSEGMENTS_FLAT  segments-flat.o: both are plain arrays, grown by
+ *                    doubling, so a lookup is one indexed load
+ *   -DSEGMENTS_POOL  segments-pool.o: Seq_Ts, but a segment of up to
+ *                    LARGE_SEGMENT words is malloc'd with room for a
+ *                    power of 2 words and, when released, kept in a
+ *                    pool of that size for the next map to reuse, up
+ *                    to POOL_WORDS in all, until Segments_compact
+ * The two flags may be given together.
  */
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <malloc.h>
 
 #include "mem.h"
 #include "assert.h"
+#include "reclaim.h"
 #include "segments.h"
 #include "seq.h"
 #include "bitpack.h"
@@ -21,37 +37,355 @@
 #define BITS 8
 #define MAX 32
 
+#define SMALL_SEGMENT 256       /* words; smaller segments share slabs */
+#define SLAB_BYTES (64 * 1024)
+#define REPACK_MAPS 1024        /* small maps between two repackings */
+#define TRIM_WORDS (64 * 1024)  /* freed words worth returning to the OS */
+#define LARGE_SEGMENT (64 * 1024)       /* words; larger ones are mapped */
+
+#define ABSENT UINT32_MAX       /* Segments_save's size of an unmapped id */
+
+#define CHUNK_BITS 8            /* a store dirties its 256-word chunk */
+#define WHOLE UINT32_MAX        /* the chunk of a segment replaced outright */
+
+#define POOL_CLASSES 17         /* pools of 2^0 to 2^16 word segments */
+#define POOL_WORDS (1 << 22)    /* words the pools may keep in all */
+
+/* what a segment counts against the limit: its words and bookkeeping */
+#define COST(size) ((uint64_t)(size) + 4)
+
+/*
+ * Segments_compact packs small segments, in id order, into slabs: one
+ * malloc'd block holding a count of the segments still in it, followed
+ * by the segments. The last one released frees the slab.
+ */
+typedef struct Slab {
+        uint32_t live;
+} *Slab;
+
+typedef struct Snapshot *Snapshot;
+
+/*
+ * the table of segments by id and the stack of unmapped ids, each a
+ * sequence of pointers (an unmapped id is stored as one)
+ */
+#ifdef SEGMENTS_FLAT
+typedef struct Table {
+        void **at;
+        uint32_t len, cap;
+} *Table;
+
+static inline Table table_new(void)
+{
+        Table table;
+        NEW(table);
+        table->len = 0;
+        table->cap = 16;
+        table->at = ALLOC(table->cap * sizeof(void *));
+        return table;
+}
+
+static inline void table_free(Table *table)
+{
+        FREE((*table)->at);
+        FREE(*table);
+}
+
+static inline uint32_t table_length(Table table)
+{
+        return table->len;
+}
+
+static inline void *table_get(Table table, uint32_t i)
+{
+        return table->at[i];
+}
+
+static inline void *table_put(Table table, uint32_t i, void *x)
+{
+        void *old = table->at[i];
+        table->at[i] = x;
+        return old;
+}
+
+static inline void table_addhi(Table table, void *x)
+{
+        if (table->len == table->cap) {
+                table->cap *= 2;
+                RESIZE(table->at, table->cap * sizeof(void *));
+        }
+        table->at[table->len++] = x;
+}
+
+static inline void *table_remhi(Table table)
+{
+        assert(table->len > 0);
+        return table->at[--table->len];
+}
+#else
+typedef Seq_T Table;
+#define table_new() Seq_new(0)
+#define table_free Seq_free
+#define table_length(table) ((uint32_t)Seq_length(table))
+#define table_get Seq_get
+#define table_put Seq_put
+#define table_addhi Seq_addhi
+#define table_remhi Seq_remhi
+#endif
+
 struct Segments_T {
-        Seq_T mapped;
-        Seq_T unmapped;
+        Table mapped;
+        Table unmapped;
         uint32_t next_id;
+        uint32_t released;      /* unmapped ids whose memory is freed, at
+                                   the low end of the unmapped stack */
+        uint32_t small_maps;    /* small segments mapped since repacking */
+        uint64_t live;          /* COST of every mapped segment */
+        uint64_t limit;         /* most live allowed after a map */
+        Snapshot snap;          /* NULL unless Segments_snapshot ran */
+        Reclaim_T reclaim;      /* NULL until a large segment is mapped */
+#ifdef SEGMENTS_POOL
+        struct Segment *pools[POOL_CLASSES];
+        uint64_t pooled;        /* words in the pools */
+#endif
 };
 
 typedef struct Segment {
+        Slab slab;              /* NULL if malloc'd by itself */
         uint32_t seg_size;
         uint32_t memory[];
 } *Segment;
 
 typedef uint32_t word;
 
-/* takes size of program binary in words and creates corresponding Segment */
-static inline Segment malloc_segment(uint32_t size)
+/*
+ * what Segments_snapshot saved: the fields of the Segments_T, a copy of
+ * every segment (NULL where the id was released) and of the unmapped
+ * stack. Every chunk written since is listed once in written, as its id
+ * in the high half and its chunk number (or WHOLE) in the low half; a
+ * bit per chunk, at dirty + first[id], says whether it is listed yet.
+ */
+struct Snapshot {
+        struct Segments_T fields;
+        uint32_t ids;
+        Segment *copies;
+        seg_id *unmapped;
+        uint32_t waiting;
+        uint64_t *dirty;
+        uint32_t *first;
+        bool *whole;
+        uint64_t *written;
+        uint32_t len, cap;
+};
+
+static void mark_whole(Segments_T segments, seg_id id);
+
+/* bytes a segment of size words takes, padded for the one after it */
+static inline size_t segment_bytes(uint32_t size)
+{
+        size_t bytes = offsetof(struct Segment, memory) + size * sizeof(word);
+        size_t align = sizeof(Slab);
+        return (bytes + align - 1) / align * align;
+}
+
+#ifdef SEGMENTS_POOL
+/* the pool of a segment of size words: room for 2^class words */
+static inline int pool_class(uint32_t size)
+{
+        return size <= 1 ? 0 : 32 - __builtin_clz(size - 1);
+}
+
+/* frees every pooled segment */
+static void drain_pools(Segments_T segments)
+{
+        for (int class = 0; class < POOL_CLASSES; ++class) {
+                while (segments->pools[class] != NULL) {
+                        Segment seg = segments->pools[class];
+                        segments->pools[class] = (Segment)seg->slab;
+                        free(seg);
+                }
+        }
+        segments->pooled = 0;
+}
+#endif
+
+/* 
+ * takes size of program binary in words and creates corresponding
+ * Segment; a large one comes from the reclaimer, already zero
+ */
+static inline Segment malloc_segment(Segments_T segments, uint32_t size)
 {
-        uint32_t seg_size = sizeof(uint32_t) + size * sizeof(word);
-        Segment new_seg = malloc(seg_size);
-        memset(new_seg->memory, 0, size * sizeof(word));
+        Segment new_seg;
+        if (size > LARGE_SEGMENT) {
+                if (segments->reclaim == NULL) {
+                        segments->reclaim = Reclaim_new();
+                }
+                new_seg = Reclaim_alloc(segments->reclaim,
+                                        segment_bytes(size));
+#ifdef SEGMENTS_POOL
+        } else if (segments->pools[pool_class(size)] != NULL) {
+                int class = pool_class(size);
+                new_seg = segments->pools[class];
+                segments->pools[class] = (Segment)new_seg->slab;
+                segments->pooled -= (uint32_t)1 << class;
+                memset(new_seg->memory, 0, size * sizeof(word));
+        } else {
+                new_seg = malloc(segment_bytes(1u << pool_class(size)));
+                assert(new_seg);
+                memset(new_seg->memory, 0, size * sizeof(word));
+#else
+        } else {
+                new_seg = malloc(segment_bytes(size));
+                assert(new_seg);
+                memset(new_seg->memory, 0, size * sizeof(word));
+#endif
+        }
+        new_seg->slab = NULL;
         new_seg->seg_size = size;
         return new_seg;
 }
 
+/* 
+ * frees a segment, or its slab once no other segment lives there; a
+ * large one goes back to the reclaimer, which frees it in its own time
+ */
+static inline void release_segment(Segments_T segments, Segment seg)
+{
+        if (seg == NULL) {
+                return;
+        }
+        if (seg->slab == NULL && seg->seg_size > LARGE_SEGMENT) {
+                Reclaim_release(segments->reclaim, seg,
+                                segment_bytes(seg->seg_size));
+#ifdef SEGMENTS_POOL
+        } else if (seg->slab == NULL
+                   && segments->pooled < POOL_WORDS) {
+                int class = pool_class(seg->seg_size);
+                seg->slab = (Slab)segments->pools[class];
+                segments->pools[class] = seg;
+                segments->pooled += (uint32_t)1 << class;
+#endif
+        } else if (seg->slab == NULL) {
+                free(seg);
+        } else if (--seg->slab->live == 0) {
+                free(seg->slab);
+        }
+}
+
+#ifdef SEGMENTS_TRACE
+/*
+ * built with -DSEGMENTS_TRACE (um-trace), every call of the interface is
+ * written as a line of text to the file named by the environment
+ * variable SEGMENTS_TRACE: "p size" when segment 0 is read in,
+ * "m size id", "u id", "c origin target", and "g id n" for n calls of
+ * Segments_get_mem on id in a row. It stops after TRACE_RECORDS lines.
+ * A program that unpacks itself first, like codex.umz, can be traced
+ * from where it starts instead: with SEGMENTS_TRACE_SKIP=n nothing is
+ * written until the nth copy into segment 0, and the trace then begins
+ * as if segment 0 and every segment mapped at that point were new.
+ */
+#define TRACE_RECORDS 5000000
+
+static FILE *trace;
+static uint64_t trace_records;
+static unsigned long skip_loads;  /* copies into segment 0 to let pass */
+static seg_id last_get;
+static uint64_t get_calls;      /* calls of Segments_get_mem on last_get */
+
+static void record(const char *fmt, ...);
+
+static void flush_gets(void)
+{
+        if (get_calls > 0) {
+                uint64_t n = get_calls;
+                get_calls = 0;
+                record("g %u %llu\n", last_get, (unsigned long long)n);
+        }
+}
+
+static void record(const char *fmt, ...)
+{
+        if (trace == NULL || skip_loads > 0) {
+                return;
+        }
+        flush_gets();
+        if (trace == NULL) {
+                return;
+        }
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(trace, fmt, args);
+        va_end(args);
+        if (++trace_records == TRACE_RECORDS) {
+                fclose(trace);
+                trace = NULL;
+        }
+}
+
+static inline void record_get(seg_id id)
+{
+        if (trace == NULL || skip_loads > 0) {
+                return;
+        }
+        if (get_calls > 0 && id != last_get) {
+                flush_gets();
+        }
+        last_get = id;
+        get_calls++;
+}
+
+/* begins a trace partway, with segment 0 and every segment mapped now */
+static void record_state(Segments_T segments)
+{
+        uint32_t ids = table_length(segments->mapped);
+        bool *unmapped = CALLOC(ids, sizeof(bool));
+        uint32_t waiting = table_length(segments->unmapped);
+        for (uint32_t i = 0; i < waiting; ++i) {
+                unmapped[(uintptr_t)table_get(segments->unmapped, i)] = true;
+        }
+        Segment seg = table_get(segments->mapped, 0);
+        record("p %u\n", seg->seg_size);
+        for (seg_id id = 1; id < ids; ++id) {
+                seg = table_get(segments->mapped, id);
+                if (!unmapped[id] && seg != NULL) {
+                        record("m %u %u\n", seg->seg_size, id);
+                }
+        }
+        FREE(unmapped);
+}
+#else
+#define record(...) ((void)0)
+#endif
+
 Segments_T Segments_new()
 {
+#ifdef SEGMENTS_TRACE
+        const char *path = getenv("SEGMENTS_TRACE");
+        if (trace == NULL && trace_records == 0 && path != NULL) {
+                trace = fopen(path, "w");
+                assert(trace);
+                const char *skip = getenv("SEGMENTS_TRACE_SKIP");
+                skip_loads = skip ? strtoul(skip, NULL, 0) : 0;
+        }
+#endif
         Segments_T new_segs;
         NEW(new_segs);
 
-        new_segs->mapped = Seq_new(0);
-        new_segs->unmapped = Seq_new(0);
+        new_segs->mapped = table_new();
+        new_segs->unmapped = table_new();
         new_segs->next_id = 0;
+        new_segs->released = 0;
+        new_segs->small_maps = 0;
+        new_segs->live = 0;
+        new_segs->limit = UINT64_MAX;
+        new_segs->snap = NULL;
+        new_segs->reclaim = NULL;
+#ifdef SEGMENTS_POOL
+        for (int class = 0; class < POOL_CLASSES; ++class) {
+                new_segs->pools[class] = NULL;
+        }
+        new_segs->pooled = 0;
+#endif
 
         return new_segs;
 }
@@ -68,7 +402,7 @@ void Segments_read_program(Segments_T segments, FILE *program)
         uint32_t prog_size = ftell(program) / sizeof(uint32_t);
         rewind(program);
 
-        Segment result = malloc_segment(prog_size);
+        Segment result = malloc_segment(segments, prog_size);
         
         for (unsigned i = 0; i < prog_size; i++) {
                 for (int j = 1; j <= 4; j++) {
@@ -77,24 +411,40 @@ void Segments_read_program(Segments_T segments, FILE *program)
                 }
         }
 
-        Seq_addhi(segments->mapped, result);
+        table_addhi(segments->mapped, result);
         segments->next_id = 1;
+        segments->live = COST(prog_size);
+        record("p %u\n", prog_size);
 }
 
 /*allocate a new segment of given size int bytes, return the new segment id*/
 seg_id Segments_map(Segments_T segments, uint32_t size)
 {
         assert(segments);
-        if (Seq_length(segments->unmapped) == 0) {
-                Seq_addhi(segments->mapped, malloc_segment(size));
+        if (segments->live + COST(size) > segments->limit) {
+                return SEGMENTS_FULL;
+        }
+        segments->live += COST(size);
+        if (size <= SMALL_SEGMENT) {
+                segments->small_maps++;
+        }
+        if (table_length(segments->unmapped) == 0) {
+                table_addhi(segments->mapped, malloc_segment(segments, size));
+                record("m %u %u\n", size, segments->next_id);
                 return (segments->next_id)++;
         }
 
-        seg_id new_id = (uintptr_t)(Seq_remhi(segments->unmapped));
-        Segment old_segment = Seq_get(segments->mapped, new_id);
+        seg_id new_id = (uintptr_t)(table_remhi(segments->unmapped));
+        Segment old_segment = table_get(segments->mapped, new_id);
+        uint32_t waiting = table_length(segments->unmapped);
+        if (segments->released > waiting) {
+                segments->released = waiting;
+        }
 
-        free(old_segment);
-        Seq_put(segments->mapped, new_id, malloc_segment(size));
+        mark_whole(segments, new_id);
+        release_segment(segments, old_segment);
+        table_put(segments->mapped, new_id, malloc_segment(segments, size));
+        record("m %u %u\n", size, new_id);
         return new_id;
 }
 
@@ -102,19 +452,64 @@ seg_id Segments_map(Segments_T segments, uint32_t size)
 void Segments_unmap(Segments_T segments, seg_id segment_id)
 {
         assert(segments);
-        Seq_addhi(segments->unmapped, (void *)(uintptr_t)segment_id);
+        Segment seg = table_get(segments->mapped, segment_id);
+        segments->live -= COST(seg->seg_size);
+        table_addhi(segments->unmapped, (void *)(uintptr_t)segment_id);
+        record("u %u\n", segment_id);
 }
 
 /* copies segment origin to target, replacing segment target */
 void Segments_copy(Segments_T segments, seg_id origin_id, seg_id target_id)
 {
         assert(segments);
-        free(Seq_get(segments->mapped, target_id));
-        Segment origin = Seq_get(segments->mapped, origin_id);
+        Segment target = table_get(segments->mapped, target_id);
+        segments->live -= COST(target->seg_size);
+        mark_whole(segments, target_id);
+        release_segment(segments, target);
+        Segment origin = table_get(segments->mapped, origin_id);
         uint32_t origin_size = origin->seg_size;
-        Segment copy = malloc_segment(origin_size);
+        segments->live += COST(origin_size);
+        Segment copy = malloc_segment(segments, origin_size);
         memcpy(copy->memory, origin->memory, origin_size * sizeof(word));
-        Seq_put(segments->mapped, target_id, copy);
+        table_put(segments->mapped, target_id, copy);
+#ifdef SEGMENTS_TRACE
+        if (target_id == 0 && skip_loads > 0 && --skip_loads == 0) {
+                record_state(segments);
+                return;
+        }
+#endif
+        record("c %u %u\n", origin_id, target_id);
+}
+
+void Segments_limit(Segments_T segments, uint64_t words)
+{
+        assert(segments);
+        segments->limit = words;
+}
+
+uint32_t Segments_ids(Segments_T segments)
+{
+        assert(segments);
+        return table_length(segments->mapped);
+}
+
+/* 
+ * unmapped ids keep their memory until they are mapped again or
+ * Segments_compact runs
+ */
+bool Segments_valid(Segments_T segments, seg_id segment_id)
+{
+        assert(segments);
+        return segment_id < table_length(segments->mapped)
+            && table_get(segments->mapped, segment_id) != NULL;
+}
+
+/*get the size in words of the segment of a given id*/
+uint32_t Segments_size(Segments_T segments, seg_id segment_id)
+{
+        assert(segments);
+        Segment target = table_get(segments->mapped, segment_id);
+        return target->seg_size;
 }
 
 /*get the memory of the segment of a given id*/
@@ -122,21 +517,370 @@ void *Segments_get_mem(Segments_T segments, seg_id segment_id)
 {
         assert(segments);
         assert(segment_id <= INT_MAX);
-        Segment target = Seq_get(segments->mapped, segment_id);
+#ifdef SEGMENTS_TRACE
+        record_get(segment_id);
+#endif
+        Segment target = table_get(segments->mapped, segment_id);
         return target->memory;
 }
 
+/* moves the segments with ids in ids[0..n) into one new slab */
+static void pack_slab(Segments_T segments, const seg_id *ids, uint32_t n,
+                      size_t bytes)
+{
+        /* the count is padded like an empty segment */
+        Slab slab = malloc(segment_bytes(0) + bytes);
+        assert(slab);
+        slab->live = n;
+        char *next = (char *)slab + segment_bytes(0);
+
+        for (uint32_t i = 0; i < n; ++i) {
+                Segment old = table_get(segments->mapped, ids[i]);
+                Segment moved = (Segment)next;
+                size_t size = segment_bytes(old->seg_size);
+                memcpy(moved, old, size);
+                moved->slab = slab;
+                next += size;
+                table_put(segments->mapped, ids[i], moved);
+                release_segment(segments, old);
+        }
+}
+
+/* packs every small mapped segment but segment 0 into slabs, in id order */
+static void repack(Segments_T segments)
+{
+        uint32_t len = table_length(segments->mapped);
+        seg_id *ids = CALLOC(len + 1, sizeof(seg_id));
+        uint32_t n = 0;
+        size_t bytes = 0;
+
+        for (seg_id id = 1; id < len; ++id) {
+                Segment seg = table_get(segments->mapped, id);
+                if (seg == NULL || seg->seg_size > SMALL_SEGMENT) {
+                        continue;
+                }
+                if (bytes + segment_bytes(seg->seg_size) > SLAB_BYTES) {
+                        pack_slab(segments, ids, n, bytes);
+                        n = 0;
+                        bytes = 0;
+                }
+                ids[n++] = id;
+                bytes += segment_bytes(seg->seg_size);
+        }
+        if (n > 0) {
+                pack_slab(segments, ids, n, bytes);
+        }
+        FREE(ids);
+}
+
+void Segments_compact(Segments_T segments)
+{
+        assert(segments);
+
+        /* nothing can read an unmapped segment before it is mapped again */
+        size_t freed = 0;
+        uint32_t waiting = table_length(segments->unmapped);
+        for (uint32_t i = segments->released; i < waiting; ++i) {
+                seg_id id = (uintptr_t)table_get(segments->unmapped, i);
+                mark_whole(segments, id);
+                Segment seg = table_put(segments->mapped, id, NULL);
+                freed += seg ? seg->seg_size : 0;
+                release_segment(segments, seg);
+        }
+        segments->released = waiting;
+#ifdef SEGMENTS_POOL
+        freed += segments->pooled;
+        drain_pools(segments);
+#endif
+
+        bool repacked = segments->small_maps >= REPACK_MAPS;
+        if (repacked) {
+                repack(segments);
+                segments->small_maps = 0;
+        }
+
+        /* free() keeps what it gets back for later mallocs */
+        if (repacked || freed >= TRIM_WORDS) {
+                malloc_trim(0);
+        }
+}
+
+void Segments_save(Segments_T segments, FILE *fp)
+{
+        assert(segments && fp);
+        uint32_t ids = segments->next_id;
+        uint32_t waiting = table_length(segments->unmapped);
+        bool *unmapped = CALLOC(ids + 1, sizeof(bool));
+        uint32_t header[2] = { ids, waiting };
+        fwrite(header, sizeof(word), 2, fp);
+        for (uint32_t i = 0; i < waiting; ++i) {
+                word id = (uintptr_t)table_get(segments->unmapped, i);
+                unmapped[id] = true;
+                fwrite(&id, sizeof(word), 1, fp);
+        }
+        for (seg_id id = 0; id < ids; ++id) {
+                Segment seg = table_get(segments->mapped, id);
+                word size = unmapped[id] ? ABSENT : seg->seg_size;
+                fwrite(&size, sizeof(word), 1, fp);
+                if (size != ABSENT) {
+                        fwrite(seg->memory, sizeof(word), size, fp);
+                }
+        }
+        FREE(unmapped);
+}
+
+Segments_T Segments_load(const uint32_t *words, size_t len)
+{
+        assert(words);
+        if (len < 2 || words[1] > len - 2 || words[0] == 0) {
+                return NULL;
+        }
+        uint32_t ids = words[0], waiting = words[1];
+        const uint32_t *stack = words + 2;
+        size_t at = 2 + (size_t)waiting;
+
+        Segments_T segments = Segments_new();
+        uint32_t absent = 0;
+        for (seg_id id = 0; id < ids && at < len; ++id) {
+                uint32_t size = words[at++];
+                Segment seg = NULL;
+                if (size == ABSENT) {
+                        absent++;
+                } else if (size <= len - at) {
+                        seg = malloc_segment(segments, size);
+                        memcpy(seg->memory, words + at, size * sizeof(word));
+                        at += size;
+                        segments->live += COST(size);
+                } else {
+                        break;
+                }
+                table_addhi(segments->mapped, seg);
+        }
+        segments->next_id = table_length(segments->mapped);
+
+        /* every unmapped id, and only those, must have been left out */
+        bool good = at == len && segments->next_id == ids && absent == waiting
+                    && table_get(segments->mapped, 0) != NULL;
+        for (uint32_t i = 0; good && i < waiting; ++i) {
+                good = stack[i] < ids
+                       && table_get(segments->mapped, stack[i]) == NULL;
+                table_addhi(segments->unmapped, (void *)(uintptr_t)stack[i]);
+        }
+        if (!good) {
+                Segments_free(&segments);
+                return NULL;
+        }
+        segments->released = waiting;
+        return segments;
+}
+
+/* a copy of seg, by itself, or NULL */
+static Segment copy_segment(Segments_T segments, Segment seg)
+{
+        if (seg == NULL) {
+                return NULL;
+        }
+        Segment copy = malloc_segment(segments, seg->seg_size);
+        memcpy(copy->memory, seg->memory, seg->seg_size * sizeof(word));
+        return copy;
+}
+
+static void free_snapshot(Segments_T segments, Snapshot snap)
+{
+        for (uint32_t id = 0; id < snap->ids; ++id) {
+                release_segment(segments, snap->copies[id]);
+        }
+        FREE(snap->copies);
+        FREE(snap->unmapped);
+        FREE(snap->dirty);
+        FREE(snap->first);
+        FREE(snap->whole);
+        FREE(snap->written);
+        FREE(snap);
+}
+
+static inline void add_written(Snapshot snap, seg_id id, uint32_t chunk)
+{
+        if (snap->len == snap->cap) {
+                snap->cap *= 2;
+                RESIZE(snap->written, snap->cap * sizeof(uint64_t));
+        }
+        snap->written[snap->len++] = (uint64_t)id << 32 | chunk;
+}
+
+/* notes that id now holds a different segment than it was saved with */
+static void mark_whole(Segments_T segments, seg_id id)
+{
+        Snapshot snap = segments->snap;
+        if (snap == NULL || id >= snap->ids || snap->whole[id]) {
+                return;
+        }
+        snap->whole[id] = true;
+        add_written(snap, id, WHOLE);
+}
+
+void Segments_snapshot(Segments_T segments)
+{
+        assert(segments);
+        if (segments->snap != NULL) {
+                free_snapshot(segments, segments->snap);
+        }
+        Snapshot snap;
+        NEW(snap);
+        snap->fields = *segments;
+        snap->ids = table_length(segments->mapped);
+        snap->copies = CALLOC(snap->ids + 1, sizeof(Segment));
+        snap->first = CALLOC(snap->ids + 1, sizeof(uint32_t));
+        snap->whole = CALLOC(snap->ids + 1, sizeof(bool));
+
+        uint32_t bitmap_words = 0;
+        for (seg_id id = 0; id < snap->ids; ++id) {
+                Segment seg = table_get(segments->mapped, id);
+                snap->copies[id] = copy_segment(segments, seg);
+                snap->first[id] = bitmap_words;
+                if (seg != NULL) {
+                        uint32_t chunks = (seg->seg_size >> CHUNK_BITS) + 1;
+                        bitmap_words += (chunks + 63) / 64;
+                }
+        }
+        snap->dirty = CALLOC(bitmap_words + 1, sizeof(uint64_t));
+
+        uint32_t waiting = table_length(segments->unmapped);
+        snap->waiting = waiting;
+        snap->unmapped = CALLOC(waiting + 1, sizeof(seg_id));
+        for (uint32_t i = 0; i < waiting; ++i) {
+                snap->unmapped[i] = (uintptr_t)table_get(segments->unmapped, i);
+        }
+
+        snap->cap = 64;
+        snap->len = 0;
+        snap->written = ALLOC(snap->cap * sizeof(uint64_t));
+        segments->snap = snap;
+}
+
+void Segments_touch(Segments_T segments, seg_id id, uint32_t lo, uint32_t hi)
+{
+        assert(segments);
+        Snapshot snap = segments->snap;
+        if (snap == NULL || id >= snap->ids || snap->whole[id]
+            || snap->copies[id] == NULL) {
+                return;
+        }
+        /* a store past the saved size went to a segment mapped since */
+        uint32_t size = snap->copies[id]->seg_size;
+        hi = hi < size ? hi : size;
+        uint64_t *bits = snap->dirty + snap->first[id];
+        for (uint32_t chunk = lo >> CHUNK_BITS; lo < hi 
+             && chunk <= (hi - 1) >> CHUNK_BITS; ++chunk) {
+                uint64_t bit = (uint64_t)1 << (chunk % 64);
+                if ((bits[chunk / 64] & bit) == 0) {
+                        bits[chunk / 64] |= bit;
+                        add_written(snap, id, chunk);
+                }
+        }
+}
+
+void Segments_restore(Segments_T segments,
+                      void apply(seg_id id, uint32_t lo, uint32_t hi, 
+                                 void *cl),
+                      void *cl)
+{
+        assert(segments && segments->snap);
+        Snapshot snap = segments->snap;
+
+        /* ids mapped since go */
+        while (table_length(segments->mapped) > snap->ids) {
+                release_segment(segments, table_remhi(segments->mapped));
+        }
+
+        /* segments replaced since are copied back whole first, */
+        for (uint32_t i = 0; i < snap->len; ++i) {
+                seg_id id = snap->written[i] >> 32;
+                if ((uint32_t)snap->written[i] != WHOLE) {
+                        continue;
+                }
+                Segment saved = snap->copies[id];
+                release_segment(segments,
+                                table_put(segments->mapped, id,
+                                        copy_segment(segments, saved)));
+                snap->whole[id] = false;
+                if (apply && saved) {
+                        apply(id, 0, saved->seg_size, cl);
+                }
+        }
+
+        /* then the chunks written in the others */
+        for (uint32_t i = 0; i < snap->len; ++i) {
+                seg_id id = snap->written[i] >> 32;
+                uint32_t chunk = snap->written[i];
+                if (chunk == WHOLE) {
+                        continue;
+                }
+                snap->dirty[snap->first[id] + chunk / 64] = 0;
+                Segment saved = snap->copies[id];
+                Segment seg = table_get(segments->mapped, id);
+                uint32_t lo = chunk << CHUNK_BITS;
+                uint32_t hi = lo + (1 << CHUNK_BITS);
+                hi = hi < saved->seg_size ? hi : saved->seg_size;
+
+                /* only the words that differ, often none */
+                while (lo < hi && seg->memory[lo] == saved->memory[lo]) {
+                        ++lo;
+                }
+                while (lo < hi 
+                       && seg->memory[hi - 1] == saved->memory[hi - 1]) {
+                        --hi;
+                }
+                if (lo == hi) {
+                        continue;
+                }
+                memcpy(seg->memory + lo, saved->memory + lo, 
+                       (hi - lo) * sizeof(word));
+                if (apply) {
+                        apply(id, lo, hi, cl);
+                }
+        }
+        snap->len = 0;
+
+        while (table_length(segments->unmapped) > 0) {
+                table_remhi(segments->unmapped);
+        }
+        for (uint32_t i = 0; i < snap->waiting; ++i) {
+                table_addhi(segments->unmapped, 
+                          (void *)(uintptr_t)snap->unmapped[i]);
+        }
+        segments->next_id = snap->fields.next_id;
+        segments->released = snap->fields.released;
+        segments->small_maps = snap->fields.small_maps;
+        segments->live = snap->fields.live;
+}
+
 /*free a Segments_T struct*/
 void Segments_free(Segments_T *to_free)
 {
         assert(to_free && *to_free);
-        Seq_T mapped_del = (*to_free)->mapped;
-        uint32_t mapped_len = Seq_length(mapped_del);
+        if ((*to_free)->snap != NULL) {
+                free_snapshot(*to_free, (*to_free)->snap);
+        }
+#ifdef SEGMENTS_TRACE
+        if (trace != NULL) {
+                flush_gets();
+                fflush(trace);
+        }
+#endif
+        Table mapped_del = (*to_free)->mapped;
+        uint32_t mapped_len = table_length(mapped_del);
         for (uint32_t i = 0; i < mapped_len; ++i) {
-                free(Seq_remhi(mapped_del));
+                release_segment(*to_free, table_remhi(mapped_del));
+        }
+        if ((*to_free)->reclaim != NULL) {
+                Reclaim_free(&(*to_free)->reclaim);
         }
-        Seq_free(&mapped_del);
-        Seq_free(&((*to_free)->unmapped));
+#ifdef SEGMENTS_POOL
+        drain_pools(*to_free);
+#endif
+        table_free(&mapped_del);
+        table_free(&((*to_free)->unmapped));
         FREE(*to_free);
 }
 
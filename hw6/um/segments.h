@@ -9,6 +9,7 @@
 #ifndef SEGMENTS_H_
 #define SEGMENTS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -24,6 +25,9 @@ Segments_T Segments_new();
 /* reads program into segment 0 of Segments_T */
 void Segments_read_program(Segments_T segments, FILE *program);
 
+/* the id Segments_map returns when a new segment would pass the limit */
+#define SEGMENTS_FULL 0
+
 /*allocate a new segment of given size, return the new segment id*/
 seg_id Segments_map(Segments_T segments, uint32_t size);
 
@@ -33,9 +37,60 @@ void Segments_unmap(Segments_T segments, seg_id segment_id);
 /* copies segment origin to target, replacing segment target */
 void Segments_copy(Segments_T segments, seg_id origin, seg_id target);
 
+/* 
+ * limits the words of the mapped segments, plus 4 per segment for
+ * bookkeeping, that a Segments_map may leave mapped (none by default);
+ * segment 0 counts, and a copy into it is never refused, so the limit
+ * can be passed by at most the size of one segment
+ */
+void Segments_limit(Segments_T segments, uint64_t words);
+
+/* how many ids have been handed out, counting segment 0 */
+uint32_t Segments_ids(Segments_T segments);
+
+/* whether segment_id has been mapped, though it may be unmapped since */
+bool Segments_valid(Segments_T segments, seg_id segment_id);
+
+/*get the size in words of the segment of a given id*/
+uint32_t Segments_size(Segments_T segments, seg_id segment_id);
+
 /*get the memory of the segment of a given id*/
 void *Segments_get_mem(Segments_T segments, seg_id segment_id);
 
+/* 
+ * frees the memory of unmapped segments and, once enough small segments
+ * have been mapped since the last time, copies the small ones into
+ * shared slabs in id order; ids and contents stay the same, but pointers
+ * from Segments_get_mem are no longer valid
+ */
+void Segments_compact(Segments_T segments);
+
+/* 
+ * Segments_snapshot saves a copy of every segment; from then on
+ * Segments_restore puts them back as they were, copying only the
+ * 256-word chunks that changed: those given to Segments_touch, which
+ * must hear of every store, and segments mapped, copied or compacted
+ * over. apply, if not NULL, is called with the range [lo, hi) of every
+ * segment restored
+ */
+void Segments_snapshot(Segments_T segments);
+void Segments_touch(Segments_T segments, seg_id id, uint32_t lo, 
+                    uint32_t hi);
+void Segments_restore(Segments_T segments,
+                      void apply(seg_id id, uint32_t lo, uint32_t hi, 
+                                 void *cl),
+                      void *cl);
+
+/* 
+ * Segments_save writes every id, its size and its words in host byte
+ * order, and the unmapped ids in the order they will be reused; given
+ * those len words, Segments_load makes the same segments again, with
+ * unmapped ids already compacted, or returns NULL if they are not what
+ * Segments_save writes
+ */
+void Segments_save(Segments_T segments, FILE *fp);
+Segments_T Segments_load(const uint32_t *words, size_t len);
+
 /*free a Segments_T struct*/
 void Segments_free(Segments_T* to_free);
 
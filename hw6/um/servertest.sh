@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# tests umserver with umload: usage servertest.sh [bytes]
+#
+# Runs a umserver on cat.um and has umload -e send one session up to
+# bytes (default 4MB) without reading, half-close it while its echo is
+# backed up and read nothing for a second: the server must stay idle
+# over that second, and then send the whole echo back. Needs make first.
+
+bytes=${1:-4194304}
+sock=${TMPDIR:-/tmp}/servertest.$$
+
+./umserver -t 1 $sock umbin/cat.um &
+server=$!
+sleep 1
+
+status=0
+out=`./umload -e $bytes -p $server $sock` || status=1
+echo "$out"
+ticks=`echo "$out" | sed -n 's/^server used \([0-9]*\) ticks.*/\1/p'`
+if [ -z "$ticks" ] || [ $ticks -gt 10 ]; then
+        echo "servertest: the server was not idle after the half-close" >&2
+        status=1
+fi
+
+kill $server
+rm -f $sock
+exit $status
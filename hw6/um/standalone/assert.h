@@ -0,0 +1,32 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * assert.h
+ *
+ * The standalone build's stand-in for Hanson's assert: a failed
+ * assertion prints what CII's uncaught Assert_Failed prints and aborts.
+ * Like CII's, it is not turned off by NDEBUG
+ *
+ */
+
+#undef assert
+
+#ifndef STANDALONE_ASSERT_INCLUDED
+#define STANDALONE_ASSERT_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline void Assert_fail(const char *file, int line)
+{
+        fprintf(stderr, "Uncaught exception Assertion failed raised at "
+                "%s:%d\naborting...\n", file, line);
+        fflush(stderr);
+        abort();
+}
+
+#endif
+
+#define assert(e) ((void)(__builtin_expect(!!(e), 1) \
+                          || (Assert_fail(__FILE__, __LINE__), 0)))
@@ -0,0 +1,86 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * bitpack.h
+ *
+ * The standalone build's Bitpack, all static inline: every call in the
+ * UM passes a constant width and lsb (the opcode's 4 bits at 28, the
+ * registers' 3 bits at 6, 3 and 0, a LOADV's 25-bit value), so each
+ * one compiles to a shift and a mask, where the library's is a call.
+ * A value that does not fit in Bitpack_newu or Bitpack_news is an
+ * assertion failure, in place of CII's Bitpack_Overflow
+ *
+ */
+
+#ifndef BITPACK_INCLUDED
+#define BITPACK_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "assert.h"
+
+/* a mask of the low width bits, width <= 64 */
+static inline uint64_t Bitpack_mask(unsigned width)
+{
+        return width >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+}
+
+static inline bool Bitpack_fitsu(uint64_t n, unsigned width)
+{
+        assert(width <= 64);
+        return (n & ~Bitpack_mask(width)) == 0;
+}
+
+static inline bool Bitpack_fitss(int64_t n, unsigned width)
+{
+        assert(width <= 64);
+        if (width == 0) {
+                return n == 0;
+        }
+        int64_t lo = width >= 64 ? INT64_MIN : -((int64_t)1 << (width - 1));
+        int64_t hi = width >= 64 ? INT64_MAX : ((int64_t)1 << (width - 1)) - 1;
+        return n >= lo && n <= hi;
+}
+
+static inline uint64_t Bitpack_getu(uint64_t word, unsigned width,
+                                    unsigned lsb)
+{
+        assert(width + lsb <= 64);
+        return width == 0 ? 0 : (word >> lsb) & Bitpack_mask(width);
+}
+
+static inline int64_t Bitpack_gets(uint64_t word, unsigned width,
+                                   unsigned lsb)
+{
+        assert(width + lsb <= 64);
+        if (width == 0) {
+                return 0;
+        }
+        uint64_t field = Bitpack_getu(word, width, lsb);
+        uint64_t sign = (uint64_t)1 << (width - 1);
+        return (int64_t)((field ^ sign) - sign);
+}
+
+static inline uint64_t Bitpack_newu(uint64_t word, unsigned width,
+                                    unsigned lsb, uint64_t value)
+{
+        assert(width + lsb <= 64);
+        assert(Bitpack_fitsu(value, width));
+        if (width == 0) {
+                return word;
+        }
+        uint64_t mask = Bitpack_mask(width) << lsb;
+        return (word & ~mask) | (value << lsb);
+}
+
+static inline uint64_t Bitpack_news(uint64_t word, unsigned width,
+                                    unsigned lsb, int64_t value)
+{
+        assert(Bitpack_fitss(value, width));
+        return Bitpack_newu(word, width, lsb,
+                            (uint64_t)value & Bitpack_mask(width));
+}
+
+#endif
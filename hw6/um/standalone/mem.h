@@ -0,0 +1,71 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * mem.h
+ *
+ * The standalone build's stand-in for Hanson's Mem interface: the same
+ * macros, checked the same way, over malloc, calloc, realloc and free;
+ * running out of memory prints what CII's uncaught Mem_Failed prints
+ * and aborts
+ *
+ */
+
+#ifndef MEM_INCLUDED
+#define MEM_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "assert.h"
+
+static inline void Mem_failed(const char *file, int line)
+{
+        fprintf(stderr, "Uncaught exception Allocation Failed raised at "
+                "%s:%d\naborting...\n", file, line);
+        fflush(stderr);
+        abort();
+}
+
+static inline void *Mem_alloc(long nbytes, const char *file, int line)
+{
+        assert(nbytes > 0);
+        void *ptr = malloc(nbytes);
+        if (ptr == NULL) {
+                Mem_failed(file, line);
+        }
+        return ptr;
+}
+
+static inline void *Mem_calloc(long count, long nbytes, const char *file,
+                               int line)
+{
+        assert(count > 0 && nbytes > 0);
+        void *ptr = calloc(count, nbytes);
+        if (ptr == NULL) {
+                Mem_failed(file, line);
+        }
+        return ptr;
+}
+
+static inline void *Mem_resize(void *ptr, long nbytes, const char *file,
+                               int line)
+{
+        assert(ptr && nbytes > 0);
+        ptr = realloc(ptr, nbytes);
+        if (ptr == NULL) {
+                Mem_failed(file, line);
+        }
+        return ptr;
+}
+
+#define ALLOC(nbytes) Mem_alloc((nbytes), __FILE__, __LINE__)
+#define CALLOC(count, nbytes) Mem_calloc((count), (nbytes), __FILE__, \
+                                         __LINE__)
+#define NEW(p) ((p) = ALLOC((long)sizeof *(p)))
+#define NEW0(p) ((p) = CALLOC(1, (long)sizeof *(p)))
+#define FREE(ptr) ((void)(free(ptr), (ptr) = 0))
+#define RESIZE(ptr, nbytes) ((ptr) = Mem_resize((ptr), (nbytes), \
+                                                 __FILE__, __LINE__))
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * seq.h
+ *
+ * The standalone build's stand-in for Hanson's Seq interface, all of
+ * it static inline so that Seq_get and Seq_length, which the segment
+ * table calls on every instruction that touches memory, compile to a
+ * few loads: a ring of pointers whose size is a power of 2, grown by
+ * doubling, so an index is masked rather than divided
+ *
+ */
+
+#ifndef SEQ_INCLUDED
+#define SEQ_INCLUDED
+
+#include <string.h>
+
+#include "assert.h"
+#include "mem.h"
+
+typedef struct Seq_T {
+        int length;
+        int head;               /* index of element 0 in array */
+        int size;               /* a power of 2 */
+        void **array;
+} *Seq_T;
+
+static inline Seq_T Seq_new(int hint)
+{
+        assert(hint >= 0);
+        Seq_T seq;
+        NEW(seq);
+        seq->size = 16;
+        while (seq->size < hint) {
+                seq->size *= 2;
+        }
+        seq->array = ALLOC(seq->size * (long)sizeof(void *));
+        seq->length = 0;
+        seq->head = 0;
+        return seq;
+}
+
+static inline void Seq_free(Seq_T *seq)
+{
+        assert(seq && *seq);
+        FREE((*seq)->array);
+        FREE(*seq);
+}
+
+static inline int Seq_length(Seq_T seq)
+{
+        assert(seq);
+        return seq->length;
+}
+
+static inline void **Seq_at(Seq_T seq, int i)
+{
+        return &seq->array[(seq->head + i) & (seq->size - 1)];
+}
+
+static inline void *Seq_get(Seq_T seq, int i)
+{
+        assert(seq);
+        assert(i >= 0 && i < seq->length);
+        return *Seq_at(seq, i);
+}
+
+static inline void *Seq_put(Seq_T seq, int i, void *x)
+{
+        assert(seq);
+        assert(i >= 0 && i < seq->length);
+        void **slot = Seq_at(seq, i);
+        void *prev = *slot;
+        *slot = x;
+        return prev;
+}
+
+/* doubles the ring, unwrapping it so element 0 is at the start */
+static inline void Seq_expand(Seq_T seq)
+{
+        void **array = ALLOC(2 * seq->size * (long)sizeof(void *));
+        int first = seq->size - seq->head;
+        memcpy(array, seq->array + seq->head, first * sizeof(void *));
+        memcpy(array + first, seq->array, seq->head * sizeof(void *));
+        FREE(seq->array);
+        seq->array = array;
+        seq->head = 0;
+        seq->size *= 2;
+}
+
+static inline void *Seq_addhi(Seq_T seq, void *x)
+{
+        assert(seq);
+        if (seq->length == seq->size) {
+                Seq_expand(seq);
+        }
+        *Seq_at(seq, seq->length++) = x;
+        return x;
+}
+
+static inline void *Seq_addlo(Seq_T seq, void *x)
+{
+        assert(seq);
+        if (seq->length == seq->size) {
+                Seq_expand(seq);
+        }
+        seq->head = (seq->head - 1) & (seq->size - 1);
+        seq->length++;
+        *Seq_at(seq, 0) = x;
+        return x;
+}
+
+static inline void *Seq_remhi(Seq_T seq)
+{
+        assert(seq);
+        assert(seq->length > 0);
+        return *Seq_at(seq, --seq->length);
+}
+
+static inline void *Seq_remlo(Seq_T seq)
+{
+        assert(seq);
+        assert(seq->length > 0);
+        void *x = *Seq_at(seq, 0);
+        seq->head = (seq->head + 1) & (seq->size - 1);
+        seq->length--;
+        return x;
+}
+
+#endif
@@ -8,12 +8,19 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef UM_BACKGROUND
+#include <pthread.h>
+#endif
 
 #include "um.h"
 #include "mem.h"
 #include "assert.h"
 #include "segments.h"
+#include "idioms.h"
 #include "bitpack.h"
+#include "seq.h"
 
 typedef enum Um_register { r0 = 0, r1, r2, r3, r4, r5, r6, r7 } Um_register;
 
@@ -30,12 +37,184 @@ typedef enum Um_opcode {
 
 #define NUM_REGS 8
 
+/* 
+ * one instruction of segment 0 with its fields already extracted;
+ * decoded is false until the word is first executed, so zeroed memory
+ * is an empty cache and pages of words that never run are never touched
+ */
+typedef struct Instr_regs {
+        Um_register ra, rb, rc;
+}Instr_regs;
+
+typedef struct Decoded_instr {
+        bool decoded;
+        Um_opcode op;
+        Instr_regs regs;
+        uint32_t val;
+} Decoded_instr;
+
+#ifdef UM_SPECIALIZED
+/* 
+ * with -DUM_SPECIALIZED the cache holds a handler specialized for the
+ * instruction's opcode and registers, plus the value if it is a LV
+ */
+typedef struct Cached_instr {
+        bool (*run)(Um machine, uint32_t val);
+        uint32_t val;
+#ifdef UM_RECORD
+        uint32_t word;          /* in what was padding, for the log */
+#endif
+} Cached_instr;
+#else
+typedef Decoded_instr Cached_instr;
+#endif
+
+/* 
+ * the segment TLB: the memory of the last few segments SLOAD and SSTORE
+ * used, by the low bits of the id. An empty entry holds the id ~slot,
+ * whose low bits are never slot's, so it cannot match
+ */
+#define TLB_ENTRIES 64
+
+typedef struct Tlb_entry {
+        seg_id id;
+        word *mem;
+#ifdef UM_FUZZ
+        uint32_t size;          /* words, or 0 if id has no memory */
+#endif
+} Tlb_entry;
+
+#ifdef UM_ACCESS
+/* every SLOAD and SSTORE is sampled, so loops are not run in bulk */
+#define BULK_LOOPS false
+#else
+#define BULK_LOOPS true
+#endif
+
+#ifdef UM_PROFILE
+/* 
+ * calls deeper than CALL_FRAMES are not followed; a return is looked
+ * for in the UNWIND_FRAMES innermost calls, so a jump out of a few calls
+ * at once, as to an error handler, still unwinds them
+ */
+#define CALL_FRAMES 1024
+#define UNWIND_FRAMES 8
+#endif
+
+#ifdef UM_BACKGROUND
+#ifndef UM_SPECIALIZED
+#error "-DUM_BACKGROUND needs -DUM_SPECIALIZED"
+#endif
+/* 
+ * a segment 0 of BACKGROUND_WORDS or more gets its cache built by a
+ * compiler thread, FILL_WORDS entries at a time, while the machine runs
+ * it a word at a time, decoding each. A LOADP target reached HOT_RUNS
+ * times (in HEAT_SLOTS counters, by its low bits) is sent to the thread
+ * with its words, up to HOT_WORDS of them through the next LOADP or
+ * HALT, and specialized ahead of the rest; HOT_QUEUE blocks may wait
+ */
+#define BACKGROUND_WORDS (1 << 16)
+#define FILL_WORDS (1 << 16)
+#define HOT_RUNS 8
+#define HEAT_SLOTS 4096
+#define HOT_WORDS 64
+#define HOT_QUEUE 256
+
+typedef struct Hot_block {
+        uint32_t at, len;
+        uint32_t words[HOT_WORDS];
+} Hot_block;
+
+/* 
+ * the machine writes head and the blocks before it, the thread tail,
+ * decoded and the hot words until it sets ready; after that the machine
+ * owns it all
+ */
+typedef struct Compile_job {
+        pthread_t thread;
+        uint32_t len;                   /* of segment 0 */
+        Cached_instr *decoded;          /* the cache being built */
+        uint32_t *hot;                  /* offset, word pairs specialized */
+        uint32_t nhot, hot_cap;
+        uint32_t ready, cancel;
+        uint32_t head, tail;
+        Hot_block queue[HOT_QUEUE];
+        uint8_t heat[HEAT_SLOTS];       /* the machine's alone */
+} Compile_job;
+
+/* the cache is NULL from a reset until the job building it is done */
+#define CACHE_READY(machine) ((machine)->decoded != NULL)
+#else
+#define CACHE_READY(machine) true
+#endif
+
+#ifdef UM_RECORD
+#ifndef UM_SPECIALIZED
+#error "-DUM_RECORD needs -DUM_SPECIALIZED"
+#endif
+/* where in its word each op names the register a Um_step keeps */
+static const uint8_t RECORDED_SHIFT[16] = {
+        [CMOV] = 6, [SLOAD] = 6, [ADD] = 6, [MUL] = 6, [DIV] = 6,
+        [NAND] = 6, [MAP] = 3, [LOADP] = 3, [LV] = 25
+};
+#endif
+
 struct Um {
                 Segments_T segments;
                 reg_val registers[NUM_REGS];
                 reg_val pc;
+                Cached_instr *decoded;  /* cache parallel to segment 0 */
+                uint64_t *ran;          /* a bit per word of segment 0 run
+                                           since it was last stored to */
+                uint32_t program_len;
+                Um_io io;
+                Um_status status;       /* UM_HALTED until an instruction
+                                           stops the machine early */
+                bool stepping;          /* run_next: no bulk loops */
+                Seq_T loops;            /* Loop_T found in segment 0 */
+                uint64_t executed;      /* instructions, up to entry */
+                uint32_t entry;         /* where straight-line code began */
+                uint64_t budget;        /* executed that stops a LOADP */
+                bool unpack_stop;       /* Um_stop_at_unpack, until IN or
+                                           OUT runs */
+                Tlb_entry tlb[TLB_ENTRIES];     /* forgotten by MAP, UNMAP,
+                                                   LOADP and compacting */
+#ifdef UM_FUZZ
+                reg_val saved_registers[NUM_REGS];      /* by Um_snapshot */
+                reg_val saved_pc;
+                uint64_t saved_executed;
+                uint8_t *edges;         /* LOADP edge counts, or NULL */
+                uint32_t edge_mask;
+#endif
+#ifdef UM_ACCESS
+                Um_ring *ring;          /* sampled accesses, or NULL */
+                uint64_t accesses;      /* SLOADs and SSTOREs so far */
+                uint64_t period_mask;
+                uint32_t burst;
+                uint32_t tlb_hit;       /* UM_ACCESS_TLB_HIT if the last
+                                           access hit, or 0 */
+#endif
+#ifdef UM_PROFILE
+                uint32_t calls[CALL_FRAMES];    /* return addresses */
+                uint32_t depth;         /* calls open, up to CALL_FRAMES */
+#endif
+#ifdef UM_RECORD
+                Um_log *log;            /* steps run, or NULL */
+#endif
+#ifdef UM_BACKGROUND
+                Compile_job *job;       /* building the cache, which is
+                                           NULL until it is installed */
+#endif
 };
 
+/* 
+ * what the cache entry of a LOADP that jumps back knows in its val: not
+ * analyzed yet, not a copy or fill loop, or loops index + LOOP_INDEX
+ */
+#define UNANALYZED 0
+#define NOT_A_LOOP 1
+#define LOOP_INDEX 2
+
 #define OPSIZE 4
 #define INSTR_SIZE 32
 #define REGSIZE 3
@@ -47,10 +226,6 @@ static void set_reg(Um machine, Um_register r, word val);
 static Um_instruction get_next_instr(Um machine);
 static void set_pc(Um machine, uint32_t val);
 
-typedef struct Instr_regs {
-        Um_register ra, rb, rc;
-}Instr_regs;
-
 static void conditional_move(Um machine, Instr_regs regs);
 static void segmented_load(Um machine, Instr_regs regs);
 static void segmented_store(Um machine, Instr_regs regs);
@@ -66,6 +241,9 @@ static void input(Um machine, Instr_regs regs);
 static void load_program(Um machine, Instr_regs regs);
 static void load_value(Um machine, Um_register ra, uint32_t val);
 
+static int stdio_get(void *cl);
+static void stdio_put(int c, void *cl);
+
 typedef void (*gen_instr) (Um, Instr_regs);
 
 const gen_instr INSTRUCTIONS[] = {
@@ -85,8 +263,56 @@ const gen_instr INSTRUCTIONS[] = {
 };
 
 
+/* extracts opcode and operands of an instruction word */
+static Decoded_instr decode(Um_instruction to_run);
+
 /* switch statement to judge what instr it is */
-static bool run_instr(Um machine, Um_instruction to_run);
+static bool run_instr(Um machine, Decoded_instr instr);
+
+/* resets the decoded cache after segment 0 has been replaced */
+static void reset_decoded(Um machine);
+
+/* marks one word of segment 0 to be decoded again before it runs */
+static inline void invalidate(Um machine, uint32_t offset);
+
+/* a word of segment 0 is about to run from the cache */
+static inline void mark_ran(Um machine, uint32_t offset);
+
+/* a word of segment 0 was stored to: invalidates it if it has run */
+static inline void stored_to(Um machine, uint32_t offset);
+
+/* runs the loop from pc back to the LOADP at from in bulk, if it can */
+static void run_loop(Um machine, uint32_t from);
+
+/* frees the loops found in a segment 0 that has been replaced */
+static void forget_loops(Um machine);
+
+/* counts the instructions run from entry to pc and starts over at pc */
+static inline void charge(Um machine);
+
+static inline word *segment_mem(Um machine, seg_id id);
+static inline void forget_segment(Um machine, seg_id id);
+static void forget_segments(Um machine);
+
+#ifdef UM_FUZZ
+/* aborts at an SLOAD or SSTORE outside its segment */
+static inline void check_bounds(Um machine, seg_id id, word offset);
+#endif
+
+#ifdef UM_ACCESS
+static inline void note_access(Um machine, seg_id id, uint32_t offset,
+                               uint32_t flags);
+#endif
+
+#ifdef UM_BACKGROUND
+/* stops the machine's compile job, if any, and frees it */
+static void drop_job(Um machine);
+#endif
+
+#ifdef UM_PROFILE
+/* keeps the call stack up to date after a LOADP from pc from */
+static inline void follow_calls(Um machine, uint32_t from, seg_id origin);
+#endif
 
 static uint32_t get_reg(Um machine, Um_register r)
 {
@@ -113,32 +339,57 @@ static void set_pc(Um machine, uint32_t val)
         machine->pc = val;
 }
 
-static bool run_instr(Um machine, Um_instruction to_run)
+static Decoded_instr decode(Um_instruction to_run)
 {
-        Um_opcode instr = Bitpack_getu(to_run, OPSIZE, INSTR_SIZE - OPSIZE);
-        
-        if (instr == HALT) {
-                return false;
-        }
-        if (instr == LV) {
-                Um_register ra = Bitpack_getu(to_run, REGSIZE, 
+        Decoded_instr instr;
+        instr.decoded = true;
+        instr.op = Bitpack_getu(to_run, OPSIZE, INSTR_SIZE - OPSIZE);
+
+        if (instr.op == LV) {
+                instr.regs.ra = Bitpack_getu(to_run, REGSIZE, 
                      INSTR_SIZE - OPSIZE - REGSIZE);
-                uint32_t val = Bitpack_getu(to_run, VALSIZE, 0);
+                instr.val = Bitpack_getu(to_run, VALSIZE, 0);
+                return instr;
+        }
 
-                load_value(machine, ra, val);
+        instr.regs.ra = Bitpack_getu(to_run, REGSIZE, REGSIZE * 2);
+        instr.regs.rb = Bitpack_getu(to_run, REGSIZE, REGSIZE * 1);
+        instr.regs.rc = Bitpack_getu(to_run, REGSIZE, REGSIZE * 0);
+        instr.val = 0;
+        return instr;
+}
 
+static bool run_instr(Um machine, Decoded_instr instr)
+{
+        if (instr.op == HALT) {
+                return false;
+        }
+        if (instr.op == LV) {
+                load_value(machine, instr.regs.ra, instr.val);
                 return true;
         }
 
-        Instr_regs regs;
+        INSTRUCTIONS[instr.op](machine, instr.regs);
+        return machine->status == UM_HALTED;
+}
 
-        regs.ra = Bitpack_getu(to_run, REGSIZE, REGSIZE * 2);
-        regs.rb = Bitpack_getu(to_run, REGSIZE, REGSIZE * 1);
-        regs.rc = Bitpack_getu(to_run, REGSIZE, REGSIZE * 0);
+#ifndef UM_SPECIALIZED
+static void reset_decoded(Um machine)
+{
+        machine->program_len = Segments_size(machine->segments, 0);
+        FREE(machine->decoded);
+        machine->decoded = CALLOC(machine->program_len + 1, 
+                                  sizeof(Cached_instr));
+        FREE(machine->ran);
+        machine->ran = CALLOC(machine->program_len / 64 + 1,
+                              sizeof(uint64_t));
+}
 
-        INSTRUCTIONS[instr](machine, regs);
-        return true;
+static inline void invalidate(Um machine, uint32_t offset)
+{
+        machine->decoded[offset].decoded = false;
 }
+#endif
 
 static void conditional_move(Um machine, Instr_regs regs)
 {
@@ -150,17 +401,39 @@ static void conditional_move(Um machine, Instr_regs regs)
 static void segmented_load(Um machine, Instr_regs regs)
 {
         assert(machine);
-        word *seg = Segments_get_mem(machine->segments, 
-                                     get_reg(machine, regs.rb));
+        word *seg = segment_mem(machine, get_reg(machine, regs.rb));
+#ifdef UM_FUZZ
+        check_bounds(machine, get_reg(machine, regs.rb),
+                     get_reg(machine, regs.rc));
+#endif
+#ifdef UM_ACCESS
+        note_access(machine, get_reg(machine, regs.rb),
+                    get_reg(machine, regs.rc), machine->tlb_hit);
+#endif
         set_reg(machine, regs.ra, seg[get_reg(machine, regs.rc)]);
 }
 
 static void segmented_store(Um machine, Instr_regs regs)
 {
         assert(machine);
-        word *seg = Segments_get_mem(machine->segments, 
-                                     get_reg(machine, regs.ra));
-        seg[get_reg(machine, regs.rb)] = get_reg(machine, regs.rc);
+        seg_id id = get_reg(machine, regs.ra);
+        word offset = get_reg(machine, regs.rb);
+        word *seg = segment_mem(machine, id);
+#ifdef UM_FUZZ
+        check_bounds(machine, id, offset);
+#endif
+        seg[offset] = get_reg(machine, regs.rc);
+
+        /* self-modifying code: decode this word again before running it */
+        if (id == 0)
+                stored_to(machine, offset);
+#ifdef UM_FUZZ
+        Segments_touch(machine->segments, id, offset, offset + 1);
+#endif
+#ifdef UM_ACCESS
+        note_access(machine, id, offset,
+                    UM_ACCESS_STORE | machine->tlb_hit);
+#endif
 }
 
 static void addition(Um machine, Instr_regs regs)
@@ -200,25 +473,42 @@ static void map_segment(Um machine, Instr_regs regs)
         assert(machine);
         seg_id new_id = Segments_map(machine->segments, 
                         get_reg(machine, regs.rc));
+        if (new_id == SEGMENTS_FULL) {
+                /* like a blocked IN, this MAP runs again if resumed */
+                machine->pc--;
+                machine->status = UM_OVER_MEMORY;
+                return;
+        }
+        forget_segment(machine, new_id);
         set_reg(machine, regs.rb, new_id);
 }
 
 static void unmap_segment(Um machine, Instr_regs regs)
 {
         assert(machine);
-        Segments_unmap(machine->segments, get_reg(machine, regs.rc));
+        seg_id id = get_reg(machine, regs.rc);
+        Segments_unmap(machine->segments, id);
+        forget_segment(machine, id);
 }
 
 static void output(Um machine, Instr_regs regs)
 {
         assert(machine);
-        putchar(get_reg(machine, regs.rc));
+        machine->unpack_stop = false;
+        machine->io.put(get_reg(machine, regs.rc), machine->io.cl);
 }
 
 static void input(Um machine, Instr_regs regs)
 {
         assert(machine);
-        int c = getchar();
+        machine->unpack_stop = false;
+        int c = machine->io.get(machine->io.cl);
+        if (c == UM_NO_INPUT) {
+                /* back up so that this IN runs again on the next Um_run */
+                machine->pc--;
+                machine->status = UM_BLOCKED;
+                return;
+        }
         if (c == EOF) {
                 set_reg(machine, regs.rc, ~0);
                 return;
@@ -229,44 +519,949 @@ static void input(Um machine, Instr_regs regs)
 static void load_program(Um machine, Instr_regs regs)
 {
         assert(machine); 
+        uint32_t from = machine->pc - 1;
+        charge(machine);
         set_pc(machine, get_reg(machine, regs.rc));
         seg_id origin_id = get_reg(machine, regs.rb);
-        if (origin_id == 0)
+#ifdef UM_FUZZ
+        if (machine->edges != NULL) {
+                uint32_t edge = (from * 2654435761u) ^ machine->pc
+                                ^ (origin_id != 0);
+                machine->edges[edge & machine->edge_mask]++;
+        }
+#endif
+#ifdef UM_PROFILE
+        follow_calls(machine, from, origin_id);
+#endif
+        if (origin_id != 0) {
+                Segments_copy(machine->segments, origin_id, 0);
+                forget_segment(machine, 0);
+                reset_decoded(machine);
+                forget_loops(machine);
+                if (machine->unpack_stop) {
+                        machine->unpack_stop = false;
+                        machine->status = UM_UNPACKED;
+                }
+        } else if (machine->pc <= from && !machine->stepping && BULK_LOOPS
+                   && machine->decoded[from].val != NOT_A_LOOP) {
+                run_loop(machine, from);
+        }
+        assert(machine->pc < machine->program_len);
+
+        /* every loop passes here, so this is the only check needed */
+        machine->entry = machine->pc;
+        if (machine->executed >= machine->budget) {
+                machine->status = UM_OVER_BUDGET;
+        }
+}
+
+static void run_loop(Um machine, uint32_t from)
+{
+        uint32_t *summary = &machine->decoded[from].val;
+        Um_instruction *program = Segments_get_mem(machine->segments, 0);
+        Loop_T loop = NULL;
+
+        if (*summary != UNANALYZED) {
+                loop = Seq_get(machine->loops, *summary - LOOP_INDEX);
+        }
+        if (loop == NULL || !Loop_matches(loop, program, machine->pc)) {
+                /* first time here, or the loop has been rewritten */
+                loop = Loop_new(program, machine->pc, from);
+                if (loop == NULL) {
+                        *summary = NOT_A_LOOP;
+                        return;
+                }
+                if (*summary == UNANALYZED) {
+                        *summary = Seq_length(machine->loops) + LOOP_INDEX;
+                        Seq_addhi(machine->loops, loop);
+                } else {
+                        Loop_T old = Seq_put(machine->loops, 
+                                             *summary - LOOP_INDEX, loop);
+                        Loop_free(&old);
+                }
+        }
+
+        seg_id stored;
+        uint32_t lo, hi;
+        uint32_t done = Loop_run(loop, machine->registers, machine->segments,
+                                 &stored, &lo, &hi);
+        if (done == 0) {
                 return;
-        Segments_copy(machine->segments, origin_id, 0);
+        }
+        machine->executed += (uint64_t)done * (from + 1 - machine->pc);
+        for (uint32_t offset = lo; stored == 0 && offset <= hi; ++offset) {
+                stored_to(machine, offset);
+        }
+#ifdef UM_FUZZ
+        Segments_touch(machine->segments, stored, lo, hi + 1);
+#endif
+#ifdef UM_RECORD
+        if (machine->log != NULL) {
+                Um_log *log = machine->log;
+                log->steps[(log->head - 1) & log->mask].loops = done;
+        }
+#endif
+}
+
+static void forget_loops(Um machine)
+{
+        while (Seq_length(machine->loops) > 0) {
+                Loop_T loop = Seq_remhi(machine->loops);
+                Loop_free(&loop);
+        }
 }
 
+static inline void charge(Um machine)
+{
+        machine->executed += machine->pc - machine->entry;
+        machine->entry = machine->pc;
+}
+
+static inline void mark_ran(Um machine, uint32_t offset)
+{
+        machine->ran[offset / 64] |= (uint64_t)1 << (offset % 64);
+}
+
+/* 
+ * a word that has not run since it was last stored to has no entry in
+ * the cache, so a store to data, such as a global of a program that
+ * keeps them in segment 0, leaves the cache alone
+ */
+static __attribute__((noinline)) void forget_code(Um machine,
+                                                  uint32_t offset)
+{
+        machine->ran[offset / 64] &= ~((uint64_t)1 << (offset % 64));
+        invalidate(machine, offset);
+}
+
+static inline void stored_to(Um machine, uint32_t offset)
+{
+        if (machine->ran[offset / 64] >> (offset % 64) & 1) {
+                forget_code(machine, offset);
+        }
+}
+
+/* 
+ * kept out of line, so that each of the specialized SLOAD and SSTORE
+ * handlers holds only the compare of a hit
+ */
+static __attribute__((noinline)) word *tlb_fill(Um machine, seg_id id)
+{
+        Tlb_entry *entry = &machine->tlb[id % TLB_ENTRIES];
+        entry->id = id;
+#ifdef UM_FUZZ
+        if (!Segments_valid(machine->segments, id)) {
+                entry->mem = NULL;
+                entry->size = 0;
+                return NULL;
+        }
+        entry->size = Segments_size(machine->segments, id);
+#endif
+        entry->mem = Segments_get_mem(machine->segments, id);
+        return entry->mem;
+}
+
+static inline word *segment_mem(Um machine, seg_id id)
+{
+        Tlb_entry *entry = &machine->tlb[id % TLB_ENTRIES];
+#ifdef UM_ACCESS
+        machine->tlb_hit = entry->id == id ? UM_ACCESS_TLB_HIT : 0;
+#endif
+        if (__builtin_expect(entry->id != id, 0)) {
+                return tlb_fill(machine, id);
+        }
+        return entry->mem;
+}
+
+#ifdef UM_FUZZ
+/* 
+ * a fuzzed program that reads or writes past the end of a segment, or
+ * in one that has no memory, would otherwise go on over the heap unseen
+ * and leave Um_restore a machine it cannot put back; the abort is a
+ * crash to umfuzz, which saves the input
+ */
+static __attribute__((noinline)) void out_of_bounds(Um machine, seg_id id,
+                                                    word offset)
+{
+        fprintf(stderr, "um: m[%u][%u] is outside its segment (%u words) "
+                "at pc %u\n", id, offset, machine->tlb[id % TLB_ENTRIES].size,
+                machine->pc - 1);
+        abort();
+}
+
+/* after segment_mem(machine, id), which left id in the TLB */
+static inline void check_bounds(Um machine, seg_id id, word offset)
+{
+        if (__builtin_expect(offset >= machine->tlb[id % TLB_ENTRIES].size,
+                             0)) {
+                out_of_bounds(machine, id, offset);
+        }
+}
+#endif
+
+/* id's memory has moved or gone: empties its entry if it has one */
+static inline void forget_segment(Um machine, seg_id id)
+{
+        uint32_t slot = id % TLB_ENTRIES;
+        if (machine->tlb[slot].id == id) {
+                machine->tlb[slot].id = ~slot;
+        }
+}
+
+static void forget_segments(Um machine)
+{
+        for (uint32_t slot = 0; slot < TLB_ENTRIES; ++slot) {
+                machine->tlb[slot].id = ~slot;
+        }
+}
+
+#ifdef UM_ACCESS
+/* 
+ * of every period accesses, the first burst go into the ring, unless
+ * it is full; the writer reads records up to head only once head is
+ * stored, and the machine reuses a slot only once tail has passed it
+ */
+static inline void note_access(Um machine, seg_id id, uint32_t offset,
+                               uint32_t flags)
+{
+        uint64_t seq = machine->accesses++;
+        Um_ring *ring = machine->ring;
+        if (ring == NULL || (seq & machine->period_mask) >= machine->burst) {
+                return;
+        }
+        uint64_t head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+            > ring->mask) {
+                ring->dropped++;
+                return;
+        }
+        ring->records[head & ring->mask] = (Um_access){
+                seq, id, offset, Segments_size(machine->segments, id), flags
+        };
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+#ifdef UM_PROFILE
+/* 
+ * "goto f linking r1" loads the address past its LOADP into r1, and
+ * the callee returns with a LOADP to that address
+ */
+static inline void follow_calls(Um machine, uint32_t from, seg_id origin)
+{
+        if (origin != 0) {
+                machine->depth = 0;
+                return;
+        }
+        uint32_t last = machine->depth > UNWIND_FRAMES
+                        ? machine->depth - UNWIND_FRAMES : 0;
+        for (uint32_t d = machine->depth; d > last; --d) {
+                if (machine->calls[d - 1] == machine->pc) {
+                        machine->depth = d - 1;
+                        return;
+                }
+        }
+        if (machine->registers[r1] == from + 1
+            && machine->depth < CALL_FRAMES) {
+                machine->calls[machine->depth++] = from + 1;
+        }
+}
+#endif
+
 static void load_value(Um machine, Um_register ra, uint32_t val)
 {
         set_reg(machine, ra, val);
 }
 
-Um Um_new(FILE *program)
+static int stdio_get(void *cl)
+{
+        (void)cl;
+        return getchar();
+}
+
+static void stdio_put(int c, void *cl)
+{
+        (void)cl;
+        putchar(c);
+}
+
+/* a machine at pc 0 with all registers 0, running segments */
+static Um new_machine(Segments_T segments)
 {
         Um result;
         NEW(result);
 
-        result->segments = Segments_new();
-
-        Segments_read_program(result->segments, program);
+        result->segments = segments;
         result->pc = 0;
 
         for (int i = 0; i < NUM_REGS; ++i) {
                 result->registers[i] = 0;
         }
 
+        result->decoded = NULL;
+        result->ran = NULL;
+#ifdef UM_BACKGROUND
+        result->job = NULL;
+#endif
+        reset_decoded(result);
+
+        result->io = (Um_io){ stdio_get, stdio_put, NULL };
+        result->status = UM_HALTED;
+        result->stepping = false;
+        result->loops = Seq_new(0);
+        result->executed = 0;
+        result->entry = 0;
+        result->budget = UINT64_MAX;
+        result->unpack_stop = false;
+        forget_segments(result);
+#ifdef UM_FUZZ
+        result->edges = NULL;
+#endif
+#ifdef UM_ACCESS
+        result->ring = NULL;
+        result->accesses = 0;
+        result->tlb_hit = 0;
+#endif
+#ifdef UM_PROFILE
+        result->depth = 0;
+#endif
+#ifdef UM_RECORD
+        result->log = NULL;
+#endif
+
         return result;
 }
 
+Um Um_new(FILE *program)
+{
+        Segments_T segments = Segments_new();
+        Segments_read_program(segments, program);
+        return new_machine(segments);
+}
+
+void Um_stop_at_unpack(Um machine)
+{
+        assert(machine);
+        machine->unpack_stop = true;
+}
+
+/* pc, the registers and the instruction count, ahead of the segments */
+#define SAVED_WORDS (NUM_REGS + 3)
+
+void Um_save(Um machine, FILE *fp)
+{
+        assert(machine && fp);
+        uint32_t saved[SAVED_WORDS];
+        saved[0] = machine->pc;
+        memcpy(saved + 1, machine->registers, sizeof(machine->registers));
+        saved[NUM_REGS + 1] = machine->executed & UINT32_MAX;
+        saved[NUM_REGS + 2] = machine->executed >> 32;
+        fwrite(saved, sizeof(uint32_t), SAVED_WORDS, fp);
+        Segments_save(machine->segments, fp);
+}
+
+Um Um_load(const uint32_t *words, size_t len)
+{
+        assert(words);
+        if (len < SAVED_WORDS) {
+                return NULL;
+        }
+        Segments_T segments = Segments_load(words + SAVED_WORDS,
+                                            len - SAVED_WORDS);
+        if (segments == NULL) {
+                return NULL;
+        }
+        if (words[0] >= Segments_size(segments, 0)) {
+                Segments_free(&segments);
+                return NULL;
+        }
+        Um machine = new_machine(segments);
+        machine->pc = words[0];
+        memcpy(machine->registers, words + 1, sizeof(machine->registers));
+        machine->executed = words[NUM_REGS + 1]
+                            | (uint64_t)words[NUM_REGS + 2] << 32;
+        return machine;
+}
+
 void Um_free(Um *machinep)
 {
         assert(machinep && *machinep);
         Segments_free(&((*machinep)->segments));
+        forget_loops(*machinep);
+        Seq_free(&((*machinep)->loops));
+#ifdef UM_BACKGROUND
+        drop_job(*machinep);
+#endif
+        FREE((*machinep)->decoded);
+        FREE((*machinep)->ran);
         FREE(*machinep);
         machinep = NULL;
 }
 
+void Um_compact(Um machine)
+{
+        assert(machine);
+        Segments_compact(machine->segments);
+        forget_segments(machine);
+}
+
+void Um_set_quota(Um machine, uint64_t words, uint64_t instructions)
+{
+        assert(machine);
+        Segments_limit(machine->segments, words ? words : UINT64_MAX);
+        machine->budget = instructions ? instructions : UINT64_MAX;
+}
+
+uint64_t Um_executed(Um machine)
+{
+        assert(machine);
+        return machine->executed;
+}
+
+const uint32_t *Um_registers(Um machine)
+{
+        assert(machine);
+        return machine->registers;
+}
+
+uint32_t Um_pc(Um machine)
+{
+        assert(machine);
+        return machine->pc;
+}
+
+Segments_T Um_segments(Um machine)
+{
+        assert(machine);
+        return machine->segments;
+}
+
+#ifdef UM_FUZZ
+void Um_snapshot(Um machine)
+{
+        assert(machine);
+        Segments_snapshot(machine->segments);
+        for (int i = 0; i < NUM_REGS; ++i) {
+                machine->saved_registers[i] = machine->registers[i];
+        }
+        machine->saved_pc = machine->pc;
+        machine->saved_executed = machine->executed;
+}
+
+/* forgets what the cache knew about restored words of segment 0 */
+static void restored(seg_id id, uint32_t lo, uint32_t hi, void *cl)
+{
+        Um machine = cl;
+        if (id != 0) {
+                return;
+        }
+        if (Segments_size(machine->segments, 0) != machine->program_len) {
+                reset_decoded(machine);
+                forget_loops(machine);
+                return;
+        }
+        for (uint32_t offset = lo; offset < hi; ++offset) {
+                stored_to(machine, offset);
+        }
+}
+
+void Um_restore(Um machine)
+{
+        assert(machine);
+        Segments_restore(machine->segments, restored, machine);
+        forget_segments(machine);
+        for (int i = 0; i < NUM_REGS; ++i) {
+                machine->registers[i] = machine->saved_registers[i];
+        }
+        machine->pc = machine->saved_pc;
+        machine->executed = machine->saved_executed;
+        machine->entry = machine->pc;
+}
+
+void Um_trace_edges(Um machine, uint8_t *edges, uint32_t size)
+{
+        assert(machine);
+        assert(edges == NULL || (size > 0 && (size & (size - 1)) == 0));
+        machine->edges = edges;
+        machine->edge_mask = size - 1;
+}
+#endif
+
+#ifdef UM_ACCESS
+void Um_sample_accesses(Um machine, Um_ring *ring, uint32_t period,
+                        uint32_t burst)
+{
+        assert(machine && period > 0 && (period & (period - 1)) == 0);
+        assert(ring == NULL || ((ring->mask + 1) & ring->mask) == 0);
+        machine->ring = ring;
+        machine->period_mask = period - 1;
+        machine->burst = burst;
+}
+#endif
+
+#ifdef UM_PROFILE
+const uint32_t *Um_call_stack(Um machine, uint32_t *depth)
+{
+        assert(machine && depth);
+        *depth = machine->depth;
+        return machine->calls;
+}
+#endif
+
+#ifdef UM_RECORD
+void Um_record(Um machine, Um_log *log)
+{
+        assert(machine);
+        assert(log == NULL || ((log->mask + 1) & log->mask) == 0);
+        machine->log = log;
+}
+#endif
+
+void Um_set_io(Um machine, const Um_io *io)
+{
+        assert(machine && io && io->get && io->put);
+        machine->io = *io;
+}
+
 bool run_next(Um machine)
 {
-       return run_instr(machine, get_next_instr(machine));   
+       machine->stepping = true;
+       machine->status = UM_HALTED;
+       machine->entry = machine->pc;
+       bool running = run_instr(machine, decode(get_next_instr(machine)));
+       charge(machine);
+       return running;
+}
+
+#ifndef UM_SPECIALIZED
+Um_status Um_run(Um machine)
+{
+        assert(machine);
+        Cached_instr *instr;
+        machine->status = UM_HALTED;
+        machine->stepping = false;
+        machine->entry = machine->pc;
+        do {
+                assert(machine->pc < machine->program_len);
+                instr = &machine->decoded[machine->pc];
+                if (!instr->decoded) {
+                        Um_instruction *program = 
+                                Segments_get_mem(machine->segments, 0);
+                        *instr = decode(program[machine->pc]);
+                        mark_ran(machine, machine->pc);
+                }
+                machine->pc++;
+        } while (run_instr(machine, *instr));
+        charge(machine);
+        return machine->status;
+}
+
+#else
+
+/*
+ * Specialized engine. Each handler below is one of the handlers above
+ * instantiated for a fixed register triple, so once the compiler inlines
+ * it every register is a constant offset into machine->registers and
+ * nothing is left to decode at run time.
+ */
+
+typedef bool (*special_fn)(Um machine, uint32_t val);
+
+#define SPECIALIZE(fn, a, b, c)                                         \
+static bool fn##_##a##b##c(Um machine, uint32_t val)                   \
+{                                                                       \
+        (void)val;                                                      \
+        fn(machine, (Instr_regs){ a, b, c });                           \
+        return true;                                                    \
+}
+
+#define HANDLER(fn, a, b, c) fn##_##a##b##c,
+
+/* applies M to every register for rc, then rb, then ra */
+#define REGS_C(M, fn, a, b)                                             \
+        M(fn, a, b, 0) M(fn, a, b, 1) M(fn, a, b, 2) M(fn, a, b, 3)     \
+        M(fn, a, b, 4) M(fn, a, b, 5) M(fn, a, b, 6) M(fn, a, b, 7)
+#define REGS_B(M, fn, a)                                                \
+        REGS_C(M, fn, a, 0) REGS_C(M, fn, a, 1) REGS_C(M, fn, a, 2)     \
+        REGS_C(M, fn, a, 3) REGS_C(M, fn, a, 4) REGS_C(M, fn, a, 5)     \
+        REGS_C(M, fn, a, 6) REGS_C(M, fn, a, 7)
+#define REGS_A(M, fn)                                                   \
+        REGS_B(M, fn, 0) REGS_B(M, fn, 1) REGS_B(M, fn, 2)              \
+        REGS_B(M, fn, 3) REGS_B(M, fn, 4) REGS_B(M, fn, 5)              \
+        REGS_B(M, fn, 6) REGS_B(M, fn, 7)
+
+/* ops that use ra, rb and rc get 512 handlers, indexed by ra:rb:rc */
+REGS_A(SPECIALIZE, conditional_move)
+REGS_A(SPECIALIZE, segmented_load)
+REGS_A(SPECIALIZE, segmented_store)
+REGS_A(SPECIALIZE, addition)
+REGS_A(SPECIALIZE, multiplication)
+REGS_A(SPECIALIZE, division)
+REGS_A(SPECIALIZE, bitwise_nand)
+
+/* MAP, LOADP and IN can also stop the machine */
+#define SPECIALIZE_STOP(fn, a, b, c)                                    \
+static bool fn##_##a##b##c(Um machine, uint32_t val)                   \
+{                                                                       \
+        (void)val;                                                      \
+        fn(machine, (Instr_regs){ a, b, c });                           \
+        return machine->status == UM_HALTED && CACHE_READY(machine);    \
+}
+
+/* ops that use rb and rc get 64, indexed by rb:rc, with ra fixed at 0 */
+REGS_B(SPECIALIZE_STOP, map_segment, 0)
+REGS_B(SPECIALIZE_STOP, load_program, 0)
+
+/* ops that only use rc get 8 */
+REGS_C(SPECIALIZE, unmap_segment, 0, 0)
+REGS_C(SPECIALIZE, output, 0, 0)
+REGS_C(SPECIALIZE_STOP, input, 0, 0)
+
+static const special_fn SPECIAL_ABC[][512] = {
+        [CMOV] = { REGS_A(HANDLER, conditional_move) },
+        [SLOAD] = { REGS_A(HANDLER, segmented_load) },
+        [SSTORE] = { REGS_A(HANDLER, segmented_store) },
+        [ADD] = { REGS_A(HANDLER, addition) },
+        [MUL] = { REGS_A(HANDLER, multiplication) },
+        [DIV] = { REGS_A(HANDLER, division) },
+        [NAND] = { REGS_A(HANDLER, bitwise_nand) }
+};
+
+static const special_fn SPECIAL_MAP[] = { REGS_B(HANDLER, map_segment, 0) };
+static const special_fn SPECIAL_LOADP[] = { REGS_B(HANDLER, load_program, 0) };
+static const special_fn SPECIAL_UNMAP[] = { 
+        REGS_C(HANDLER, unmap_segment, 0, 0) 
+};
+static const special_fn SPECIAL_OUT[] = { REGS_C(HANDLER, output, 0, 0) };
+static const special_fn SPECIAL_IN[] = { REGS_C(HANDLER, input, 0, 0) };
+
+/* LV keeps its value in the cache entry */
+#define SPECIALIZE_LV(a)                                                \
+static bool load_value_##a(Um machine, uint32_t val)                   \
+{                                                                       \
+        load_value(machine, a, val);                                    \
+        return true;                                                    \
+}
+
+SPECIALIZE_LV(0) SPECIALIZE_LV(1) SPECIALIZE_LV(2) SPECIALIZE_LV(3)
+SPECIALIZE_LV(4) SPECIALIZE_LV(5) SPECIALIZE_LV(6) SPECIALIZE_LV(7)
+
+static const special_fn SPECIAL_LV[] = {
+        load_value_0, load_value_1, load_value_2, load_value_3,
+        load_value_4, load_value_5, load_value_6, load_value_7
+};
+
+static bool halt_special(Um machine, uint32_t val)
+{
+        (void)machine;
+        (void)val;
+        return false;
+}
+
+/* picks the specialized handler for an instruction word */
+static Cached_instr specialize(Um_instruction to_run)
+{
+        Decoded_instr instr = decode(to_run);
+        Instr_regs regs = instr.regs;
+        Cached_instr result = { .run = NULL, .val = instr.val };
+#ifdef UM_RECORD
+        result.word = to_run;
+#endif
+
+        switch (instr.op) {
+        case HALT: 
+                result.run = halt_special;
+                break;
+        case MAP:
+                result.run = SPECIAL_MAP[regs.rb * 8 + regs.rc];
+                break;
+        case LOADP:
+                result.run = SPECIAL_LOADP[regs.rb * 8 + regs.rc];
+                break;
+        case UNMAP:
+                result.run = SPECIAL_UNMAP[regs.rc];
+                break;
+        case OUT:
+                result.run = SPECIAL_OUT[regs.rc];
+                break;
+        case IN:
+                result.run = SPECIAL_IN[regs.rc];
+                break;
+        case LV:
+                result.run = SPECIAL_LV[regs.ra];
+                break;
+        default:
+                assert(instr.op <= NAND);
+                result.run = SPECIAL_ABC[instr.op]
+                                [regs.ra * 64 + regs.rb * 8 + regs.rc];
+                break;
+        }
+        return result;
+}
+
+/* every cache entry starts here: specialize the word, then run it */
+static bool run_undecoded(Um machine, uint32_t val)
+{
+        (void)val;
+        uint32_t offset = machine->pc - 1;
+        Um_instruction *program = Segments_get_mem(machine->segments, 0);
+        Cached_instr *instr = &machine->decoded[offset];
+
+        *instr = specialize(program[offset]);
+        mark_ran(machine, offset);
+        return instr->run(machine, instr->val);
+}
+
+/* sits one past the end of the cache: running off segment 0 fails */
+static bool run_past_end(Um machine, uint32_t val)
+{
+        (void)val;
+        assert(machine->pc - 1 < machine->program_len);
+        return false;
+}
+
+#ifdef UM_BACKGROUND
+/* specializes the blocks the machine has sent so far */
+static void take_hot_blocks(Compile_job *job)
+{
+        uint32_t head = __atomic_load_n(&job->head, __ATOMIC_ACQUIRE);
+        for (uint32_t tail = job->tail; tail != head; ++tail) {
+                Hot_block *block = &job->queue[tail % HOT_QUEUE];
+                if (job->nhot + 2 * block->len > job->hot_cap) {
+                        job->hot_cap *= 2;
+                        RESIZE(job->hot, job->hot_cap * sizeof(uint32_t));
+                }
+                for (uint32_t i = 0; i < block->len; ++i) {
+                        job->decoded[block->at + i] =
+                                specialize(block->words[i]);
+                        job->hot[job->nhot++] = block->at + i;
+                        job->hot[job->nhot++] = block->words[i];
+                }
+        }
+        __atomic_store_n(&job->tail, head, __ATOMIC_RELEASE);
+}
+
+/* 
+ * the compiler thread: fills the cache as reset_decoded would, leaving
+ * alone the entries of hot blocks, which it specializes between chunks
+ */
+static void *compile(void *cl)
+{
+        Compile_job *job = cl;
+        job->decoded = CALLOC(job->len + 1, sizeof(Cached_instr));
+        for (uint32_t at = 0; at < job->len; at += FILL_WORDS) {
+                if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+                        return NULL;
+                }
+                take_hot_blocks(job);
+                uint32_t end = job->len - at < FILL_WORDS ? job->len
+                                                          : at + FILL_WORDS;
+                for (uint32_t i = at; i < end; ++i) {
+                        if (job->decoded[i].run == NULL) {
+                                job->decoded[i].run = run_undecoded;
+                        }
+                }
+        }
+        take_hot_blocks(job);
+        job->decoded[job->len].run = run_past_end;
+        __atomic_store_n(&job->ready, 1, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+static void start_job(Um machine)
+{
+        Compile_job *job;
+        NEW0(job);
+        job->len = machine->program_len;
+        job->hot_cap = 2 * HOT_WORDS;
+        job->hot = ALLOC(job->hot_cap * sizeof(uint32_t));
+        int started = pthread_create(&job->thread, NULL, compile, job);
+        assert(started == 0);
+        machine->job = job;
+}
+
+static void drop_job(Um machine)
+{
+        Compile_job *job = machine->job;
+        if (job == NULL) {
+                return;
+        }
+        __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+        pthread_join(job->thread, NULL);
+        FREE(job->decoded);
+        FREE(job->hot);
+        FREE(job);
+        machine->job = NULL;
+}
+
+/* 
+ * takes the finished cache; a hot word stored to since it was sent is
+ * specialized again when it runs, and the others are marked as run, so
+ * that a store to one from now on is seen
+ */
+static void install(Um machine)
+{
+        Compile_job *job = machine->job;
+        Um_instruction *program = segment_mem(machine, 0);
+        pthread_join(job->thread, NULL);
+        machine->decoded = job->decoded;
+        job->decoded = NULL;
+        for (uint32_t i = 0; i < job->nhot; i += 2) {
+                uint32_t offset = job->hot[i];
+                if (program[offset] == job->hot[i + 1]) {
+                        mark_ran(machine, offset);
+                } else {
+                        invalidate(machine, offset);
+                }
+        }
+        FREE(job->hot);
+        FREE(job);
+        machine->job = NULL;
+}
+
+/* counts a LOADP target, sending its block once it is hot */
+static void note_target(Um machine, uint32_t target)
+{
+        Compile_job *job = machine->job;
+        if (++job->heat[target % HEAT_SLOTS] != HOT_RUNS) {
+                return;
+        }
+        uint32_t head = job->head;
+        if (head - __atomic_load_n(&job->tail, __ATOMIC_ACQUIRE)
+            == HOT_QUEUE) {
+                return;
+        }
+        Hot_block *block = &job->queue[head % HOT_QUEUE];
+        Um_instruction *program = segment_mem(machine, 0);
+        uint32_t len = 0;
+        while (len < HOT_WORDS && target + len < machine->program_len) {
+                uint32_t word = program[target + len];
+                if (word >> 28 > LV) {
+                        break;          /* data, which specialize rejects */
+                }
+                block->words[len++] = word;
+                if (word >> 28 == LOADP || word >> 28 == HALT) {
+                        break;
+                }
+        }
+        block->at = target;
+        block->len = len;
+        __atomic_store_n(&job->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* 
+ * runs segment 0 a word at a time, as run_next does, while its cache is
+ * built; returns true once the cache is in, or false if the machine
+ * stopped first
+ */
+static bool run_uncached(Um machine)
+{
+        bool running = true;
+        machine->stepping = true;
+        while (running && machine->job != NULL) {
+                if (__atomic_load_n(&machine->job->ready, __ATOMIC_ACQUIRE)) {
+                        install(machine);
+                        break;
+                }
+                assert(machine->pc < machine->program_len);
+                Decoded_instr instr =
+                        decode(segment_mem(machine, 0)[machine->pc++]);
+                running = run_instr(machine, instr);
+                if (instr.op == LOADP && machine->job != NULL
+                    && get_reg(machine, instr.regs.rb) == 0) {
+                        note_target(machine, machine->pc);
+                }
+        }
+        machine->stepping = false;
+        return running;
+}
+#endif
+
+static void reset_decoded(Um machine)
+{
+        machine->program_len = Segments_size(machine->segments, 0);
+        FREE(machine->decoded);
+        FREE(machine->ran);
+        machine->ran = CALLOC(machine->program_len / 64 + 1,
+                              sizeof(uint64_t));
+#ifdef UM_BACKGROUND
+        drop_job(machine);
+        if (machine->program_len >= BACKGROUND_WORDS) {
+                start_job(machine);
+                return;
+        }
+#endif
+        machine->decoded = CALLOC(machine->program_len + 1, 
+                                  sizeof(Cached_instr));
+        for (uint32_t i = 0; i < machine->program_len; ++i) {
+                invalidate(machine, i);
+        }
+        machine->decoded[machine->program_len].run = run_past_end;
+}
+
+static inline void invalidate(Um machine, uint32_t offset)
+{
+        machine->decoded[offset].run = run_undecoded;
+}
+
+#ifdef UM_RECORD
+/* 
+ * Um_run writing each step to log: the step is filled before head moves
+ * past it, so a signal handler reading the log never takes a step of
+ * the last lap for a new one. The word in an entry not yet specialized
+ * may be stale, as a store to a word that has not run leaves the cache
+ * alone, so that one is read from segment 0
+ */
+static void run_recorded(Um machine, Um_log *log)
+{
+        Um_step *steps = log->steps;
+        uint32_t mask = log->mask;
+        uint64_t head = log->head;
+        bool running;
+        do {
+                uint32_t pc = machine->pc++;
+                Cached_instr *instr = &machine->decoded[pc];
+                uint32_t word = instr->word;
+                if (instr->run == run_undecoded) {
+                        word = segment_mem(machine, 0)[pc];
+                }
+                Um_step *step = &steps[head++ & mask];
+                *step = (Um_step){ pc, word, 0, 0 };
+                __atomic_store_n(&log->head, head, __ATOMIC_RELEASE);
+                uint32_t *kept = &machine->registers
+                                 [word >> RECORDED_SHIFT[word >> 28] & 7];
+                running = instr->run(machine, instr->val);
+                step->value = *kept;
+        } while (running);
+}
+#endif
+
+Um_status Um_run(Um machine)
+{
+        assert(machine);
+        Cached_instr *instr;
+        machine->status = UM_HALTED;
+        machine->stepping = false;
+        machine->entry = machine->pc;
+#ifdef UM_RECORD
+        if (machine->log != NULL) {
+                run_recorded(machine, machine->log);
+                charge(machine);
+                return machine->status;
+        }
+#endif
+        /* a LOADP that leaves the cache to be built stops the inner loop */
+        do {
+#ifdef UM_BACKGROUND
+                if (machine->decoded == NULL && !run_uncached(machine)) {
+                        break;
+                }
+#endif
+                do {
+                        instr = &machine->decoded[machine->pc++];
+                } while (instr->run(machine, instr->val));
+        } while (!CACHE_READY(machine) && machine->status == UM_HALTED);
+        charge(machine);
+        return machine->status;
 }
+#endif
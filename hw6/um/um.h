@@ -11,13 +11,180 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "segments.h"
 
 struct Um;
 
 typedef struct Um *Um;
 
+/* returned by an input source that has no byte ready yet */
+#define UM_NO_INPUT (-2)
+
+/* 
+ * where a machine gets its input and puts its output: get returns the
+ * next byte, EOF at the end of input or UM_NO_INPUT to block the machine
+ * in IN until it is run again
+ */
+typedef struct Um_io {
+        int (*get)(void *cl);
+        void (*put)(int c, void *cl);
+        void *cl;
+} Um_io;
+
+/* 
+ * why Um_run returned: the machine halted, blocked on input, or passed
+ * a quota set with Um_set_quota; the last two are faults that leave the
+ * machine stopped before the MAP that was refused, or at the target of
+ * the jump that used up the budget. UM_UNPACKED is only returned after
+ * Um_stop_at_unpack, and is not a fault
+ */
+typedef enum Um_status { 
+        UM_HALTED = 0, UM_BLOCKED, UM_OVER_MEMORY, UM_OVER_BUDGET,
+        UM_UNPACKED
+} Um_status;
+
 Um Um_new(FILE *input);
 void Um_free(Um *machine);
+
+/* replaces stdin and stdout, the default io of a new machine */
+void Um_set_io(Um machine, const Um_io *io);
+
+/* 
+ * limits the machine to words of mapped segments (see Segments_limit)
+ * and to instructions executed in all; 0 means no limit. A MAP that
+ * would pass the first is refused; the second is checked at every
+ * LOADP, which stops the machine once it has run that many, so it can
+ * be passed by one straight run of instructions or one loop run in bulk.
+ * It may be called from the machine's own io callbacks: an instruction
+ * quota of 1 set from put stops the machine at its next LOADP
+ */
+void Um_set_quota(Um machine, uint64_t words, uint64_t instructions);
+
+/* 
+ * makes Um_run stop with UM_UNPACKED at the first LOADP that replaces
+ * segment 0, as a program like codex.umz does once it has unpacked
+ * itself, unless an IN or OUT runs first: what the machine has done up
+ * to there depends on nothing but its image. Um_save writes such a
+ * machine out as words, and Um_load makes it again from them, in place
+ * of running the image from the start; it returns NULL if the len
+ * words are not what Um_save writes
+ */
+void Um_stop_at_unpack(Um machine);
+void Um_save(Um machine, FILE *fp);
+Um Um_load(const uint32_t *words, size_t len);
+
+/* instructions executed so far, as of the last LOADP or stop */
+uint64_t Um_executed(Um machine);
+
+/* 
+ * only in a machine built with -DUM_FUZZ (um-fuzz.o), whose stores are
+ * tracked: Um_snapshot saves the machine's registers, pc, instruction
+ * count and memory, and Um_restore puts them back, copying only what
+ * was written since and keeping the decoded instructions that are still
+ * good. Um_trace_edges counts every LOADP's pair of source and target
+ * into edges[hash & (size - 1)], size a power of 2, or stops if NULL
+ */
+void Um_snapshot(Um machine);
+void Um_restore(Um machine);
+void Um_trace_edges(Um machine, uint8_t *edges, uint32_t size);
+
+/* 
+ * one SLOAD or SSTORE: the count of accesses before it, the segment, the
+ * offset, the size of the segment then, and flags: UM_ACCESS_STORE for
+ * an SSTORE, and UM_ACCESS_TLB_HIT if the machine's segment TLB gave it
+ * the segment without asking the Segments_T
+ */
+typedef struct Um_access {
+        uint64_t seq;
+        uint32_t id, offset, size, flags;
+} Um_access;
+
+#define UM_ACCESS_STORE 1
+#define UM_ACCESS_TLB_HIT 2
+
+/* 
+ * a ring of 2^k records written by the machine and read by one other
+ * thread: the machine fills records from head and the reader moves tail
+ * past what it has read, both with atomic loads and stores
+ */
+typedef struct Um_ring {
+        uint64_t head, tail;
+        uint64_t dropped;       /* records lost to a full ring */
+        uint32_t mask;          /* 2^k - 1 */
+        Um_access *records;
+} Um_ring;
+
+/* 
+ * only in a machine built with -DUM_ACCESS (um-access.o), which runs
+ * every loop an instruction at a time: of every period (a power of 2)
+ * SLOADs and SSTOREs, the first burst are written to ring
+ */
+void Um_sample_accesses(Um machine, Um_ring *ring, uint32_t period,
+                        uint32_t burst);
+
+/* 
+ * only in a machine built with -DUM_PROFILE (um-prof.o): the return
+ * addresses of the calls ("goto ... linking r1") the machine is in,
+ * outermost first, as its LOADPs have followed them; cheap enough to
+ * call from a signal handler that has interrupted Um_run
+ */
+const uint32_t *Um_call_stack(Um machine, uint32_t *depth);
+
+/*
+ * one instruction run: its pc and word, then, once it has run, the
+ * register it wrote (ra; rb of MAP; rc of IN), or for the ops that
+ * write none the one that says the most (rc of SSTORE, UNMAP and OUT,
+ * the segment rb of LOADP), and how many more times a loop back to this
+ * LOADP was then run in bulk
+ */
+typedef struct Um_step {
+        uint32_t pc, word, value, loops;
+} Um_step;
+
+/*
+ * a ring of 2^k steps: the machine fills step head & mask and then
+ * moves head past it, so the ring always holds the last steps run, the
+ * newest one possibly unfinished
+ */
+typedef struct Um_log {
+        uint64_t head;
+        uint32_t mask;          /* 2^k - 1 */
+        Um_step *steps;
+} Um_log;
+
+/*
+ * only in a machine built with -DUM_RECORD (um-record.o): every
+ * instruction Um_run runs is written to log, or to nothing if NULL;
+ * log can be read from a signal handler that has interrupted Um_run
+ */
+void Um_record(Um machine, Um_log *log);
+
+/* for tools that inspect a machine: its 8 registers, pc and memory */
+const uint32_t *Um_registers(Um machine);
+uint32_t Um_pc(Um machine);
+Segments_T Um_segments(Um machine);
+
+/* 
+ * runs a single instruction, decoding it from segment 0 every time;
+ * returns false once the machine halts or blocks on input
+ */
 bool run_next(Um machine);
 
+/* 
+ * runs until halt, executing segment 0 from a cache of decoded
+ * instructions so that a LOADP within segment 0 costs no decoding;
+ * stops early with UM_BLOCKED at an IN that has no input yet, which
+ * runs again when Um_run is next called
+ */
+Um_status Um_run(Um machine);
+
+/* 
+ * frees the memory of unmapped segments and packs small segments
+ * together; cheap unless there is something to do, and meant for quiet
+ * points such as a machine blocked on input
+ */
+void Um_compact(Um machine);
+
 #endif
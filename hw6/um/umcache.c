@@ -0,0 +1,185 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * Implementation of Umcache module
+ *
+ * A cache file is a Header followed by the words Um_save writes: the
+ * pc, registers and instruction count, then every segment in host byte
+ * order. Loading maps the file, checks the header and the checksum of
+ * the words, and hands them to Um_load, so a warm start neither reads
+ * and byte swaps the image nor runs the code that unpacks it; segment
+ * 0 is decoded lazily from there, as after any LOADP.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "umcache.h"
+
+#define MAGIC 0x31434d55        /* "UMC1", read in host byte order */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct Header {
+        uint32_t magic;
+        uint32_t header_bytes;  /* sizeof(Header) when written */
+        uint64_t image_bytes;
+        uint64_t image_hash;    /* FNV-1a of the image's bytes */
+        uint64_t words;         /* written by Um_save */
+        uint64_t checksum;      /* of those words */
+} Header;
+
+struct Umcache {
+        char *path;             /* dir/hash-bytes.umc */
+        uint64_t image_bytes;
+        uint64_t image_hash;
+};
+
+/* FNV-1a a word, rather than a byte, at a time */
+static uint64_t checksum(const uint32_t *words, size_t len)
+{
+        uint64_t hash = FNV_OFFSET;
+        for (size_t i = 0; i < len; ++i) {
+                hash = (hash ^ words[i]) * FNV_PRIME;
+        }
+        return hash;
+}
+
+Umcache Umcache_new(const char *dir, FILE *image)
+{
+        assert(dir && image);
+        Umcache cache;
+        NEW(cache);
+        cache->image_bytes = 0;
+        cache->image_hash = FNV_OFFSET;
+
+        unsigned char chunk[65536];
+        size_t n;
+        rewind(image);
+        while ((n = fread(chunk, 1, sizeof(chunk), image)) > 0) {
+                for (size_t i = 0; i < n; ++i) {
+                        cache->image_hash = (cache->image_hash ^ chunk[i])
+                                            * FNV_PRIME;
+                }
+                cache->image_bytes += n;
+        }
+        rewind(image);
+
+        /* a missing directory shows up when the entry is saved */
+        mkdir(dir, 0777);
+        size_t size = strlen(dir) + 64;
+        cache->path = ALLOC(size);
+        snprintf(cache->path, size, "%s/%016llx-%llu.umc", dir,
+                 (unsigned long long)cache->image_hash,
+                 (unsigned long long)cache->image_bytes);
+        return cache;
+}
+
+Um Umcache_load(Umcache cache)
+{
+        assert(cache);
+        int fd = open(cache->path, O_RDONLY);
+        if (fd < 0) {
+                return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+                close(fd);
+                return NULL;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return NULL;
+        }
+
+        const Header *header = map;
+        const uint32_t *words = (const uint32_t *)(header + 1);
+        size_t bytes = st.st_size - sizeof(Header);
+        Um machine = NULL;
+        if (header->magic == MAGIC && header->header_bytes == sizeof(Header)
+            && header->image_bytes == cache->image_bytes
+            && header->image_hash == cache->image_hash
+            && bytes % sizeof(uint32_t) == 0
+            && header->words == bytes / sizeof(uint32_t)
+            && header->checksum == checksum(words, header->words)) {
+                machine = Um_load(words, header->words);
+        }
+        munmap(map, st.st_size);
+        return machine;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+        const char *next = data;
+        while (len > 0) {
+                ssize_t n = write(fd, next, len);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        return false;
+                }
+                next += n;
+                len -= n;
+        }
+        return true;
+}
+
+void Umcache_save(Umcache cache, Um machine)
+{
+        assert(cache && machine);
+        char *saved = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&saved, &len);
+        assert(out);
+        Um_save(machine, out);
+        fclose(out);
+
+        Header header = { MAGIC, sizeof(Header), cache->image_bytes,
+                          cache->image_hash, len / sizeof(uint32_t),
+                          checksum((uint32_t *)saved,
+                                   len / sizeof(uint32_t)) };
+
+        /* readers only ever open a complete file under the real name */
+        size_t size = strlen(cache->path) + 8;
+        char *temp = ALLOC(size);
+        snprintf(temp, size, "%s.XXXXXX", cache->path);
+        int fd = mkstemp(temp);
+        bool saved_ok = fd >= 0 && fchmod(fd, 0644) == 0
+                        && write_all(fd, &header, sizeof(header))
+                        && write_all(fd, saved, len) && fsync(fd) == 0;
+        if (fd >= 0) {
+                saved_ok = close(fd) == 0 && saved_ok;
+        }
+        saved_ok = saved_ok && rename(temp, cache->path) == 0;
+        if (!saved_ok) {
+                fprintf(stderr, "cannot save %s: %s\n", cache->path,
+                        strerror(errno));
+                if (fd >= 0) {
+                        unlink(temp);
+                }
+        }
+        FREE(temp);
+        free(saved);
+}
+
+void Umcache_free(Umcache *cache)
+{
+        assert(cache && *cache);
+        FREE((*cache)->path);
+        FREE(*cache);
+}
@@ -0,0 +1,40 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umcache.h
+ *
+ * Interface of the Umcache module: a directory of machines saved just
+ * after their image unpacked itself (see Um_stop_at_unpack), one file
+ * per image, named by a hash of the image's bytes
+ *
+ */
+
+#ifndef UMCACHE_H_
+#define UMCACHE_H_
+
+#include <stdio.h>
+
+#include "um.h"
+
+typedef struct Umcache *Umcache;
+
+/* the cache entry in dir for image, which is read through to hash it */
+Umcache Umcache_new(const char *dir, FILE *image);
+
+/*
+ * the machine saved for the image, or NULL if there is none or its file
+ * fails the checksum; the file is mapped, not read, and left as it is
+ */
+Um Umcache_load(Umcache cache);
+
+/*
+ * saves a machine that Um_run has just stopped with UM_UNPACKED; the
+ * file is written under a temporary name and renamed into place, so
+ * any number of processes may load and save the same entry at once
+ */
+void Umcache_save(Umcache cache, Um machine);
+
+void Umcache_free(Umcache *cache);
+
+#endif
@@ -0,0 +1,428 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umfuzz: fuzzes the input of a UM program in process
+ *
+ * usage: umfuzz [-n runs] [-t seconds] [-s seed] [-l length]
+ *               [-i instructions] [-m words] [-o dir] image [seed files]
+ *
+ * The image is loaded once and run until its first IN finds no input;
+ * that machine is saved with Um_snapshot, and every run starts from it
+ * with Um_restore, which copies back only the chunks of the segments
+ * that run wrote. A run reads its input from a buffer, then EOF. Inputs
+ * are mutated from a corpus, which starts with the seed files (or one
+ * empty input) and keeps every input that gives a LOADP edge a count in
+ * a range it has not had before, as AFL counts edges. A run that passes
+ * the instruction budget (default 10000000) is a hang, and one refused
+ * a MAP by the memory quota (default none) runs out of memory; with -o
+ * both are saved to dir, as is the corpus. A run that crashes the
+ * machine (a failed assertion, a bad address, a division by 0, or an
+ * SLOAD or SSTORE outside its segment, which the fuzz build checks)
+ * stops umfuzz, after it saves the input to dir/crash, or prints it.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "seq.h"
+#include "um.h"
+
+#define EDGES (1 << 16)
+#define REPORT_EVERY 4096       /* runs between looks at the clock */
+#define SAVED_HANGS 16          /* most hangs or ooms written to dir */
+
+typedef struct Input {
+        size_t len;
+        unsigned char bytes[];
+} *Input;
+
+/* the input being run, where a crash handler can find it */
+static unsigned char *current;
+static size_t current_len, current_next, max_len = 256;
+static bool started;            /* past the setup of the machine */
+static const char *out_dir;
+
+static uint8_t edges[EDGES];
+static uint8_t seen[EDGES];     /* count ranges seen per edge, one bit each */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+        return rng_state;
+}
+
+/* before the snapshot the machine blocks at its first IN */
+static int fuzz_get(void *cl)
+{
+        (void)cl;
+        if (!started) {
+                return UM_NO_INPUT;
+        }
+        if (current_next == current_len) {
+                return EOF;
+        }
+        return current[current_next++];
+}
+
+static void fuzz_put(int c, void *cl)
+{
+        (void)c;
+        (void)cl;
+}
+
+/* writes bytes to dir/name, with only async-signal-safe calls */
+static void save(const char *name, const unsigned char *bytes, size_t len)
+{
+        char path[4096];
+        size_t dir_len = strlen(out_dir), name_len = strlen(name);
+        if (dir_len + name_len + 2 > sizeof(path)) {
+                return;
+        }
+        memcpy(path, out_dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+                if (write(fd, bytes, len) < 0) {
+                        /* nothing left to do about it */
+                }
+                close(fd);
+        }
+}
+
+static void on_crash(int sig)
+{
+        static const char hex[] = "0123456789abcdef";
+        const char *msg = "umfuzz: the machine crashed on this input\n";
+        if (write(2, msg, strlen(msg)) < 0) {
+                _exit(1);
+        }
+        if (out_dir) {
+                save("crash", current, current_len);
+        } else {
+                for (size_t i = 0; i < current_len; ++i) {
+                        char pair[2] = { hex[current[i] >> 4],
+                                         hex[current[i] & 15] };
+                        if (write(2, pair, 2) < 0) {
+                                break;
+                        }
+                }
+                if (write(2, "\n", 1) < 0) {
+                        _exit(1);
+                }
+        }
+        signal(sig, SIG_DFL);
+        raise(sig);
+}
+
+static Input Input_new(const unsigned char *bytes, size_t len)
+{
+        Input input = ALLOC(sizeof(*input) + len + 1);
+        input->len = len;
+        memcpy(input->bytes, bytes, len);
+        return input;
+}
+
+static Input read_seed(const char *path)
+{
+        FILE *fp = fopen(path, "rb");
+        assert(fp);
+        unsigned char *bytes = ALLOC(max_len + 1);
+        size_t len = fread(bytes, 1, max_len, fp);
+        fclose(fp);
+        Input input = Input_new(bytes, len);
+        FREE(bytes);
+        return input;
+}
+
+/*
+ * the count range of a count, one bit each: 1, 2, 3, 4-7, 8-15, 16-31,
+ * 32-127, 128 and up
+ */
+static uint8_t range_bit(uint8_t count)
+{
+        if (count <= 3) {
+                return 1 << (count - 1);
+        }
+        if (count < 8) {
+                return 8;
+        }
+        if (count < 16) {
+                return 16;
+        }
+        if (count < 32) {
+                return 32;
+        }
+        return count < 128 ? 64 : 128;
+}
+
+/* merges this run's edges into seen; true if any range is new */
+static bool new_coverage(void)
+{
+        bool found = false;
+        uint64_t *words = (uint64_t *)edges;
+        for (size_t w = 0; w < EDGES / 8; ++w) {
+                if (words[w] == 0) {
+                        continue;
+                }
+                for (size_t i = w * 8; i < w * 8 + 8; ++i) {
+                        if (edges[i] == 0) {
+                                continue;
+                        }
+                        uint8_t bit = range_bit(edges[i]);
+                        if ((seen[i] & bit) == 0) {
+                                seen[i] |= bit;
+                                found = true;
+                        }
+                }
+        }
+        return found;
+}
+
+static size_t edges_seen(void)
+{
+        size_t n = 0;
+        for (size_t i = 0; i < EDGES; ++i) {
+                n += seen[i] != 0;
+        }
+        return n;
+}
+
+/* bytes a mutation prefers: the seeds' own, and digits and separators */
+static unsigned char dictionary[256];
+static size_t dictionary_len;
+
+static void add_to_dictionary(unsigned char c)
+{
+        if (memchr(dictionary, c, dictionary_len) == NULL) {
+                dictionary[dictionary_len++] = c;
+        }
+}
+
+static unsigned char some_byte(void)
+{
+        if (rng() % 4 == 0) {
+                return rng();
+        }
+        return dictionary[rng() % dictionary_len];
+}
+
+/* a few random edits of parent, sometimes spliced with other */
+static size_t mutate(unsigned char *out, Input parent, Input other)
+{
+        size_t len = parent->len;
+        memcpy(out, parent->bytes, len);
+        int edits = 1 + rng() % 4;
+        for (int e = 0; e < edits; ++e) {
+                size_t at = len ? rng() % len : 0;
+                switch (rng() % 6) {
+                case 0:
+                        if (len) {
+                                out[at] ^= 1 << (rng() % 8);
+                        }
+                        break;
+                case 1:
+                        if (len) {
+                                out[at] = some_byte();
+                        }
+                        break;
+                case 2:
+                        if (len < max_len) {
+                                memmove(out + at + 1, out + at, len - at);
+                                out[at] = some_byte();
+                                len++;
+                        }
+                        break;
+                case 3:
+                        if (len) {
+                                memmove(out + at, out + at + 1, len - at - 1);
+                                len--;
+                        }
+                        break;
+                case 4: {
+                        /* repeat a piece */
+                        size_t n = len - at < 8 ? len - at : 8;
+                        if (n && len + n <= max_len) {
+                                memmove(out + at + n, out + at, len - at);
+                                len += n;
+                        }
+                        break;
+                }
+                default: {
+                        /* splice in the tail of another input */
+                        size_t from = other->len ? rng() % other->len : 0;
+                        size_t n = other->len - from;
+                        n = at + n > max_len ? max_len - at : n;
+                        memcpy(out + at, other->bytes + from, n);
+                        len = at + n;
+                        break;
+                }
+                }
+        }
+        return len;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+        uint64_t runs = 0, budget = 10000000, words = 0;
+        double seconds = 0;
+        int opt;
+        while ((opt = getopt(argc, argv, "n:t:s:l:i:m:o:")) != -1) {
+                switch (opt) {
+                case 'n': runs = strtoull(optarg, NULL, 0); break;
+                case 't': seconds = atof(optarg); break;
+                case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+                case 'l': max_len = strtoull(optarg, NULL, 0); break;
+                case 'i': budget = strtoull(optarg, NULL, 0); break;
+                case 'm': words = strtoull(optarg, NULL, 0); break;
+                case 'o': out_dir = optarg; break;
+                default:
+                        fprintf(stderr, "usage: %s [-n runs] [-t seconds] "
+                                "[-s seed] [-l length] [-i instructions] "
+                                "[-m words] [-o dir] image [seeds]\n",
+                                argv[0]);
+                        return 1;
+                }
+        }
+        if (argc - optind < 1 || max_len == 0) {
+                fprintf(stderr, "usage: %s [options] image [seeds]\n",
+                        argv[0]);
+                return 1;
+        }
+
+        Seq_T corpus = Seq_new(0);
+        for (int i = optind + 1; i < argc; ++i) {
+                Seq_addhi(corpus, read_seed(argv[i]));
+        }
+        if (Seq_length(corpus) == 0) {
+                Seq_addhi(corpus, Input_new((const unsigned char *)"", 0));
+        }
+        const char *common = "0123456789 \n";
+        for (size_t i = 0; common[i]; ++i) {
+                add_to_dictionary(common[i]);
+        }
+        for (int i = 0; i < Seq_length(corpus); ++i) {
+                Input seed = Seq_get(corpus, i);
+                for (size_t j = 0; j < seed->len; ++j) {
+                        add_to_dictionary(seed->bytes[j]);
+                }
+        }
+
+        FILE *program = fopen(argv[optind], "r");
+        assert(program);
+        Um machine = Um_new(program);
+        fclose(program);
+        Um_io io = { fuzz_get, fuzz_put, NULL };
+        Um_set_io(machine, &io);
+        Um_set_quota(machine, words, budget);
+        if (Um_run(machine) != UM_BLOCKED) {
+                fprintf(stderr, "%s: %s never reads input\n", argv[0],
+                        argv[optind]);
+                return 1;
+        }
+        Um_snapshot(machine);
+        Um_trace_edges(machine, edges, EDGES);
+        started = true;
+
+        current = ALLOC(max_len + 1);
+        signal(SIGSEGV, on_crash);
+        signal(SIGBUS, on_crash);
+        signal(SIGFPE, on_crash);
+        signal(SIGABRT, on_crash);
+
+        uint64_t run = 0, hangs = 0, ooms = 0;
+        double start = now(), last = start;
+        char name[64];
+        for (;;) {
+                /* every seed as it is, then mutants */
+                if (run < (uint64_t)Seq_length(corpus)) {
+                        Input seed = Seq_get(corpus, run);
+                        memcpy(current, seed->bytes, seed->len);
+                        current_len = seed->len;
+                } else {
+                        int n = Seq_length(corpus);
+                        current_len = mutate(current,
+                                             Seq_get(corpus, rng() % n),
+                                             Seq_get(corpus, rng() % n));
+                }
+                current_next = 0;
+
+                Um_restore(machine);
+                Um_set_quota(machine, words, Um_executed(machine) + budget);
+                memset(edges, 0, sizeof(edges));
+                Um_status status = Um_run(machine);
+                run++;
+
+                if (status == UM_OVER_BUDGET || status == UM_OVER_MEMORY) {
+                        uint64_t *count = status == UM_OVER_BUDGET ? &hangs
+                                                                   : &ooms;
+                        if (out_dir && *count < SAVED_HANGS) {
+                                snprintf(name, sizeof(name), "%s-%" PRIu64,
+                                         status == UM_OVER_BUDGET ? "hang"
+                                                                  : "oom",
+                                         *count);
+                                save(name, current, current_len);
+                        }
+                        (*count)++;
+                } else if (new_coverage()) {
+                        if (out_dir) {
+                                snprintf(name, sizeof(name), "corpus-%d",
+                                         Seq_length(corpus));
+                                save(name, current, current_len);
+                        }
+                        Seq_addhi(corpus, Input_new(current, current_len));
+                }
+
+                bool done = runs && run >= runs;
+                if (done || run % REPORT_EVERY == 0) {
+                        double t = now();
+                        if (done || t - last >= 1 || (seconds
+                            && t - start >= seconds)) {
+                                fprintf(stderr, "%" PRIu64 " runs, %.0f/s, "
+                                        "corpus %d, %zu edges, %" PRIu64
+                                        " hangs, %" PRIu64 " ooms\n", run,
+                                        run / (t - start),
+                                        Seq_length(corpus), edges_seen(),
+                                        hangs, ooms);
+                                last = t;
+                        }
+                        if (seconds && t - start >= seconds) {
+                                done = true;
+                        }
+                }
+                if (done) {
+                        break;
+                }
+        }
+
+        while (Seq_length(corpus) > 0) {
+                Input input = Seq_remhi(corpus);
+                FREE(input);
+        }
+        Seq_free(&corpus);
+        FREE(current);
+        Um_free(&machine);
+        return 0;
+}
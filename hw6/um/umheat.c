@@ -0,0 +1,381 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umheat: samples a UM program's SLOADs and SSTOREs and reports on them
+ *
+ * usage: umheat [-p period] [-b burst] -o samples image
+ *        umheat -r samples
+ *
+ * The first form runs the program as um would, reading stdin and
+ * writing stdout, on um-access.o: the special engine built with
+ * -DUM_ACCESS. Of every period accesses (default 2^20) the first burst
+ * (default 4096) go into a ring shared with a writer thread, which
+ * copies them to the samples file as it goes; a record is the access's
+ * number, segment, offset, the segment's size and whether the machine's
+ * segment TLB knew the segment. Runs of consecutive accesses let the
+ * report see what follows what without keeping every access. The
+ * report, on stderr after the run or from an old file with -r, gives
+ * the fraction of TLB hits and, for the ids accessed most, a heat map
+ * of where in the segment the accesses fall; the accesses by segment
+ * size class; the stride from each access to the next; and the reuse
+ * distance of each 16-word line, the number of other lines touched
+ * since it was last touched, within a burst.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "um.h"
+
+#define RING_RECORDS (1 << 16)
+#define LINE_BITS 4             /* 16 words, 64 bytes */
+#define HEAT_BUCKETS 64
+#define HEAT_IDS 8
+#define SIZE_CLASSES 33         /* sizes under 2^k words, k <= 32 */
+#define DISTANCES 16            /* 0, 1, 2-3, ... 2^14 and over */
+
+static Um_ring ring;
+static FILE *out;
+static volatile bool finished;
+
+/* moves what the machine has written to the samples file */
+static void *write_samples(void *arg)
+{
+        (void)arg;
+        for (;;) {
+                bool last = __atomic_load_n(&finished, __ATOMIC_ACQUIRE);
+                uint64_t head = __atomic_load_n(&ring.head,
+                                                __ATOMIC_ACQUIRE);
+                uint64_t tail = ring.tail;
+                while (tail < head) {
+                        uint64_t at = tail & ring.mask;
+                        uint64_t n = head - tail;
+                        if (n > ring.mask + 1 - at) {
+                                n = ring.mask + 1 - at;
+                        }
+                        fwrite(ring.records + at, sizeof(Um_access), n, out);
+                        tail += n;
+                        __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+                }
+                if (last) {
+                        return NULL;
+                }
+                struct timespec nap = { 0, 1000000 };
+                nanosleep(&nap, NULL);
+        }
+}
+
+static void record(const char *image, const char *path, uint32_t period,
+                   uint32_t burst)
+{
+        FILE *program = fopen(image, "r");
+        assert(program);
+        Um machine = Um_new(program);
+        fclose(program);
+        out = fopen(path, "wb");
+        if (out == NULL) {
+                perror(path);
+                exit(1);
+        }
+
+        ring.mask = RING_RECORDS - 1;
+        ring.records = ALLOC(RING_RECORDS * sizeof(Um_access));
+        Um_sample_accesses(machine, &ring, period, burst);
+        pthread_t writer;
+        pthread_create(&writer, NULL, write_samples, NULL);
+
+        Um_status status = Um_run(machine);
+        fflush(stdout);
+        assert(status == UM_HALTED);
+        __atomic_store_n(&finished, true, __ATOMIC_RELEASE);
+        pthread_join(writer, NULL);
+        fclose(out);
+        if (ring.dropped > 0) {
+                fprintf(stderr, "%" PRIu64 " records dropped on a full "
+                        "ring\n", ring.dropped);
+        }
+        FREE(ring.records);
+        Um_free(&machine);
+}
+
+typedef struct Id_stats {
+        uint32_t id, size;
+        uint64_t loads, stores;
+        uint64_t heat[HEAT_BUCKETS];
+} Id_stats;
+
+static int by_accesses(const void *a, const void *b)
+{
+        const Id_stats *x = a, *y = b;
+        uint64_t m = x->loads + x->stores, n = y->loads + y->stores;
+        return (m < n) - (m > n);
+}
+
+/* k for a size or distance in [2^(k-1), 2^k), 0 for 0 */
+static int log_class(uint64_t n)
+{
+        int k = 0;
+        while (n > 0) {
+                n >>= 1;
+                ++k;
+        }
+        return k;
+}
+
+static void print_heat(Id_stats *stats)
+{
+        static const char shades[] = " .:-=+*#%@";
+        uint64_t most = 1;
+        for (int i = 0; i < HEAT_BUCKETS; ++i) {
+                most = stats->heat[i] > most ? stats->heat[i] : most;
+        }
+        char row[HEAT_BUCKETS + 1];
+        for (int i = 0; i < HEAT_BUCKETS; ++i) {
+                /* shades are logarithmic: @ is the hottest bucket */
+                int shade = stats->heat[i] == 0 ? 0
+                            : 1 + 8 * log_class(stats->heat[i])
+                                  / log_class(most);
+                row[i] = shades[shade > 9 ? 9 : shade];
+        }
+        row[HEAT_BUCKETS] = '\0';
+        fprintf(stderr, "  %8u %10u words %10" PRIu64 " ld %10" PRIu64
+                " st |%s|\n", stats->id, stats->size, stats->loads,
+                stats->stores, row);
+}
+
+/* a Fenwick tree over positions in a burst, to count distinct lines */
+static void tree_add(int32_t *tree, uint32_t n, uint32_t at, int32_t d)
+{
+        for (++at; at <= n; at += at & -at) {
+                tree[at] += d;
+        }
+}
+
+static int32_t tree_sum(int32_t *tree, uint32_t at)
+{
+        int32_t sum = 0;
+        for (; at > 0; at -= at & -at) {
+                sum += tree[at];
+        }
+        return sum;
+}
+
+typedef struct Line {
+        uint64_t key;           /* id and line, + 1; 0 when empty */
+        uint32_t last;          /* position last touched in the burst */
+        uint32_t burst;         /* burst the entry belongs to */
+} Line;
+
+static void report(const char *path)
+{
+        FILE *in = fopen(path, "rb");
+        if (in == NULL) {
+                perror(path);
+                exit(1);
+        }
+        size_t n = 0, cap = 1 << 16;
+        Um_access *records = ALLOC(cap * sizeof(Um_access));
+        size_t got;
+        while ((got = fread(records + n, sizeof(Um_access), cap - n, in))
+               > 0) {
+                n += got;
+                if (n == cap) {
+                        cap *= 2;
+                        RESIZE(records, cap * sizeof(Um_access));
+                }
+        }
+        fclose(in);
+        if (n == 0) {
+                fprintf(stderr, "%s: no accesses\n", path);
+                FREE(records);
+                return;
+        }
+
+        /* by id: ids are dense, so index an array by them */
+        uint32_t ids = 0;
+        for (size_t i = 0; i < n; ++i) {
+                ids = records[i].id >= ids ? records[i].id + 1 : ids;
+        }
+        Id_stats *stats = CALLOC(ids, sizeof(Id_stats));
+        uint64_t by_class[SIZE_CLASSES] = { 0 };
+        uint64_t stores = 0, hits = 0;
+        for (size_t i = 0; i < n; ++i) {
+                Um_access *a = &records[i];
+                Id_stats *s = &stats[a->id];
+                s->id = a->id;
+                s->size = a->size > s->size ? a->size : s->size;
+                if (a->flags & UM_ACCESS_STORE) {
+                        s->stores++;
+                        stores++;
+                } else {
+                        s->loads++;
+                }
+                hits += (a->flags & UM_ACCESS_TLB_HIT) != 0;
+                by_class[log_class(a->size)]++;
+        }
+        for (size_t i = 0; i < n; ++i) {
+                Id_stats *s = &stats[records[i].id];
+                uint64_t bucket = (uint64_t)records[i].offset * HEAT_BUCKETS
+                                  / (s->size ? s->size : 1);
+                s->heat[bucket < HEAT_BUCKETS ? bucket : HEAT_BUCKETS - 1]++;
+        }
+
+        /* strides and reuse distances, within runs of consecutive seqs */
+        size_t longest = 1, run = 1;
+        for (size_t i = 1; i < n; ++i) {
+                run = records[i].seq == records[i - 1].seq + 1 ? run + 1 : 1;
+                longest = run > longest ? run : longest;
+        }
+        uint32_t table_size = 1;
+        while (table_size < 2 * longest) {
+                table_size <<= 1;
+        }
+        Line *lines = CALLOC(table_size, sizeof(Line));
+        int32_t *tree = CALLOC(longest + 1, sizeof(int32_t));
+        uint64_t same = 0, next = 0, back = 0, near = 0, far = 0;
+        uint64_t other = 0, distances[DISTANCES] = { 0 }, first = 0;
+        uint32_t burst = 0;
+        for (size_t start = 0, end; start < n; start = end) {
+                end = start + 1;
+                while (end < n
+                       && records[end].seq == records[end - 1].seq + 1) {
+                        ++end;
+                }
+                uint32_t len = end - start;
+                burst++;
+                memset(tree, 0, (len + 1) * sizeof(int32_t));
+                for (uint32_t pos = 0; pos < len; ++pos) {
+                        Um_access *a = &records[start + pos];
+                        if (pos > 0) {
+                                Um_access *p = a - 1;
+                                int64_t stride = (int64_t)a->offset
+                                                 - p->offset;
+                                if (a->id != p->id) {
+                                        other++;
+                                } else if (stride == 0) {
+                                        same++;
+                                } else if (stride == 1) {
+                                        next++;
+                                } else if (stride == -1) {
+                                        back++;
+                                } else if (stride >= -16 && stride <= 16) {
+                                        near++;
+                                } else {
+                                        far++;
+                                }
+                        }
+
+                        /* lines of earlier bursts count as empty */
+                        uint64_t key = ((uint64_t)a->id << 32
+                                        | a->offset >> LINE_BITS) + 1;
+                        uint32_t h = (uint32_t)((key * 0x9e3779b97f4a7c15ULL)
+                                                >> 40) & (table_size - 1);
+                        while (lines[h].burst == burst
+                               && lines[h].key != key) {
+                                h = (h + 1) & (table_size - 1);
+                        }
+                        if (lines[h].burst == burst) {
+                                uint32_t last = lines[h].last;
+                                int32_t between = tree_sum(tree, pos)
+                                                  - tree_sum(tree, last + 1);
+                                int k = log_class(between);
+                                distances[k < DISTANCES ? k
+                                                        : DISTANCES - 1]++;
+                                tree_add(tree, len, last, -1);
+                        } else {
+                                first++;
+                        }
+                        lines[h] = (Line){ key, pos, burst };
+                        tree_add(tree, len, pos, 1);
+                }
+        }
+
+        fprintf(stderr, "%zu accesses sampled (%.1f%% stores), %" PRIu32
+                " bursts, %u ids\n", n, 100.0 * stores / n, burst, ids);
+        fprintf(stderr, "segment TLB hits %.1f%%\n", 100.0 * hits / n);
+        qsort(stats, ids, sizeof(Id_stats), by_accesses);
+        fprintf(stderr, "ids accessed most, with where in the segment:\n");
+        for (uint32_t i = 0; i < ids && i < HEAT_IDS; ++i) {
+                if (stats[i].loads + stats[i].stores > 0) {
+                        print_heat(&stats[i]);
+                }
+        }
+        fprintf(stderr, "accesses by segment size:\n");
+        for (int k = 0; k < SIZE_CLASSES; ++k) {
+                if (by_class[k] > 0) {
+                        fprintf(stderr, "  < %10" PRIu64 " words %6.2f%%\n",
+                                (uint64_t)1 << k,
+                                100.0 * by_class[k] / n);
+                }
+        }
+        uint64_t pairs = same + next + back + near + far + other;
+        if (pairs > 0) {
+                fprintf(stderr, "stride to the next access: same word "
+                        "%.1f%%, +1 %.1f%%, -1 %.1f%%, within 16 %.1f%%, "
+                        "farther %.1f%%, another segment %.1f%%\n",
+                        100.0 * same / pairs, 100.0 * next / pairs,
+                        100.0 * back / pairs, 100.0 * near / pairs,
+                        100.0 * far / pairs, 100.0 * other / pairs);
+        }
+        fprintf(stderr, "reuse distance of a 16-word line, in other lines "
+                "(first touch in a burst: %.1f%%):\n", 100.0 * first / n);
+        for (int k = 0; k < DISTANCES; ++k) {
+                if (distances[k] > 0) {
+                        fprintf(stderr, "  %s%6" PRIu64 " %6.2f%%\n",
+                                k == DISTANCES - 1 ? ">=" : "< ",
+                                k ? (uint64_t)1 << (k == DISTANCES - 1
+                                                    ? k - 1 : k)
+                                  : 1,
+                                100.0 * distances[k] / n);
+                }
+        }
+        FREE(lines);
+        FREE(tree);
+        FREE(stats);
+        FREE(records);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *samples = NULL, *old = NULL;
+        uint32_t period = 1 << 20, burst = 4096;
+        int opt;
+        while ((opt = getopt(argc, argv, "p:b:o:r:")) != -1) {
+                if (opt == 'p') {
+                        period = strtoul(optarg, NULL, 0);
+                } else if (opt == 'b') {
+                        burst = strtoul(optarg, NULL, 0);
+                } else if (opt == 'o') {
+                        samples = optarg;
+                } else if (opt == 'r') {
+                        old = optarg;
+                } else {
+                        break;
+                }
+        }
+        bool recording = samples != NULL && argc - optind == 1;
+        if ((old == NULL) == !recording || period == 0
+            || (period & (period - 1)) != 0 || burst == 0) {
+                fprintf(stderr, "usage: %s [-p period] [-b burst] -o samples"
+                        " image\n       %s -r samples\n", argv[0], argv[0]);
+                return 1;
+        }
+        if (recording) {
+                record(argv[optind], samples, period, burst);
+                report(samples);
+        } else {
+                report(old);
+        }
+        return 0;
+}
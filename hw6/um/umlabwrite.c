@@ -20,6 +20,8 @@ void emit_test_cmov(Seq_T stream);
 void emit_map_unmap_sload_sstore(Seq_T stream);
 void emit_map_unmap(Seq_T stream);
 void emit_time_test(Seq_T stream);
+void emit_fill_copy_test(Seq_T stream);
+void emit_copy_code_test(Seq_T stream);
 
 
 /* The array `tests` contains all unit tests for the lab. */
@@ -41,7 +43,9 @@ static struct test_info {
         { "cmov", NULL, "YX", emit_test_cmov },
         { "sload_sstore", NULL, "bab", emit_map_unmap_sload_sstore },
         { "time", NULL, NULL, emit_time_test },
-        { "map_unmap", NULL, "11111111111111111111111111111111111111111111111111", emit_map_unmap }
+        { "map_unmap", NULL, "11111111111111111111111111111111111111111111111111", emit_map_unmap },
+        { "fill_copy", NULL, "0xxyy", emit_fill_copy_test },
+        { "copy_code", NULL, "ab", emit_copy_code_test }
 
 };
 
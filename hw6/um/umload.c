@@ -0,0 +1,241 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/10/17
+ *
+ * umload: measures umserver from the client side
+ *
+ * usage: umload [-k keys] [-p pid] socket sessions rounds
+ *        umload -e bytes [-p pid] socket
+ *
+ * Opens sessions connections, then for rounds rounds sends keys to each
+ * session in turn and waits for a newline back, timing each round trip
+ * while every other session sits parked in the server; a first, untimed
+ * round waits for the server to set every session up. The default keys,
+ * "1\np ", make calc40 print one line and leave its stack empty again.
+ * Prints the median, 99th percentile and worst keystroke latency and,
+ * given the server's pid, its resident memory per session and the
+ * number of such sessions that fit in a gigabyte.
+ *
+ * With -e, for a server running cat.um, one session is sent up to bytes
+ * of a pattern, reading nothing, until the socket has taken no more for
+ * SEND_WAIT ms, then half-closed with its echo backed up in the server.
+ * Nothing is read for a second, over which the server's CPU time is
+ * printed, given its pid; then the echo is read to the end and checked
+ * against what was sent. Exits 1 if it differs.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+
+#define SEND_WAIT 200         /* ms a full socket is given to drain */
+
+static double now_us(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int connect_to(const char *path)
+{
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        assert(strlen(path) < sizeof(addr.sun_path));
+        strcpy(addr.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        int connected = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        assert(connected == 0);
+        return fd;
+}
+
+/* sends keys and reads until the reply contains a newline */
+static double keystroke(int fd, const char *keys)
+{
+        char reply[256];
+        double start = now_us();
+        ssize_t sent = write(fd, keys, strlen(keys));
+        assert(sent == (ssize_t)strlen(keys));
+        for (;;) {
+                ssize_t n = read(fd, reply, sizeof(reply));
+                assert(n > 0);
+                if (memchr(reply, '\n', n) != NULL)
+                        return now_us() - start;
+        }
+}
+
+/* resident set size of process pid in kB, from /proc */
+static long rss_kb(long pid)
+{
+        char path[64], line[256];
+        long kb = -1;
+        snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+        FILE *status = fopen(path, "r");
+        assert(status);
+        while (fgets(line, sizeof(line), status) != NULL) {
+                if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+                        break;
+        }
+        fclose(status);
+        return kb;
+}
+
+/* user and system clock ticks process pid has used, from /proc */
+static long cpu_ticks(long pid)
+{
+        char path[64];
+        long user = 0, sys = 0;
+        snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+        FILE *stat = fopen(path, "r");
+        assert(stat);
+        int got = fscanf(stat, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u "
+                         "%*u %*u %*u %*u %ld %ld", &user, &sys);
+        assert(got == 2);
+        fclose(stat);
+        return user + sys;
+}
+
+/* takes what has come back so far, checking it against the pattern */
+static bool take_echo(int fd, long *got)
+{
+        char chunk[4096];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+                for (ssize_t i = 0; i < n; ++i) {
+                        if (chunk[i] != (char)((*got + i) % 251)) {
+                                return false;
+                        }
+                }
+                *got += n;
+        }
+        return n == 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int echo_check(const char *path, long bytes, long pid)
+{
+        int fd = connect_to(path);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        char chunk[4096];
+        long sent = 0, got = 0;
+        bool good = true, full = false;
+        while (good && !full && sent < bytes) {
+                long len = bytes - sent < (long)sizeof(chunk)
+                           ? bytes - sent : (long)sizeof(chunk);
+                for (long i = 0; i < len; ++i) {
+                        chunk[i] = (sent + i) % 251;
+                }
+                ssize_t n = send(fd, chunk, len, MSG_NOSIGNAL);
+                if (n > 0) {
+                        sent += n;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        struct pollfd p = { fd, POLLOUT, 0 };
+                        full = poll(&p, 1, SEND_WAIT) == 0;
+                } else {
+                        good = false;
+                }
+        }
+        shutdown(fd, SHUT_WR);
+
+        long ticks = pid ? cpu_ticks(pid) : 0;
+        sleep(1);
+        if (pid) {
+                printf("server used %ld ticks in 1 s after the half-close, "
+                       "with %ld bytes not yet read\n",
+                       cpu_ticks(pid) - ticks, sent - got);
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        good = good && take_echo(fd, &got) && got == sent;
+        close(fd);
+        printf("sent %ld bytes, %ld echoed%s\n", sent, got,
+               good ? "" : ": FAILED");
+        return good ? 0 : 1;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+        double x = *(const double *)a, y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *keys = "1\np ";
+        long pid = 0, echo_bytes = 0;
+        int opt;
+        while ((opt = getopt(argc, argv, "k:p:e:")) != -1) {
+                if (opt == 'k') {
+                        keys = optarg;
+                } else if (opt == 'e') {
+                        echo_bytes = atol(optarg);
+                } else if (opt == 'p') {
+                        pid = atol(optarg);
+                } else {
+                        break;
+                }
+        }
+        if (echo_bytes > 0 && argc - optind == 1) {
+                return echo_check(argv[optind], echo_bytes, pid);
+        }
+        if (argc - optind != 3) {
+                fprintf(stderr, "usage: %s [-k keys] [-p pid] socket "
+                        "sessions rounds\n"
+                        "       %s -e bytes [-p pid] socket\n", argv[0],
+                        argv[0]);
+                return 1;
+        }
+        const char *path = argv[optind];
+        long sessions = atol(argv[optind + 1]);
+        long rounds = atol(argv[optind + 2]);
+        assert(sessions > 0 && rounds > 0);
+
+        long base_kb = pid ? rss_kb(pid) : 0;
+        int *fds = CALLOC(sessions, sizeof(int));
+        for (long i = 0; i < sessions; ++i)
+                fds[i] = connect_to(path);
+
+        /* one round untimed, so every session has been set up */
+        for (long i = 0; i < sessions; ++i)
+                keystroke(fds[i], keys);
+
+        long samples = sessions * rounds;
+        double *latency = CALLOC(samples, sizeof(double));
+        for (long r = 0; r < rounds; ++r)
+                for (long i = 0; i < sessions; ++i)
+                        latency[r * sessions + i] = keystroke(fds[i], keys);
+
+        qsort(latency, samples, sizeof(double), compare_doubles);
+        printf("%ld sessions, %ld keystrokes: p50 %.1f us, p99 %.1f us, "
+               "max %.1f us\n", sessions, samples, latency[samples / 2],
+               latency[samples * 99 / 100], latency[samples - 1]);
+
+        if (pid) {
+                double per_session = (double)(rss_kb(pid) - base_kb)
+                                     / sessions;
+                printf("server rss %ld kB: %.1f kB per session, "
+                       "%.0f sessions/GB\n", rss_kb(pid), per_session,
+                       1024.0 * 1024.0 / per_session);
+        }
+
+        for (long i = 0; i < sessions; ++i)
+                close(fds[i]);
+        FREE(fds);
+        FREE(latency);
+        return 0;
+}
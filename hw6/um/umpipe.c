@@ -0,0 +1,186 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * Implementation of Umpipe module
+ *
+ * The ring has one writer and one reader. Each byte is published with a
+ * release store of head, and taken with one of tail; each end keeps the
+ * last value it loaded of the other's counter, and loads it again only
+ * when the ring looks full or empty, so a byte costs no more than a few
+ * plain moves. An end that finds nothing to do sleeps on a futex, after
+ * saying so in its sleeping flag; the other end checks that flag, behind
+ * a full fence, only every WAKE_BYTES bytes and whenever it stops itself
+ * (the writer blocked on input, halted or facing a full ring; the reader
+ * about to sleep or dropping the pipe), so a sleeper may wait for a
+ * batch but never for nothing.
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "um.h"
+#include "umpipe.h"
+
+#define RING_BYTES (1 << 16)
+#define WAKE_BYTES (RING_BYTES / 4)
+
+/* a writer's and a reader's fields, never on the same cache line */
+struct Umpipe {
+        struct {
+                uint32_t head;          /* bytes put */
+                uint32_t closed;
+                uint32_t sleeping;      /* waiting for room */
+                uint32_t room;          /* futex: bumped to wake it */
+                uint32_t seen_tail;
+                uint32_t unwoken;       /* bytes put since a wake */
+        } w;
+        unsigned char apart[64];
+        struct {
+                uint32_t tail;          /* bytes taken */
+                uint32_t dropped;
+                uint32_t sleeping;      /* waiting for bytes */
+                uint32_t bytes;         /* futex: bumped to wake it */
+                uint32_t seen_head;
+                uint32_t unwoken;       /* bytes taken since a wake */
+        } r;
+        unsigned char after[64];
+        unsigned char ring[RING_BYTES];
+};
+
+static void futex_wait(uint32_t *word, uint32_t value)
+{
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/* bumps event and wakes whoever sleeps on it, if sleeping says anyone */
+static void wake(uint32_t *sleeping, uint32_t *event)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(sleeping, __ATOMIC_RELAXED)) {
+                __atomic_add_fetch(event, 1, __ATOMIC_SEQ_CST);
+                syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, 1, NULL,
+                        NULL, 0);
+        }
+}
+
+/*
+ * sleeps on event unless ready() holds once sleeping is set; the fence
+ * pairs with wake's, so either this sees the other end's change or the
+ * other end sees the flag
+ */
+static void sleep_unless(uint32_t *sleeping, uint32_t *event,
+                         bool ready(Umpipe), Umpipe pipe)
+{
+        __atomic_store_n(sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint32_t seen = __atomic_load_n(event, __ATOMIC_SEQ_CST);
+        if (!ready(pipe)) {
+                futex_wait(event, seen);
+        }
+        __atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+}
+
+Umpipe Umpipe_new(void)
+{
+        Umpipe pipe;
+        NEW0(pipe);
+        return pipe;
+}
+
+static bool has_room(Umpipe pipe)
+{
+        pipe->w.seen_tail = __atomic_load_n(&pipe->r.tail, __ATOMIC_ACQUIRE);
+        return pipe->w.head - pipe->w.seen_tail < RING_BYTES
+               || __atomic_load_n(&pipe->r.dropped, __ATOMIC_ACQUIRE);
+}
+
+void Umpipe_put(Umpipe pipe, int c)
+{
+        uint32_t head = pipe->w.head;
+        if (head - pipe->w.seen_tail == RING_BYTES) {
+                while (!has_room(pipe)) {
+                        Umpipe_flush(pipe);
+                        sleep_unless(&pipe->w.sleeping, &pipe->w.room,
+                                     has_room, pipe);
+                }
+                if (head - pipe->w.seen_tail == RING_BYTES) {
+                        return;         /* dropped */
+                }
+        }
+        pipe->ring[head % RING_BYTES] = c;
+        __atomic_store_n(&pipe->w.head, head + 1, __ATOMIC_RELEASE);
+        if (++pipe->w.unwoken == WAKE_BYTES) {
+                Umpipe_flush(pipe);
+        }
+}
+
+void Umpipe_flush(Umpipe pipe)
+{
+        assert(pipe);
+        pipe->w.unwoken = 0;
+        wake(&pipe->r.sleeping, &pipe->r.bytes);
+}
+
+void Umpipe_close(Umpipe pipe)
+{
+        assert(pipe);
+        __atomic_store_n(&pipe->w.closed, 1, __ATOMIC_RELEASE);
+        Umpipe_flush(pipe);
+}
+
+static bool has_bytes(Umpipe pipe)
+{
+        bool closed = __atomic_load_n(&pipe->w.closed, __ATOMIC_ACQUIRE);
+        pipe->r.seen_head = __atomic_load_n(&pipe->w.head, __ATOMIC_ACQUIRE);
+        return closed || pipe->r.seen_head != pipe->r.tail;
+}
+
+int Umpipe_get(Umpipe pipe)
+{
+        uint32_t tail = pipe->r.tail;
+        if (tail == pipe->r.seen_head) {
+                if (!has_bytes(pipe)) {
+                        return UM_NO_INPUT;
+                }
+                if (tail == pipe->r.seen_head) {
+                        return EOF;
+                }
+        }
+        int c = pipe->ring[tail % RING_BYTES];
+        __atomic_store_n(&pipe->r.tail, tail + 1, __ATOMIC_RELEASE);
+        if (++pipe->r.unwoken == WAKE_BYTES) {
+                pipe->r.unwoken = 0;
+                wake(&pipe->w.sleeping, &pipe->w.room);
+        }
+        return c;
+}
+
+void Umpipe_wait(Umpipe pipe)
+{
+        assert(pipe);
+        pipe->r.unwoken = 0;
+        wake(&pipe->w.sleeping, &pipe->w.room);
+        sleep_unless(&pipe->r.sleeping, &pipe->r.bytes, has_bytes, pipe);
+}
+
+void Umpipe_drop(Umpipe pipe)
+{
+        assert(pipe);
+        __atomic_store_n(&pipe->r.dropped, 1, __ATOMIC_RELEASE);
+        wake(&pipe->w.sleeping, &pipe->w.room);
+}
+
+void Umpipe_free(Umpipe *pipe)
+{
+        assert(pipe && *pipe);
+        FREE(*pipe);
+}
@@ -0,0 +1,47 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umpipe.h
+ *
+ * Interface of the Umpipe module: a ring of bytes from the output of a
+ * machine run on one thread to the input of a machine run on another,
+ * as a shell pipe is between two um processes
+ *
+ */
+
+#ifndef UMPIPE_H_
+#define UMPIPE_H_
+
+typedef struct Umpipe *Umpipe;
+
+Umpipe Umpipe_new(void);
+
+/*
+ * the writer's end, for an Um_io put: waits while the ring is full,
+ * unless the reader has dropped the pipe, when the byte is thrown away
+ */
+void Umpipe_put(Umpipe pipe, int c);
+
+/* the reader may be asleep: wakes it if anything has been put since */
+void Umpipe_flush(Umpipe pipe);
+
+/* no more bytes are coming: the reader gets EOF once it has the rest */
+void Umpipe_close(Umpipe pipe);
+
+/*
+ * the reader's end, for an Um_io get: the next byte, EOF once the pipe
+ * is closed and empty, or UM_NO_INPUT when it is only empty
+ */
+int Umpipe_get(Umpipe pipe);
+
+/* the reader's wait, after UM_NO_INPUT, for a byte or the close */
+void Umpipe_wait(Umpipe pipe);
+
+/* the reader will take no more: the writer stops waiting on it */
+void Umpipe_drop(Umpipe pipe);
+
+/* once both ends are done */
+void Umpipe_free(Umpipe *pipe);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umprof: runs a UM program and profiles it at the level of its labels
+ *
+ * usage: umprof [-s symbols] [-f hz] [-o folded] image
+ *
+ * The program runs as under um, reading stdin and writing stdout, on
+ * um-prof.o: the special engine built with -DUM_PROFILE, which follows
+ * every "goto ... linking r1" call and its return at LOADP. A SIGPROF
+ * timer (default 1000 times a CPU second) saves the pc and the return
+ * addresses of the calls open into a buffer allocated up front, so the
+ * handler does no more than copy a few words. The symbol map has one
+ * "<hex address> <label>" line per label, as umasm -m writes it; a pc
+ * belongs to the label at or below it. At HALT umprof prints, to
+ * stderr, the labels the most samples were in, by themselves (self) and
+ * with the calls made from them (total), and with -o writes every stack
+ * seen in the folded form of flamegraph.pl, outermost call first
+ * ("main_loop;push_value;grow_copy 12"), one line per stack.
+ */
+
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "um.h"
+
+#define SAMPLE_WORDS (1 << 22)  /* of samples, at 2 words plus a frame */
+#define MAX_FRAMES 64           /* innermost calls kept in a sample */
+#define TOP_LABELS 20
+
+typedef struct Symbol {
+        uint32_t address;
+        char *name;
+} Symbol;
+
+static Symbol *symbols;
+static size_t nsymbols;
+
+/* written only by the SIGPROF handler while Um_run runs */
+static Um machine;
+static uint32_t *samples;
+static volatile size_t used;
+static volatile uint64_t dropped;
+
+static int compare_symbols(const void *a, const void *b)
+{
+        const Symbol *x = a, *y = b;
+        return (x->address > y->address) - (x->address < y->address);
+}
+
+static void read_symbols(const char *path)
+{
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+                perror(path);
+                exit(1);
+        }
+        size_t cap = 256;
+        symbols = ALLOC(cap * sizeof(Symbol));
+        char line[512], name[256];
+        unsigned address;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                if (sscanf(line, "%x %255s", &address, name) != 2) {
+                        continue;
+                }
+                if (nsymbols == cap) {
+                        cap *= 2;
+                        RESIZE(symbols, cap * sizeof(Symbol));
+                }
+                symbols[nsymbols].address = address;
+                symbols[nsymbols].name = ALLOC(strlen(name) + 1);
+                strcpy(symbols[nsymbols].name, name);
+                nsymbols++;
+        }
+        fclose(fp);
+        qsort(symbols, nsymbols, sizeof(Symbol), compare_symbols);
+}
+
+/* index of the label pc belongs to, or nsymbols if it is below them all */
+static size_t symbol_of(uint32_t pc)
+{
+        size_t lo = 0, hi = nsymbols;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (symbols[mid].address <= pc) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo == 0 ? nsymbols : lo - 1;
+}
+
+static void name_of(uint32_t pc, char *buf, size_t size)
+{
+        size_t i = symbol_of(pc);
+        if (i == nsymbols) {
+                snprintf(buf, size, "0x%x", pc);
+        } else {
+                snprintf(buf, size, "%s", symbols[i].name);
+        }
+}
+
+/*
+ * a sample is its number of frames, the pc, then the frames: each the
+ * address of a LOADP that made a call, outermost first
+ */
+static void on_tick(int sig)
+{
+        (void)sig;
+        uint32_t depth;
+        const uint32_t *calls = Um_call_stack(machine, &depth);
+        uint32_t first = depth > MAX_FRAMES ? depth - MAX_FRAMES : 0;
+        uint32_t frames = depth - first;
+        if (used + 2 + frames > SAMPLE_WORDS) {
+                dropped++;
+                return;
+        }
+        uint32_t *sample = samples + used;
+        sample[0] = frames;
+        sample[1] = Um_pc(machine);
+        for (uint32_t i = 0; i < frames; ++i) {
+                sample[2 + i] = calls[first + i] - 1;
+        }
+        used += 2 + frames;
+}
+
+static void start_timer(long hz)
+{
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_tick;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, NULL);
+
+        struct itimerval timer;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void stop_timer(void)
+{
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, NULL);
+        signal(SIGPROF, SIG_IGN);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+        return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* the stack of every sample, folded into one line each, then sorted */
+static char **fold(size_t *count)
+{
+        size_t cap = 1024, n = 0;
+        char **stacks = ALLOC(cap * sizeof(char *));
+        char name[300];
+        for (size_t at = 0; at < used; at += 2 + samples[at]) {
+                uint32_t frames = samples[at];
+                size_t len = 0, room = (frames + 1) * sizeof(name);
+                char *stack = ALLOC(room);
+                for (uint32_t i = 0; i <= frames; ++i) {
+                        uint32_t pc = i < frames ? samples[at + 2 + i]
+                                                 : samples[at + 1];
+                        name_of(pc, name, sizeof(name));
+                        len += snprintf(stack + len, room - len, "%s%s",
+                                        i ? ";" : "", name);
+                }
+                if (n == cap) {
+                        cap *= 2;
+                        RESIZE(stacks, cap * sizeof(char *));
+                }
+                stacks[n++] = stack;
+        }
+        qsort(stacks, n, sizeof(char *), compare_strings);
+        *count = n;
+        return stacks;
+}
+
+static void write_folded(const char *path, char **stacks, size_t n)
+{
+        FILE *out = fopen(path, "w");
+        if (out == NULL) {
+                perror(path);
+                return;
+        }
+        for (size_t i = 0; i < n; ) {
+                size_t j = i;
+                while (j < n && strcmp(stacks[i], stacks[j]) == 0) {
+                        ++j;
+                }
+                fprintf(out, "%s %zu\n", stacks[i], j - i);
+                i = j;
+        }
+        fclose(out);
+}
+
+typedef struct Tally {
+        size_t symbol;
+        uint64_t self, total;
+        size_t last;            /* sample that last counted in total */
+} Tally;
+
+static int by_self(const void *a, const void *b)
+{
+        const Tally *x = a, *y = b;
+        if (x->self != y->self) {
+                return x->self < y->self ? 1 : -1;
+        }
+        return (x->total < y->total) - (x->total > y->total);
+}
+
+static void print_top(size_t nsamples)
+{
+        /* one tally per label, and one for pcs below every label */
+        Tally *tallies = CALLOC(nsymbols + 1, sizeof(Tally));
+        for (size_t i = 0; i <= nsymbols; ++i) {
+                tallies[i].symbol = i;
+                tallies[i].last = SIZE_MAX;
+        }
+        size_t index = 0;
+        for (size_t at = 0; at < used; at += 2 + samples[at], ++index) {
+                uint32_t frames = samples[at];
+                tallies[symbol_of(samples[at + 1])].self++;
+                for (uint32_t i = 0; i <= frames; ++i) {
+                        uint32_t pc = i < frames ? samples[at + 2 + i]
+                                                 : samples[at + 1];
+                        Tally *tally = &tallies[symbol_of(pc)];
+                        if (tally->last != index) {
+                                tally->last = index;
+                                tally->total++;
+                        }
+                }
+        }
+        qsort(tallies, nsymbols + 1, sizeof(Tally), by_self);
+
+        fprintf(stderr, "%zu samples (%llu dropped)\n", nsamples,
+                (unsigned long long)dropped);
+        fprintf(stderr, "%7s %7s  label\n", "self", "total");
+        for (size_t i = 0; i < TOP_LABELS && i <= nsymbols; ++i) {
+                Tally *tally = &tallies[i];
+                if (tally->self == 0) {
+                        break;
+                }
+                fprintf(stderr, "%6.2f%% %6.2f%%  %s\n",
+                        100.0 * tally->self / nsamples,
+                        100.0 * tally->total / nsamples,
+                        tally->symbol < nsymbols
+                                ? symbols[tally->symbol].name
+                                : "(no label)");
+        }
+        FREE(tallies);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *folded = NULL;
+        long hz = 1000;
+        int opt;
+        while ((opt = getopt(argc, argv, "s:f:o:")) != -1) {
+                if (opt == 's') {
+                        read_symbols(optarg);
+                } else if (opt == 'f') {
+                        hz = strtol(optarg, NULL, 0);
+                } else if (opt == 'o') {
+                        folded = optarg;
+                } else {
+                        break;
+                }
+        }
+        if (argc - optind != 1 || hz <= 0 || hz > 1000000) {
+                fprintf(stderr, "usage: %s [-s symbols] [-f hz] "
+                        "[-o folded] image\n", argv[0]);
+                return 1;
+        }
+        FILE *program = fopen(argv[optind], "r");
+        assert(program);
+        machine = Um_new(program);
+        fclose(program);
+        samples = ALLOC(SAMPLE_WORDS * sizeof(uint32_t));
+
+        start_timer(hz);
+        Um_status status = Um_run(machine);
+        stop_timer();
+        fflush(stdout);
+        assert(status == UM_HALTED);
+
+        size_t n;
+        char **stacks = fold(&n);
+        if (n > 0) {
+                print_top(n);
+        }
+        if (folded != NULL) {
+                write_folded(folded, stacks, n);
+        }
+        for (size_t i = 0; i < n; ++i) {
+                FREE(stacks[i]);
+        }
+        FREE(stacks);
+        for (size_t i = 0; i < nsymbols; ++i) {
+                FREE(symbols[i].name);
+        }
+        FREE(symbols);
+        FREE(samples);
+        Um_free(&machine);
+        return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umrecord: runs a UM program recording the last instructions it ran,
+ * and prints them back as UMASM
+ *
+ * usage: umrecord [-n steps] [-o record] image
+ *        umrecord -d record
+ *
+ * The first form runs the program as um would, reading stdin and
+ * writing stdout, on um-record.o: the special engine built with
+ * -DUM_RECORD, which writes every instruction it runs into a ring of
+ * steps (default 2^16, -n rounded up to a power of 2) allocated up
+ * front. A step is the pc, the instruction word and the value of the
+ * register it wrote; a loop run in bulk is one step for its LOADP with
+ * the times it ran. The ring, with the registers and the pc, is written
+ * to the record file (default um.rec) when the machine stops, on
+ * SIGUSR1, which lets it go on, and on SIGINT, SIGTERM and the faults
+ * SIGABRT (a failed assertion), SIGSEGV, SIGBUS and SIGFPE, which it
+ * then dies of. The handler only calls pwrite on a file opened before
+ * the run. The second form prints a record, oldest step first, one
+ * instruction a line with what it did.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "um.h"
+
+#define RECORD_MAGIC 0x554d5243         /* "UMRC" */
+#define DEFAULT_STEPS (1 << 16)
+#define MAX_STEPS (1 << 28)
+
+/*
+ * the record file: this header, in host order, then the ring as the
+ * machine left it; signal is 0 when Um_run returned status
+ */
+typedef struct Header {
+        uint32_t magic;
+        uint32_t signal, status;
+        uint32_t mask;
+        uint64_t head;
+        uint32_t pc;
+        uint32_t registers[8];
+} Header;
+
+/* read by the signal handlers while Um_run runs */
+static Um machine;
+static Um_log recorded;
+static int fd = -1;
+
+static void write_record(uint32_t sig, uint32_t status)
+{
+        Header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = RECORD_MAGIC;
+        header.signal = sig;
+        header.status = status;
+        header.mask = recorded.mask;
+        header.head = __atomic_load_n(&recorded.head, __ATOMIC_ACQUIRE);
+        header.pc = Um_pc(machine);
+        memcpy(header.registers, Um_registers(machine),
+               sizeof(header.registers));
+
+        size_t ring = ((size_t)recorded.mask + 1) * sizeof(Um_step);
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+            || pwrite(fd, recorded.steps, ring, sizeof(header))
+               != (ssize_t)ring) {
+                static const char msg[] = "umrecord: cannot write record\n";
+                (void)!write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        }
+}
+
+/*
+ * SA_RESETHAND has put back the default action, which takes the signal
+ * raised here as soon as the handler returns; a fault would come back
+ * anyway when its instruction runs again
+ */
+static void on_signal(int sig)
+{
+        write_record(sig, 0);
+        if (sig != SIGUSR1) {
+                raise(sig);
+        }
+}
+
+static void catch_signals(void)
+{
+        static const int fatal[] = {
+                SIGINT, SIGTERM, SIGABRT, SIGSEGV, SIGBUS, SIGFPE
+        };
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_signal;
+        sigfillset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, NULL);
+        action.sa_flags = SA_RESETHAND;
+        for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); ++i) {
+                sigaction(fatal[i], &action, NULL);
+        }
+}
+
+static int record(const char *image, const char *path, uint32_t steps)
+{
+        FILE *program = fopen(image, "r");
+        if (program == NULL) {
+                perror(image);
+                return 1;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+                perror(path);
+                fclose(program);
+                return 1;
+        }
+        machine = Um_new(program);
+        fclose(program);
+        recorded.head = 0;
+        recorded.mask = steps - 1;
+        recorded.steps = CALLOC(steps, sizeof(Um_step));
+        Um_record(machine, &recorded);
+
+        catch_signals();
+        Um_status status = Um_run(machine);
+        fflush(stdout);
+        signal(SIGUSR1, SIG_IGN);
+        write_record(0, status);
+
+        close(fd);
+        Um_record(machine, NULL);
+        FREE(recorded.steps);
+        Um_free(&machine);
+        return 0;
+}
+
+static const char *const STATUS[] = {
+        "halted", "blocked on input", "over its memory quota",
+        "over its instruction quota", "unpacked"
+};
+
+/* the instruction in UMASM, as umasm would read it */
+static void disassemble(uint32_t word, char *buf, size_t size)
+{
+        unsigned op = word >> 28;
+        unsigned a = word >> 6 & 7, b = word >> 3 & 7, c = word & 7;
+        switch (op) {
+        case 0:
+                snprintf(buf, size, "if (r%u != 0) r%u := r%u", c, a, b);
+                break;
+        case 1:
+                snprintf(buf, size, "r%u := m[r%u][r%u]", a, b, c);
+                break;
+        case 2:
+                snprintf(buf, size, "m[r%u][r%u] := r%u", a, b, c);
+                break;
+        case 3: case 4: case 5:
+                snprintf(buf, size, "r%u := r%u %c r%u", a, b,
+                         "+*/"[op - 3], c);
+                break;
+        case 6:
+                snprintf(buf, size, "r%u := r%u nand r%u", a, b, c);
+                break;
+        case 7:
+                snprintf(buf, size, "halt");
+                break;
+        case 8:
+                snprintf(buf, size, "r%u := map segment (r%u words)", b,
+                         c);
+                break;
+        case 9:
+                snprintf(buf, size, "unmap r%u", c);
+                break;
+        case 10:
+                snprintf(buf, size, "output r%u", c);
+                break;
+        case 11:
+                snprintf(buf, size, "r%u := input()", c);
+                break;
+        case 12:
+                snprintf(buf, size, "goto r%u in program m[r%u]", c, b);
+                break;
+        case 13:
+                snprintf(buf, size, "r%u := %u", word >> 25 & 7,
+                         word & 0x1ffffff);
+                break;
+        default:
+                snprintf(buf, size, "(bad opcode %u)", op);
+                break;
+        }
+}
+
+/* what the step did, from the register it kept */
+static void describe(const Um_step *step, char *buf, size_t size)
+{
+        unsigned op = step->word >> 28;
+        uint32_t v = step->value;
+        switch (op) {
+        case 0: case 1: case 3: case 4: case 5: case 6:
+                snprintf(buf, size, "r%u = 0x%08" PRIx32,
+                         step->word >> 6 & 7, v);
+                break;
+        case 2:
+                snprintf(buf, size, "stored 0x%08" PRIx32, v);
+                break;
+        case 8:
+                snprintf(buf, size, "r%u = segment %" PRIu32,
+                         step->word >> 3 & 7, v);
+                break;
+        case 9:
+                snprintf(buf, size, "segment %" PRIu32, v);
+                break;
+        case 10:
+                snprintf(buf, size, v >= ' ' && v < 127 ? "'%c'" : "%u",
+                         (int)v);
+                break;
+        case 11:
+                snprintf(buf, size, v == UINT32_MAX ? "EOF" : "read %u",
+                         (unsigned)v);
+                break;
+        case 12:
+                if (step->loops > 0) {
+                        snprintf(buf, size, "loop run %" PRIu32
+                                 " more times in bulk", step->loops);
+                } else {
+                        snprintf(buf, size, "segment %" PRIu32, v);
+                }
+                break;
+        default:
+                buf[0] = '\0';
+                break;
+        }
+}
+
+static int print(const char *path)
+{
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL) {
+                perror(path);
+                return 1;
+        }
+        Header header;
+        if (fread(&header, sizeof(header), 1, fp) != 1
+            || header.magic != RECORD_MAGIC
+            || header.mask >= MAX_STEPS
+            || ((header.mask + 1) & header.mask) != 0) {
+                fprintf(stderr, "%s: not a umrecord record\n", path);
+                fclose(fp);
+                return 1;
+        }
+        uint32_t steps = header.mask + 1;
+        Um_step *ring = CALLOC(steps, sizeof(Um_step));
+        size_t got = fread(ring, sizeof(Um_step), steps, fp);
+        fclose(fp);
+        if (got != steps) {
+                fprintf(stderr, "%s: record cut short\n", path);
+                FREE(ring);
+                return 1;
+        }
+
+        uint64_t first = header.head > steps ? header.head - steps : 0;
+        printf("%" PRIu64 " of %" PRIu64 " steps, ", header.head - first,
+               header.head);
+        if (header.signal != 0) {
+                printf("stopped by %s", strsignal(header.signal));
+        } else if (header.status < sizeof(STATUS) / sizeof(STATUS[0])) {
+                printf("%s", STATUS[header.status]);
+        } else {
+                printf("status %u", header.status);
+        }
+        printf(" at pc 0x%08x\n", header.pc);
+        for (int r = 0; r < 8; ++r) {
+                printf("r%d = 0x%08x%s", r, header.registers[r],
+                       r % 4 == 3 ? "\n" : "  ");
+        }
+
+        char instr[64], what[64];
+        for (uint64_t n = first; n < header.head; ++n) {
+                const Um_step *step = &ring[n & header.mask];
+                disassemble(step->word, instr, sizeof(instr));
+                if (n + 1 == header.head && header.signal != 0) {
+                        snprintf(what, sizeof(what),
+                                 "(may be unfinished)");
+                } else {
+                        describe(step, what, sizeof(what));
+                }
+                printf("%12" PRIu64 "  %08" PRIx32 "  %-*s%s\n", n,
+                       step->pc, what[0] ? 35 : 0, instr, what);
+        }
+        FREE(ring);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        const char *path = "um.rec";
+        long steps = DEFAULT_STEPS;
+        int print_only = 0;
+        int opt;
+        while ((opt = getopt(argc, argv, "n:o:d")) != -1) {
+                if (opt == 'n') {
+                        steps = strtol(optarg, NULL, 0);
+                } else if (opt == 'o') {
+                        path = optarg;
+                } else if (opt == 'd') {
+                        print_only = 1;
+                } else {
+                        break;
+                }
+        }
+        if (argc - optind != 1 || steps <= 0 || steps > MAX_STEPS) {
+                fprintf(stderr, "usage: %s [-n steps] [-o record] image\n"
+                        "       %s -d record\n", argv[0], argv[0]);
+                return 1;
+        }
+        if (print_only) {
+                return print(argv[optind]);
+        }
+        uint32_t size = 1;
+        while (size < steps) {
+                size *= 2;
+        }
+        return record(argv[optind], path, size);
+}
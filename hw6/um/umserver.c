@@ -0,0 +1,407 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/10/17
+ *
+ * umserver: runs one Um per connection on a Unix domain socket
+ *
+ * usage: umserver [-t threads] [-m words] [-i instructions] socket image
+ *
+ * The main thread accepts connections and hands each one to a worker,
+ * round robin. Every worker owns an epoll instance and the sessions
+ * registered with it. A session's machine reads from the bytes the
+ * client has sent so far and writes into an output buffer; when IN finds
+ * no byte, Um_run returns UM_BLOCKED and the session stays parked in
+ * epoll until more input (or the end of input) arrives, so a worker
+ * thread multiplexes any number of sessions. A machine runs at most
+ * SLICE_INSTRUCTIONS at a time (to its next LOADP past them); one with
+ * more to do is registered for EPOLLOUT, which fires at once, so it runs
+ * again after the other sessions that are ready, and one busy machine
+ * cannot hold up the rest of its worker. Neither buffer grows past
+ * BUFFER_LIMIT bytes for long: the socket is not read while the input
+ * buffer is that full, and a machine whose unsent output reaches it is
+ * stopped at its next LOADP and runs again once the client has read
+ * some, so a program that only writes to a client that never reads
+ * costs the server no more memory than any other. A session ends when
+ * its machine halts and its output has been sent, or when the client
+ * goes away.
+ *
+ * -m limits the words each session's machine may map, and -i the
+ * instructions it may run between two blocks on input; a machine that
+ * passes either is stopped, and its session ends with a message.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "um.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 4096
+#define SLICE_INSTRUCTIONS (1 << 16)    /* a machine's turn on its worker */
+#define BUFFER_LIMIT (1 << 16)          /* bytes waiting in or out */
+
+typedef struct Buffer {
+        char *data;
+        size_t start, len, cap;         /* unread bytes are start..len */
+} Buffer;
+
+typedef struct Session {
+        int fd;
+        Um machine;
+        Buffer in, out;
+        bool eof;               /* the client has shut down its side */
+        bool blocked;           /* on IN, until input or EOF arrives */
+        bool halted;
+        uint64_t quota_end;     /* executed at which -i stops it */
+        uint32_t events;        /* what epoll is watching for */
+} *Session;
+
+typedef struct Worker {
+        pthread_t thread;
+        int epfd;
+} Worker;
+
+/* the image's machine as Um_save writes it, read once and loaded per session */
+static uint32_t *image;
+static size_t image_len;
+static uint64_t quota_words, quota_instructions;        /* 0: no limit */
+
+/* appends len bytes to buf, compacting or growing it as needed */
+static void Buffer_append(Buffer *buf, const char *bytes, size_t len)
+{
+        if (buf->data == NULL) {
+                buf->cap = READ_CHUNK;
+                buf->data = ALLOC(buf->cap);
+        }
+        if (buf->start == buf->len) {
+                buf->start = buf->len = 0;
+        }
+        if (buf->len + len > buf->cap) {
+                memmove(buf->data, buf->data + buf->start,
+                        buf->len - buf->start);
+                buf->len -= buf->start;
+                buf->start = 0;
+                while (buf->len + len > buf->cap) {
+                        buf->cap *= 2;
+                }
+                RESIZE(buf->data, buf->cap);
+        }
+        memcpy(buf->data + buf->len, bytes, len);
+        buf->len += len;
+}
+
+/* input source of a session's machine */
+static int session_get(void *cl)
+{
+        Session session = cl;
+        Buffer *in = &session->in;
+        if (in->start < in->len) {
+                return (unsigned char) in->data[in->start++];
+        }
+        return session->eof ? EOF : UM_NO_INPUT;
+}
+
+static size_t waiting(const Buffer *buf)
+{
+        return buf->len - buf->start;
+}
+
+/* 
+ * output sink of a session's machine; put cannot refuse a byte, so a
+ * full buffer stops the machine at its next LOADP, the end of its slice
+ */
+static void session_put(int c, void *cl)
+{
+        Session session = cl;
+        char byte = c;
+        Buffer_append(&session->out, &byte, 1);
+        if (waiting(&session->out) >= BUFFER_LIMIT) {
+                Um_set_quota(session->machine, quota_words, 1);
+        }
+}
+
+/* reads the image into a machine once, and keeps it as words */
+static void read_image(const char *path)
+{
+        FILE *program = fopen(path, "r");
+        if (program == NULL) {
+                perror(path);
+                exit(1);
+        }
+        Um machine = Um_new(program);
+        fclose(program);
+
+        char *saved = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&saved, &len);
+        assert(out);
+        Um_save(machine, out);
+        fclose(out);
+        Um_free(&machine);
+        image = (uint32_t *)saved;
+        image_len = len / sizeof(uint32_t);
+}
+
+static Session Session_new(int fd)
+{
+        Session session;
+        NEW0(session);
+        session->fd = fd;
+        session->machine = Um_load(image, image_len);
+        assert(session->machine);
+        session->quota_end = Um_executed(session->machine)
+                             + quota_instructions;
+        Um_set_quota(session->machine, quota_words, 0);
+
+        Um_io io = { session_get, session_put, session };
+        Um_set_io(session->machine, &io);
+        return session;
+}
+
+static void Session_free(Worker *worker, Session *sessionp)
+{
+        Session session = *sessionp;
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->fd, NULL);
+        close(session->fd);
+        Um_free(&session->machine);
+        FREE(session->in.data);
+        FREE(session->out.data);
+        FREE(*sessionp);
+}
+
+/* 
+ * reads what the client has sent, up to BUFFER_LIMIT waiting; false if
+ * the connection failed
+ */
+static bool read_input(Session session)
+{
+        char chunk[READ_CHUNK];
+        while (waiting(&session->in) < BUFFER_LIMIT) {
+                ssize_t n = read(session->fd, chunk, sizeof(chunk));
+                if (n > 0) {
+                        Buffer_append(&session->in, chunk, n);
+                        session->blocked = false;
+                } else if (n == 0) {
+                        session->eof = true;
+                        session->blocked = false;
+                        return true;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return true;
+                } else if (errno != EINTR) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/* sends as much pending output as the socket takes */
+static bool flush_output(Session session)
+{
+        Buffer *out = &session->out;
+        while (out->start < out->len) {
+                ssize_t n = send(session->fd, out->data + out->start,
+                                 out->len - out->start, MSG_NOSIGNAL);
+                if (n >= 0) {
+                        out->start += n;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return true;
+                } else if (errno != EINTR) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/* 
+ * runs the session's machine for a slice, or until it blocks or halts;
+ * a machine stopped by the end of its slice, and not by -i, just waits
+ * for its next turn
+ */
+static void run_session(Session session)
+{
+        Buffer *out = &session->out;
+        Um machine = session->machine;
+        uint64_t stop = Um_executed(machine) + SLICE_INSTRUCTIONS;
+        if (quota_instructions && session->quota_end < stop) {
+                stop = session->quota_end;
+        }
+        Um_set_quota(machine, quota_words, stop);
+
+        Um_status status = Um_run(machine);
+        bool over_quota = quota_instructions
+                          && Um_executed(machine) >= session->quota_end;
+        if (status == UM_BLOCKED) {
+                /* parked until the client types: a quiet point */
+                session->blocked = true;
+                session->quota_end = Um_executed(machine)
+                                     + quota_instructions;
+                Um_compact(machine);
+        } else if (status != UM_OVER_BUDGET || over_quota) {
+                session->halted = true;
+        }
+        if (status == UM_OVER_MEMORY || (status == UM_OVER_BUDGET
+                                         && over_quota)) {
+                const char *why = status == UM_OVER_MEMORY 
+                        ? "\numserver: over the memory quota\n"
+                        : "\numserver: over the instruction quota\n";
+                Buffer_append(out, why, strlen(why));
+        }
+}
+
+/* whether the machine has work to do and room for its output */
+static bool runnable(Session session)
+{
+        return !session->halted && !session->blocked
+               && waiting(&session->out) < BUFFER_LIMIT;
+}
+
+/*
+ * sends what output it can and gives the session's machine a slice if
+ * it is runnable, then watches for what the session needs next: input
+ * until EOF, and EPOLLOUT while output is pending or the machine can
+ * run, which brings it round again once the socket drains or at its next
+ * turn. false once the session is over
+ */
+static bool service(Worker *worker, Session session)
+{
+        if (!flush_output(session)) {
+                return false;
+        }
+        if (runnable(session)) {
+                run_session(session);
+                if (!flush_output(session)) {
+                        return false;
+                }
+        }
+        bool pending = waiting(&session->out) > 0;
+        if (session->halted && !pending) {
+                return false;
+        }
+
+        /* 
+         * a socket the client has shut down stays readable, so polling
+         * it for input after EOF would wake the worker over and over
+         */
+        bool want_in = !session->eof && !session->halted
+                       && waiting(&session->in) < BUFFER_LIMIT;
+        uint32_t events = (want_in ? EPOLLIN : 0)
+                          | (pending || runnable(session) ? EPOLLOUT : 0);
+        if (events != session->events) {
+                struct epoll_event ev;
+                ev.events = events;
+                ev.data.ptr = session;
+                epoll_ctl(worker->epfd, EPOLL_CTL_MOD, session->fd, &ev);
+                session->events = events;
+        }
+        return true;
+}
+
+static void *worker_loop(void *cl)
+{
+        Worker *worker = cl;
+        struct epoll_event events[MAX_EVENTS];
+
+        for (;;) {
+                int n = epoll_wait(worker->epfd, events, MAX_EVENTS, -1);
+                for (int i = 0; i < n; ++i) {
+                        Session session = events[i].data.ptr;
+                        bool alive = true;
+                        if (!session->eof && events[i].events
+                            & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                                alive = read_input(session);
+                        if (alive)
+                                alive = service(worker, session);
+                        if (!alive)
+                                Session_free(worker, &session);
+                }
+        }
+        return NULL;
+}
+
+static int listen_on(const char *path)
+{
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        assert(strlen(path) < sizeof(addr.sun_path));
+        strcpy(addr.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        unlink(path);
+        int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        assert(bound == 0);
+        int listening = listen(fd, SOMAXCONN);
+        assert(listening == 0);
+        return fd;
+}
+
+int main(int argc, char *argv[])
+{
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        bool usage = false;
+        int opt;
+        while ((opt = getopt(argc, argv, "t:m:i:")) != -1) {
+                if (opt == 't') {
+                        threads = atol(optarg);
+                } else if (opt == 'm') {
+                        quota_words = strtoull(optarg, NULL, 0);
+                } else if (opt == 'i') {
+                        quota_instructions = strtoull(optarg, NULL, 0);
+                } else {
+                        usage = true;
+                }
+        }
+        if (usage || argc - optind != 2 || threads < 1) {
+                fprintf(stderr, "usage: %s [-t threads] [-m words] "
+                        "[-i instructions] socket image\n", argv[0]);
+                return 1;
+        }
+        read_image(argv[optind + 1]);
+        int listener = listen_on(argv[optind]);
+        signal(SIGPIPE, SIG_IGN);
+
+        Worker *workers = CALLOC(threads, sizeof(Worker));
+        for (long i = 0; i < threads; ++i) {
+                workers[i].epfd = epoll_create1(0);
+                assert(workers[i].epfd >= 0);
+                int made = pthread_create(&workers[i].thread, NULL,
+                                          worker_loop, &workers[i]);
+                assert(made == 0);
+        }
+
+        /*
+         * a new session is registered for EPOLLOUT, which fires at once,
+         * so its worker runs the machine up to its first IN
+         */
+        for (long next = 0;; next = (next + 1) % threads) {
+                int fd = accept(listener, NULL, NULL);
+                if (fd < 0) {
+                        continue;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                Session session = Session_new(fd);
+                session->events = EPOLLIN | EPOLLOUT;
+
+                struct epoll_event ev;
+                ev.events = session->events;
+                ev.data.ptr = session;
+                int added = epoll_ctl(workers[next].epfd, EPOLL_CTL_ADD,
+                                      fd, &ev);
+                assert(added == 0);
+        }
+}
@@ -221,3 +221,130 @@ void emit_map_unmap_sload_sstore(Seq_T stream)
 
         emit(stream, halt());
 }
+
+/* 
+ * loops a UM may run in bulk: fills a segment counting down, copies it
+ * counting up with != built from NANDs, then smears one word across the
+ * copy, each word read right after the last was written; prints the
+ * counter, the copy, the last word loaded and the last word smeared
+ */
+void emit_fill_copy_test(Seq_T stream)
+{
+        uint32_t head;
+
+        emit(stream, loadval(r3, 1000));
+        emit(stream, three_register(MAP, 0, r1, r3));
+        emit(stream, three_register(MAP, 0, r2, r3));
+        emit(stream, loadval(r4, 'x'));
+        emit(stream, three_register(NAND, r5, r0, r0)); /* r5 = -1 */
+
+        /* do m[r1][--r3] := r4 while r3 != 0 */
+        head = Seq_length(stream);
+        emit(stream, add(r3, r3, r5));
+        emit(stream, three_register(SSTORE, r1, r3, r4));
+        emit(stream, loadval(r6, head));
+        emit(stream, loadval(r7, head + 6));
+        emit(stream, three_register(CMOV, r7, r6, r3));
+        emit(stream, three_register(LOADP, 0, r0, r7));
+
+        emit(stream, loadval(r6, '0'));
+        emit(stream, add(r6, r6, r3));
+        emit(stream, output(r6)); /* output is '0' */
+
+        /* do m[r2][r3] := m[r1][r3++] while r3 != r4 */
+        emit(stream, loadval(r4, 1000));
+        head = Seq_length(stream);
+        emit(stream, three_register(SLOAD, r7, r1, r3));
+        emit(stream, three_register(SSTORE, r2, r3, r7));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r3, r3, r7));
+        emit(stream, three_register(NAND, r6, r3, r3));
+        emit(stream, three_register(NAND, r7, r4, r4));
+        emit(stream, three_register(NAND, r6, r6, r4));
+        emit(stream, three_register(NAND, r7, r7, r3));
+        emit(stream, three_register(NAND, r6, r6, r7)); /* r3 xor r4 */
+        emit(stream, loadval(r5, head));
+        emit(stream, loadval(r7, head + 13));
+        emit(stream, three_register(CMOV, r7, r5, r6));
+        emit(stream, three_register(LOADP, 0, r0, r7));
+
+        emit(stream, three_register(SLOAD, r6, r2, r0));
+        emit(stream, output(r6)); /* output is 'x' */
+        emit(stream, loadval(r7, 999));
+        emit(stream, three_register(SLOAD, r6, r2, r7));
+        emit(stream, output(r6)); /* output is 'x' */
+
+        /* m[r2][0] := 'y', then do m[r2][r3 + 1] := m[r2][r3] up to 998 */
+        emit(stream, loadval(r6, 'y'));
+        emit(stream, three_register(SSTORE, r2, r0, r6));
+        emit(stream, loadval(r3, 0));
+        emit(stream, loadval(r4, 998));
+        emit(stream, three_register(NAND, r4, r4, r4)); /* r4 = -999 */
+        head = Seq_length(stream);
+        emit(stream, three_register(SLOAD, r6, r2, r3));
+        emit(stream, loadval(r1, 1));
+        emit(stream, add(r3, r3, r1));
+        emit(stream, three_register(SSTORE, r2, r3, r6));
+        emit(stream, add(r5, r3, r4));
+        emit(stream, loadval(r1, head));
+        emit(stream, loadval(r7, head + 9));
+        emit(stream, three_register(CMOV, r7, r1, r5));
+        emit(stream, three_register(LOADP, 0, r0, r7));
+
+        emit(stream, output(r6)); /* output is 'y' */
+        emit(stream, loadval(r7, 999));
+        emit(stream, three_register(SLOAD, r6, r2, r7));
+        emit(stream, output(r6)); /* output is 'y' */
+        emit(stream, halt());
+}
+
+/* 
+ * a loop copying code over code that has already run: the block at
+ * 'to' prints 'a', then the block at 'from', which prints 'b', is copied
+ * over it and run again
+ */
+void emit_copy_code_test(Seq_T stream)
+{
+        const uint32_t block = 16, start = 22;
+        const uint32_t to = start + 2, from = to + block;
+        uint32_t head;
+
+        emit(stream, loadval(r5, 3));
+        emit(stream, loadval(r7, to));
+        emit(stream, three_register(LOADP, 0, r0, r7)); /* prints 'a' */
+
+        /* do m[0][r2 + r3] := m[0][r1 + r3] for r3 from 0 to block */
+        emit(stream, loadval(r1, from));
+        emit(stream, loadval(r2, to));
+        emit(stream, loadval(r3, 0));
+        head = Seq_length(stream);
+        emit(stream, add(r7, r1, r3));
+        emit(stream, three_register(SLOAD, r6, r0, r7));
+        emit(stream, add(r7, r2, r3));
+        emit(stream, three_register(SSTORE, r0, r7, r6));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r3, r3, r7));
+        emit(stream, loadval(r7, block - 1));
+        emit(stream, three_register(NAND, r7, r7, r7));
+        emit(stream, add(r7, r3, r7)); /* r3 - block */
+        emit(stream, loadval(r5, head));
+        emit(stream, loadval(r4, head + 13));
+        emit(stream, three_register(CMOV, r4, r5, r7));
+        emit(stream, three_register(LOADP, 0, r0, r4));
+
+        emit(stream, loadval(r5, start));
+        emit(stream, loadval(r7, to));
+        emit(stream, three_register(LOADP, 0, r0, r7)); /* prints 'b' */
+        assert((uint32_t)Seq_length(stream) == start);
+        emit(stream, halt());
+        emit(stream, halt());
+
+        for (char c = 'a'; c <= 'b'; ++c) {
+                emit(stream, loadval(r6, c));
+                emit(stream, output(r6));
+                for (uint32_t i = 3; i < block; ++i) {
+                        emit(stream, three_register(CMOV, r0, r0, r0));
+                }
+                emit(stream, three_register(LOADP, 0, r0, r5));
+        }
+}
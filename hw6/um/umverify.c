@@ -0,0 +1,281 @@
+/*
+ * Martin Gao & Juliet Yue
+ * date: 12/12/17
+ *
+ * umverify: runs an engine in lockstep with the reference interpreter
+ *
+ * usage: umverify [-n instructions] image [input]
+ *
+ * Two machines load the same image and read the same input (a file, or
+ * all of stdin, read once into a buffer). The candidate runs Um_run, the
+ * engine this program is linked with (um.o or um-special.o), with an
+ * instruction budget, so it stops at the first LOADP after every n
+ * instructions (default 1000000); the reference then single steps
+ * run_next, which decodes every word and never runs a loop in bulk, to
+ * the same instruction count. At every such checkpoint the two must
+ * agree on pc, registers, a rolling hash of the output and the contents
+ * of every segment. On the first disagreement both machines start over,
+ * run to the last checkpoint that agreed and go on one LOADP at a time,
+ * which narrows the divergence down to one straight run of instructions;
+ * that run is reported with the first register or word that differs.
+ * Exit status 0 when the machines agree through HALT, 1 when not.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "mem.h"
+#include "um.h"
+
+#define NUM_REGS 8
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static const char *image;
+static unsigned char *input;
+static size_t input_len;
+
+/* where one machine is in the input and what it has written */
+typedef struct Stream {
+        size_t next;
+        uint64_t out_hash, out_len;
+} Stream;
+
+typedef struct Side {
+        Um machine;
+        Stream stream;
+        bool halted;
+} Side;
+
+static int stream_get(void *cl)
+{
+        Stream *stream = cl;
+        if (stream->next == input_len) {
+                return EOF;
+        }
+        return input[stream->next++];
+}
+
+static void stream_put(int c, void *cl)
+{
+        Stream *stream = cl;
+        stream->out_hash = (stream->out_hash ^ (unsigned char)c) * FNV_PRIME;
+        stream->out_len++;
+}
+
+static void read_input(const char *path)
+{
+        FILE *fp = path ? fopen(path, "rb") : stdin;
+        assert(fp);
+        size_t cap = 4096;
+        input = ALLOC(cap);
+        size_t n;
+        while ((n = fread(input + input_len, 1, cap - input_len, fp)) > 0) {
+                input_len += n;
+                if (input_len == cap) {
+                        cap *= 2;
+                        RESIZE(input, cap);
+                }
+        }
+        if (path) {
+                fclose(fp);
+        }
+}
+
+/* loads the image into side's machine, reading input from the start */
+static void start(Side *side)
+{
+        FILE *program = fopen(image, "r");
+        assert(program);
+        side->machine = Um_new(program);
+        fclose(program);
+        side->stream = (Stream){ 0, FNV_OFFSET, 0 };
+        side->halted = false;
+        Um_io io = { stream_get, stream_put, &side->stream };
+        Um_set_io(side->machine, &io);
+}
+
+/*
+ * runs the candidate to the first LOADP after more than target
+ * instructions, or to HALT; with no memory quota no MAP is refused
+ */
+static void run_candidate(Side *cand, uint64_t target)
+{
+        Um_set_quota(cand->machine, 0, target + 1);
+        Um_status status = Um_run(cand->machine);
+        assert(status == UM_HALTED || status == UM_OVER_BUDGET);
+        cand->halted = status == UM_HALTED;
+}
+
+/* steps the reference until it has run as many instructions as count */
+static void run_reference(Side *ref, uint64_t count)
+{
+        while (!ref->halted && Um_executed(ref->machine) < count) {
+                ref->halted = !run_next(ref->machine);
+        }
+}
+
+/*
+ * describes the first difference between the machines into why and
+ * returns false, or returns true if they agree
+ */
+static bool agree(Side *ref, Side *cand, char *why, size_t size)
+{
+        Um a = ref->machine, b = cand->machine;
+        if (ref->halted != cand->halted) {
+                snprintf(why, size, "only the %s halted",
+                         ref->halted ? "reference" : "candidate");
+                return false;
+        }
+        if (Um_executed(a) != Um_executed(b)) {
+                snprintf(why, size, "instruction count %" PRIu64 " vs %"
+                         PRIu64, Um_executed(a), Um_executed(b));
+                return false;
+        }
+        if (!ref->halted && Um_pc(a) != Um_pc(b)) {
+                snprintf(why, size, "pc %u vs %u", Um_pc(a), Um_pc(b));
+                return false;
+        }
+        for (int r = 0; r < NUM_REGS; ++r) {
+                uint32_t x = Um_registers(a)[r], y = Um_registers(b)[r];
+                if (x != y) {
+                        snprintf(why, size, "r%d 0x%08x vs 0x%08x", r, x, y);
+                        return false;
+                }
+        }
+        if (ref->stream.out_len != cand->stream.out_len
+            || ref->stream.out_hash != cand->stream.out_hash) {
+                snprintf(why, size, "output differs (%" PRIu64 " vs %"
+                         PRIu64 " bytes)", ref->stream.out_len,
+                         cand->stream.out_len);
+                return false;
+        }
+
+        Segments_T sa = Um_segments(a), sb = Um_segments(b);
+        if (Segments_ids(sa) != Segments_ids(sb)) {
+                snprintf(why, size, "%u segment ids vs %u",
+                         Segments_ids(sa), Segments_ids(sb));
+                return false;
+        }
+        for (seg_id id = 0; id < Segments_ids(sa); ++id) {
+                /* an id compaction has released is unmapped in both */
+                if (!Segments_valid(sa, id) || !Segments_valid(sb, id)) {
+                        continue;
+                }
+                uint32_t len = Segments_size(sa, id);
+                if (len != Segments_size(sb, id)) {
+                        snprintf(why, size, "segment %u has %u words vs %u",
+                                 id, len, Segments_size(sb, id));
+                        return false;
+                }
+                uint32_t *x = Segments_get_mem(sa, id);
+                uint32_t *y = Segments_get_mem(sb, id);
+                if (memcmp(x, y, len * sizeof(uint32_t)) == 0) {
+                        continue;
+                }
+                uint32_t i = 0;
+                while (x[i] == y[i]) {
+                        ++i;
+                }
+                snprintf(why, size, "m[%u][%u] 0x%08x vs 0x%08x", id, i,
+                         x[i], y[i]);
+                return false;
+        }
+        return true;
+}
+
+/*
+ * replays both machines to the checkpoint at good instructions, then
+ * checks after every LOADP to find the run of instructions that diverged
+ */
+static void narrow(uint64_t good)
+{
+        Side ref, cand;
+        char why[128];
+        start(&ref);
+        start(&cand);
+        if (good > 0) {
+                run_candidate(&cand, good - 1);
+                run_reference(&ref, Um_executed(cand.machine));
+        }
+        bool same = agree(&ref, &cand, why, sizeof(why));
+        assert(same);
+
+        for (;;) {
+                uint64_t from = Um_executed(cand.machine);
+                uint32_t pc = Um_pc(cand.machine);
+                run_candidate(&cand, from);
+                run_reference(&ref, Um_executed(cand.machine));
+                if (!agree(&ref, &cand, why, sizeof(why))) {
+                        printf("diverged in instructions %" PRIu64 "..%"
+                               PRIu64 ", the run from pc %u to ", from + 1,
+                               Um_executed(cand.machine), pc);
+                        if (cand.halted) {
+                                printf("HALT\n");
+                        } else {
+                                printf("a LOADP to pc %u\n",
+                                       Um_pc(cand.machine));
+                        }
+                        printf("first difference (reference vs candidate): "
+                               "%s\n", why);
+                        break;
+                }
+                assert(!ref.halted);
+        }
+        Um_free(&ref.machine);
+        Um_free(&cand.machine);
+}
+
+int main(int argc, char *argv[])
+{
+        uint64_t interval = 1000000;
+        int opt;
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                if (opt != 'n') {
+                        break;
+                }
+                interval = strtoull(optarg, NULL, 0);
+        }
+        if (argc - optind < 1 || argc - optind > 2 || interval == 0) {
+                fprintf(stderr, "usage: %s [-n instructions] image [input]\n",
+                        argv[0]);
+                return 1;
+        }
+        image = argv[optind];
+        read_input(argv[optind + 1]);
+
+        Side ref, cand;
+        char why[128];
+        start(&ref);
+        start(&cand);
+        uint64_t good = 0, checkpoints = 0;
+        bool same = true;
+        while (same && !cand.halted) {
+                run_candidate(&cand, good + interval);
+                run_reference(&ref, Um_executed(cand.machine));
+                checkpoints++;
+                same = agree(&ref, &cand, why, sizeof(why));
+                if (same) {
+                        good = Um_executed(cand.machine);
+                }
+        }
+        if (!same) {
+                printf("checkpoint %" PRIu64 " after %" PRIu64
+                       " instructions: %s\n", checkpoints,
+                       Um_executed(cand.machine), why);
+                narrow(good);
+        } else {
+                printf("%" PRIu64 " instructions, %" PRIu64 " checkpoints, "
+                       "%" PRIu64 " bytes of output: the same\n", good,
+                       checkpoints, ref.stream.out_len);
+        }
+        Um_free(&ref.machine);
+        Um_free(&cand.machine);
+        FREE(input);
+        return same ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+/*
+ * Juliet Yue (qyue01), Steven Song (ssong03)
+ * RPN Calc
+ * calcbench.c
+ *
+ * Writes a large random RPN workload for calc40.um together with the
+ * output calc40 is expected to produce for it.
+ *
+ * usage: calcbench [-b | -d] [bytes [seed]] name
+ *
+ * writes name.0 (input) and name.1 (expected output), the same naming
+ * the UM unit tests use, and prints "<chars> <ops>" on stdout so that a
+ * harness can turn the running time into throughput.
+ *
+ * The workload touches every jumptable entry: digits, ' ', '+', '-', '*',
+ * '/', '|', '&', 'c', '~', 's', 'd', 'p', 'z', '\n', and now and then an
+ * unknown character. The expected output comes from a C model of
+ * calc40.ums, including its stack underflow and division messages.
+ *
+ * With -b the workload is one that bigcalc40.um must answer the same way:
+ * no '|' or '&', numbers of at most four digits, and any operation whose
+ * exact result would not fit strictly inside the 32-bit signed range is
+ * replaced by 'p', so the two machines can be timed on identical input.
+ *
+ * With -d the workload instead pushes values until half the bytes are
+ * used and then folds them all with '+', so the value stack grows to a
+ * few hundred thousand values per megabyte and the cost of growing it
+ * shows up in the running time.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_BYTES (4 * 1024 * 1024)
+#define MAX_DEPTH 24            /* keeps each print (newline) short */
+#define INITIAL_VALUES 1024     /* first value stack segment in calc40 */
+
+typedef struct Calc {
+        uint32_t *values;
+        int capacity;           /* grows like calc40's value stack */
+        int numvals;
+        int entering;           /* state: 1 after a digit, else 0 */
+        FILE *out;
+} Calc;
+
+static const char COMMANDS[] = "+-*/|&c~sdpz";
+static const char BIG_COMMANDS[] = "+-*/c~sdpz";
+
+static int bigsafe;             /* set by -b */
+static int deep;                /* set by -d */
+
+static void push(Calc *calc, uint32_t value)
+{
+        if (calc->numvals == calc->capacity) {
+                calc->capacity = calc->capacity ? 2 * calc->capacity
+                                                : INITIAL_VALUES;
+                calc->values = realloc(calc->values,
+                                       calc->capacity * sizeof(uint32_t));
+                assert(calc->values != NULL);
+        }
+        calc->values[calc->numvals++] = value;
+}
+
+static void underflow(Calc *calc, int expected)
+{
+        if (expected == 1)
+                fputs("Stack underflow---expected at least 1 element\n",
+                      calc->out);
+        else
+                fputs("Stack underflow---expected at least 2 elements\n",
+                      calc->out);
+}
+
+/* signed division the way calc40's pos_pos/pos_neg/neg_pos/neg_neg do it */
+static uint32_t calc_divide(uint32_t numer, uint32_t denom)
+{
+        int neg = 0;
+        if ((int32_t)numer < 0) {
+                numer = -numer;
+                neg = !neg;
+        }
+        if ((int32_t)denom < 0) {
+                denom = -denom;
+                neg = !neg;
+        }
+        uint32_t quot = numer / denom;
+        return neg ? -quot : quot;
+}
+
+static void binary(Calc *calc, char c)
+{
+        if (calc->numvals < 2) {
+                underflow(calc, 2);
+                return;
+        }
+        uint32_t *top = &calc->values[calc->numvals - 1];
+        uint32_t *second = &calc->values[calc->numvals - 2];
+
+        switch (c) {
+        case '+': *second = *second + *top; break;
+        case '-': *second = *second - *top; break;
+        case '*': *second = *second * *top; break;
+        case '|': *second = *second | *top; break;
+        case '&': *second = *second & *top; break;
+        case '/':
+                if (*top == 0) {
+                        fputs("Division by zero\n", calc->out);
+                        return;
+                }
+                *second = calc_divide(*second, *top);
+                break;
+        case 's': {
+                uint32_t tmp = *second;
+                *second = *top;
+                *top = tmp;
+                return;
+        }
+        }
+        calc->numvals--;
+}
+
+static void unary(Calc *calc, char c)
+{
+        if (calc->numvals < 1) {
+                underflow(calc, 1);
+                return;
+        }
+        uint32_t *top = &calc->values[calc->numvals - 1];
+        switch (c) {
+        case 'c': *top = -*top; break;
+        case '~': *top = ~*top; break;
+        case 'd': push(calc, *top); break;
+        case 'p': calc->numvals--; break;
+        }
+}
+
+/* feed one character to the model, the way main_loop dispatches it */
+static void calc_step(Calc *calc, char c)
+{
+        if (c >= '0' && c <= '9') {
+                if (calc->entering) {
+                        uint32_t *top = &calc->values[calc->numvals - 1];
+                        *top = *top * 10 + (c - '0');
+                } else {
+                        push(calc, c - '0');
+                        calc->entering = 1;
+                }
+                return;
+        }
+        calc->entering = 0;
+
+        switch (c) {
+        case ' ':
+                break;
+        case '\n':
+                for (int i = calc->numvals - 1; i >= 0; --i)
+                        fprintf(calc->out, ">>> %d\n",
+                                (int32_t)calc->values[i]);
+                break;
+        case 'z':
+                calc->numvals = 0;
+                break;
+        case '+': case '-': case '*': case '/': case '|': case '&': case 's':
+                binary(calc, c);
+                break;
+        case 'c': case '~': case 'd': case 'p':
+                unary(calc, c);
+                break;
+        default:
+                fprintf(calc->out, "Unknown character '%c'\n", c);
+                break;
+        }
+}
+
+/* whether c would leave a value outside (INT32_MIN, INT32_MAX] */
+static int overflows(Calc *calc, char c)
+{
+        int64_t top, second, result;
+
+        if (calc->numvals < 1)
+                return 0;
+        top = (int32_t)calc->values[calc->numvals - 1];
+        if (c == '~')
+                return -(top + 1) <= INT32_MIN;
+        if (calc->numvals < 2)
+                return 0;
+        second = (int32_t)calc->values[calc->numvals - 2];
+
+        switch (c) {
+        case '+': result = second + top; break;
+        case '-': result = second - top; break;
+        case '*': result = second * top; break;
+        default: return 0;
+        }
+        return result <= INT32_MIN || result > INT32_MAX;
+}
+
+/*
+ * picks the next token given the current depth; favours numbers on a
+ * shallow stack and folding operators on a deep one
+ */
+static int emit_token(Calc *calc, FILE *input, char *buf)
+{
+        int len = 0;
+        int r = rand() % 100;
+
+        if (calc->numvals >= MAX_DEPTH) {
+                const char *fold = bigsafe ? "+-*/" : "+-*/|&";
+                buf[len++] = (r < 90) ? fold[rand() % strlen(fold)] : 'z';
+        } else if (r < 40 || calc->numvals < 2) {
+                int digits = 1 + rand() % (bigsafe ? 4 : 10);
+                for (int i = 0; i < digits; ++i)
+                        buf[len++] = '0' + rand() % 10;
+        } else if (r < 92) {
+                const char *cmds = bigsafe ? BIG_COMMANDS : COMMANDS;
+                buf[len++] = cmds[rand() % strlen(cmds)];
+        } else if (r < 99) {
+                buf[len++] = '\n';
+        } else {
+                buf[len++] = "xq#"[rand() % 3];
+        }
+
+        if (bigsafe && overflows(calc, buf[0]))
+                buf[0] = 'p';
+
+        for (int i = 0; i < len; ++i)
+                calc_step(calc, buf[i]);
+        if (buf[len - 1] != '\n') {
+                buf[len++] = ' ';
+                calc_step(calc, ' ');
+        }
+        fwrite(buf, 1, len, input);
+        return len;
+}
+
+/*
+ * the -d workload: a number and a space for each push while the first
+ * half of the bytes lasts, then "+ " for each fold
+ */
+static long emit_deep(Calc *calc, FILE *input, long bytes, long *ops)
+{
+        char buf[16];
+        long chars = 0;
+
+        while (chars < bytes / 2) {
+                int len = 0;
+                int digits = 1 + rand() % 3;
+                for (int i = 0; i < digits; ++i)
+                        buf[len++] = '0' + rand() % 10;
+                buf[len++] = ' ';
+                for (int i = 0; i < len; ++i)
+                        calc_step(calc, buf[i]);
+                fwrite(buf, 1, len, input);
+                chars += len;
+                (*ops)++;
+        }
+        while (calc->numvals > 1) {
+                fputs("+ ", input);
+                calc_step(calc, '+');
+                calc_step(calc, ' ');
+                chars += 2;
+                (*ops)++;
+        }
+        return chars;
+}
+
+static FILE *open_named(const char *name, const char *ext)
+{
+        char path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%s.%s", name, ext);
+        FILE *fp = fopen(path, "wb");
+        assert(fp != NULL);
+        return fp;
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 1 && (strcmp(argv[1], "-b") == 0
+                         || strcmp(argv[1], "-d") == 0)) {
+                bigsafe = argv[1][1] == 'b';
+                deep = argv[1][1] == 'd';
+                argv[1] = argv[0];
+                argc--;
+                argv++;
+        }
+        int options = 0;        /* left after a leading -b or -d */
+        for (int i = 1; i < argc; i++) {
+                options += argv[i][0] == '-';
+        }
+        if (argc < 2 || argc > 4 || options > 0) {
+                fprintf(stderr, "usage: %s [-b | -d] [bytes [seed]] name\n",
+                        argv[0]);
+                return 1;
+        }
+        long bytes = argc > 2 ? atol(argv[1]) : DEFAULT_BYTES;
+        srand(argc > 3 ? (unsigned)atol(argv[2]) : 40);
+        const char *name = argv[argc - 1];
+
+        FILE *input = open_named(name, "0");
+        Calc *calc = calloc(1, sizeof(*calc));
+        assert(calc != NULL);
+        calc->out = open_named(name, "1");
+
+        char buf[16];
+        long chars = 0, ops = 0;
+        if (deep)
+                chars = emit_deep(calc, input, bytes, &ops);
+        else
+                while (chars < bytes) {
+                        chars += emit_token(calc, input, buf);
+                        ops++;
+                }
+
+        /* finish with a print so every run ends by showing the stack */
+        fputc('\n', input);
+        calc_step(calc, '\n');
+        chars++;
+        ops++;
+
+        printf("%ld %ld\n", chars, ops);
+
+        fclose(input);
+        fclose(calc->out);
+        free(calc->values);
+        free(calc);
+        return 0;
+}
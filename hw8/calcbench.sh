@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Juliet Yue (qyue01), Steven Song (ssong03)
+# RPN Calc
+# calcbench.sh
+#
+# End-to-end throughput of calc40.um: generates a workload with calcbench,
+# runs it through the UM, checks the output against the reference and
+# reports characters/sec and ops/sec.
+#
+# usage: ./calcbench.sh [bytes [seed]]
+#
+# UM and CALC may be set in the environment to pick the machine and image;
+# CALCFLAGS is passed to calcbench (-b for a workload bigcalc40 agrees on).
+
+UM=${UM:-../hw6/um/um}
+CALC=${CALC:-calc40.um}
+BYTES=${1:-4194304}
+SEED=${2:-40}
+NAME=${TMPDIR:-/tmp}/calcbench.$$
+
+set -- `./calcbench $CALCFLAGS $BYTES $SEED $NAME`
+CHARS=$1
+OPS=$2
+
+START=`date +%s%N`
+$UM $CALC < $NAME.0 > $NAME.2
+END=`date +%s%N`
+
+if cmp -s $NAME.1 $NAME.2; then
+        STATUS=ok
+else
+        STATUS=FAILED
+        diff $NAME.1 $NAME.2 | head -20 >&2
+fi
+
+awk -v c=$CHARS -v o=$OPS -v ns=`expr $END - $START` -v s=$STATUS 'BEGIN {
+        sec = ns / 1e9
+        printf "%d chars, %d ops in %.3f s: %.0f chars/sec, %.0f ops/sec (%s)\n",
+               c, o, sec, c / sec, o / sec, s
+}'
+
+rm -f $NAME.0 $NAME.1 $NAME.2
+test $STATUS = ok
@@ -0,0 +1,1505 @@
+/*
+ * Juliet Yue (qyue01), Steven Song (ssong03)
+ * RPN Calc
+ * umasm.c
+ *
+ * Assembler and linker for UM assembly (UMASM), covering the language
+ * of the .ums files here, so that building calc40.um and bigcalc40.um
+ * needs nothing outside this directory.
+ *
+ * usage: umasm [-o image.um] [-m image.sym] file.ums ...
+ *
+ * All files are linked into one image for segment 0. Labels are global.
+ * Section "init" is laid out first, then "text", then every other
+ * section in the order it first appears. The symbol map, if asked for,
+ * has one "<hex address> <label>" line per label, sorted by address.
+ *
+ * Macro instructions expand using the registers named by .temps and by
+ * a trailing "using" clause. When a comparison runs short of registers
+ * the register named by .zero is borrowed and set back to 0 before the
+ * expansion ends.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum Um_opcode {
+        CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
+        NAND, HALT, MAP, UNMAP, OUT, IN, LOADP, LV
+} Um_opcode;
+
+#define NUM_REGS 8
+#define NO_REG (-1)
+#define LV_MAX ((1u << 25) - 1)
+
+static const char *cur_file = "";
+static int cur_line = 0;
+
+static void fail(const char *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+        fprintf(stderr, "%s:%d: ", cur_file, cur_line);
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+        va_end(ap);
+        exit(1);
+}
+
+static void *grow(void *p, size_t *cap, size_t need, size_t elem)
+{
+        if (need <= *cap)
+                return p;
+        size_t n = *cap ? *cap : 64;
+        while (n < need)
+                n *= 2;
+        p = realloc(p, n * elem);
+        if (p == NULL) {
+                fprintf(stderr, "umasm: out of memory\n");
+                exit(1);
+        }
+        *cap = n;
+        return p;
+}
+
+typedef struct Section {
+        char *name;
+        uint32_t *words;
+        size_t len, cap;
+        uint32_t base;
+} Section;
+
+typedef struct Symbol {
+        char *name;             /* NULL if generated by the assembler */
+        int section;            /* -1 while undefined */
+        uint32_t offset;
+} Symbol;
+
+/*
+ * a slot of the symbol table, holding the name and its hash so that a
+ * lookup need not touch the symbol
+ */
+typedef struct Slot {
+        uint32_t hash;
+        int sym;                /* -1 is empty */
+        const char *name;
+} Slot;
+
+/* a link-time constant: address of sym (or 0 if sym < 0) plus addend */
+typedef struct Const {
+        int sym;
+        uint32_t addend;
+} Const;
+
+typedef struct Reloc {
+        int section;
+        uint32_t offset;
+        Const value;
+        bool lv;                /* 25-bit LV field, else a full word */
+        const char *file;
+        int line;
+} Reloc;
+
+static Section *sections;
+static size_t nsections, sections_cap;
+static int cur_section = -1;
+
+static Symbol *symbols;
+static size_t nsymbols, symbols_cap;
+static Slot *sym_hash;          /* open addressing, named symbols only */
+static size_t sym_hash_size, nnamed;
+
+static Reloc *relocs;
+static size_t nrelocs, relocs_cap;
+
+static uint32_t hash_name(const char *s, size_t len)
+{
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i)
+                h = (h ^ (unsigned char)s[i]) * 16777619u;
+        return h;
+}
+
+static void rehash(void)
+{
+        size_t size = sym_hash_size ? sym_hash_size * 2 : 1024;
+        Slot *table = malloc(size * sizeof(Slot));
+        if (table == NULL)
+                fail("out of memory");
+        for (size_t i = 0; i < size; ++i)
+                table[i].sym = -1;
+        for (size_t i = 0; i < sym_hash_size; ++i) {
+                if (sym_hash[i].sym < 0)
+                        continue;
+                size_t j = sym_hash[i].hash & (size - 1);
+                while (table[j].sym >= 0)
+                        j = (j + 1) & (size - 1);
+                table[j] = sym_hash[i];
+        }
+        free(sym_hash);
+        sym_hash = table;
+        sym_hash_size = size;
+}
+
+static int new_symbol(char *name)
+{
+        symbols = grow(symbols, &symbols_cap, nsymbols + 1, sizeof(Symbol));
+        Symbol *sym = &symbols[nsymbols];
+        sym->name = name;
+        sym->section = -1;
+        sym->offset = 0;
+        return nsymbols++;
+}
+
+/* finds or creates the symbol with the given name */
+static int lookup(const char *name, size_t len)
+{
+        if (2 * (nnamed + 1) > sym_hash_size)
+                rehash();
+        uint32_t hash = hash_name(name, len);
+        size_t i = hash & (sym_hash_size - 1);
+        while (sym_hash[i].sym >= 0) {
+                Slot *slot = &sym_hash[i];
+                if (slot->hash == hash && memcmp(slot->name, name, len) == 0
+                    && slot->name[len] == '\0')
+                        return slot->sym;
+                i = (i + 1) & (sym_hash_size - 1);
+        }
+        sym_hash[i].hash = hash;
+        sym_hash[i].sym = new_symbol(strndup(name, len));
+        sym_hash[i].name = symbols[sym_hash[i].sym].name;
+        nnamed++;
+        return sym_hash[i].sym;
+}
+
+/* a label only the assembler refers to, such as a return address */
+static int new_local_symbol(void)
+{
+        return new_symbol(NULL);
+}
+
+static void define_symbol(int sym)
+{
+        if (symbols[sym].section >= 0)
+                fail("label '%s' defined twice", symbols[sym].name);
+        symbols[sym].section = cur_section;
+        symbols[sym].offset = sections[cur_section].len;
+}
+
+static void set_section(const char *name, size_t len)
+{
+        for (size_t i = 0; i < nsections; ++i) {
+                if (strncmp(sections[i].name, name, len) == 0
+                    && sections[i].name[len] == '\0') {
+                        cur_section = i;
+                        return;
+                }
+        }
+        sections = grow(sections, &sections_cap, nsections + 1,
+                        sizeof(Section));
+        memset(&sections[nsections], 0, sizeof(Section));
+        sections[nsections].name = strndup(name, len);
+        cur_section = nsections++;
+}
+
+static inline void emit_word(uint32_t word)
+{
+        Section *s = &sections[cur_section];
+        if (s->len == s->cap)
+                s->words = grow(s->words, &s->cap, s->len + 1,
+                                sizeof(uint32_t));
+        s->words[s->len++] = word;
+}
+
+static void add_reloc(Const value, bool lv)
+{
+        relocs = grow(relocs, &relocs_cap, nrelocs + 1, sizeof(Reloc));
+        Reloc *r = &relocs[nrelocs++];
+        r->section = cur_section;
+        r->offset = sections[cur_section].len - 1;
+        r->value = value;
+        r->lv = lv;
+        r->file = cur_file;
+        r->line = cur_line;
+}
+
+static void emit3(Um_opcode op, int ra, int rb, int rc)
+{
+        emit_word((uint32_t)op << 28 | ra << 6 | rb << 3 | rc);
+}
+
+static void emit_lv(int ra, Const value)
+{
+        if (value.sym < 0) {
+                if (value.addend > LV_MAX)
+                        fail("constant %u does not fit in a load value",
+                             value.addend);
+                emit_word((uint32_t)LV << 28 | ra << 25 | value.addend);
+                return;
+        }
+        emit_word((uint32_t)LV << 28 | ra << 25);
+        add_reloc(value, true);
+}
+
+static Const absolute(uint32_t n)
+{
+        Const c = { -1, n };
+        return c;
+}
+
+static Const symbolic(int sym)
+{
+        Const c = { sym, 0 };
+        return c;
+}
+
+typedef enum Tok_kind {
+        T_END, T_IDENT, T_REG, T_NUM, T_STRING, T_PUNCT
+} Tok_kind;
+
+typedef struct Token {
+        Tok_kind kind;
+        const char *text;       /* identifier or string text */
+        size_t len;
+        uint32_t num;           /* number, char literal or register */
+        char punct[4];
+} Token;
+
+#define MAX_TOKENS 256
+
+static Token toks[MAX_TOKENS];
+static int ntoks, tpos;
+static char strbuf[4096];
+static size_t strbuf_len;
+
+static int escape(const char **pp)
+{
+        const char *p = *pp;
+        int c = *p++;
+        if (c == '\\') {
+                c = *p++;
+                switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = '\0'; break;
+                case '\\': case '\'': case '"': break;
+                default: fail("unknown escape '\\%c'", c);
+                }
+        }
+        *pp = p;
+        return c;
+}
+
+static void tokenize(const char *p)
+{
+        ntoks = tpos = 0;
+        strbuf_len = 0;
+        for (;;) {
+                while (*p == ' ' || *p == '\t' || *p == '\r')
+                        p++;
+                if (*p == '\0' || *p == '\n' || *p == '#'
+                    || (p[0] == '/' && p[1] == '/'))
+                        break;
+                if (ntoks == MAX_TOKENS - 1)
+                        fail("line too long");
+                Token *t = &toks[ntoks++];
+                if (isalpha((unsigned char)*p) || *p == '_' || *p == '.') {
+                        const char *start = p;
+                        while (isalnum((unsigned char)*p) || *p == '_'
+                               || *p == '.' || *p == '$')
+                                p++;
+                        t->kind = T_IDENT;
+                        t->text = start;
+                        t->len = p - start;
+                        if (t->len == 2 && start[0] == 'r'
+                            && start[1] >= '0' && start[1] <= '7') {
+                                t->kind = T_REG;
+                                t->num = start[1] - '0';
+                        }
+                } else if (isdigit((unsigned char)*p)) {
+                        char *end;
+                        unsigned long long n = strtoull(p, &end, 0);
+                        if (n > UINT32_MAX)
+                                fail("number too large");
+                        t->kind = T_NUM;
+                        t->num = n;
+                        p = end;
+                } else if (*p == '\'') {
+                        p++;
+                        t->kind = T_NUM;
+                        t->num = (unsigned char)escape(&p);
+                        if (*p++ != '\'')
+                                fail("bad character literal");
+                } else if (*p == '"') {
+                        p++;
+                        t->kind = T_STRING;
+                        t->text = strbuf + strbuf_len;
+                        while (*p != '"') {
+                                if (*p == '\0' || *p == '\n')
+                                        fail("unterminated string");
+                                if (strbuf_len == sizeof(strbuf))
+                                        fail("string too long");
+                                strbuf[strbuf_len++] = escape(&p);
+                        }
+                        p++;
+                        t->len = strbuf + strbuf_len - t->text;
+                } else {
+                        /* ":=", "==", "!=", "<", ">" and "<=", ">=" with
+                           an optional "s" for signed; else one character */
+                        size_t n = 1;
+                        t->kind = T_PUNCT;
+                        memset(t->punct, 0, sizeof(t->punct));
+                        t->punct[0] = p[0];
+                        if (p[1] == '=' && strchr(":=!<>", p[0]) != NULL)
+                                t->punct[n++] = '=';
+                        if ((p[0] == '<' || p[0] == '>') && p[n] == 's'
+                            && !isalnum((unsigned char)p[n + 1])
+                            && p[n + 1] != '_')
+                                t->punct[n++] = 's';
+                        p += n;
+                }
+        }
+        toks[ntoks].kind = T_END;
+}
+
+static Token *peek(void)
+{
+        return &toks[tpos];
+}
+
+static bool is_punct(const char *s)
+{
+        return toks[tpos].kind == T_PUNCT && strcmp(toks[tpos].punct, s) == 0;
+}
+
+static bool is_word(const char *s)
+{
+        return toks[tpos].kind == T_IDENT && strlen(s) == toks[tpos].len
+                && strncmp(toks[tpos].text, s, toks[tpos].len) == 0;
+}
+
+static bool accept_punct(const char *s)
+{
+        if (!is_punct(s))
+                return false;
+        tpos++;
+        return true;
+}
+
+static bool accept_word(const char *s)
+{
+        if (!is_word(s))
+                return false;
+        tpos++;
+        return true;
+}
+
+static void expect_punct(const char *s)
+{
+        if (!accept_punct(s))
+                fail("expected '%s'", s);
+}
+
+static void expect_word(const char *s)
+{
+        if (!accept_word(s))
+                fail("expected '%s'", s);
+}
+
+static int expect_reg(void)
+{
+        if (peek()->kind != T_REG)
+                fail("expected a register");
+        return toks[tpos++].num;
+}
+
+typedef enum Expr_kind {
+        E_REG, E_CONST, E_MEM, E_NEG, E_NOT, E_BINOP, E_INPUT
+} Expr_kind;
+
+typedef enum Binop {
+        B_ADD, B_SUB, B_MUL, B_DIV, B_MOD, B_AND, B_OR, B_NAND, B_XOR
+} Binop;
+
+typedef struct Expr {
+        Expr_kind kind;
+        int reg;
+        Const value;
+        Binop op;
+        struct Expr *left, *right;
+} Expr;
+
+#define MAX_EXPRS 256
+
+static Expr exprs[MAX_EXPRS];
+static int nexprs;
+
+static Expr *new_expr(Expr_kind kind)
+{
+        if (nexprs == MAX_EXPRS)
+                fail("expression too complex");
+        Expr *e = &exprs[nexprs++];
+        memset(e, 0, sizeof(*e));
+        e->kind = kind;
+        return e;
+}
+
+static Expr *parse_expr(void);
+
+static Expr *const_expr(Const value)
+{
+        Expr *e = new_expr(E_CONST);
+        e->value = value;
+        return e;
+}
+
+static Expr *parse_primary(void)
+{
+        Token *t = peek();
+        if (t->kind == T_REG) {
+                tpos++;
+                Expr *e = new_expr(E_REG);
+                e->reg = t->num;
+                return e;
+        }
+        if (t->kind == T_NUM) {
+                tpos++;
+                return const_expr(absolute(t->num));
+        }
+        if (accept_punct("(")) {
+                Expr *e = parse_expr();
+                expect_punct(")");
+                return e;
+        }
+        if (accept_punct("-")) {
+                Expr *e = new_expr(E_NEG);
+                e->left = parse_primary();
+                return e;
+        }
+        if (accept_punct("~")) {
+                Expr *e = new_expr(E_NOT);
+                e->left = parse_primary();
+                return e;
+        }
+        if (t->kind == T_IDENT) {
+                if (is_word("m") && toks[tpos + 1].kind == T_PUNCT
+                    && strcmp(toks[tpos + 1].punct, "[") == 0) {
+                        tpos += 2;
+                        Expr *e = new_expr(E_MEM);
+                        e->left = parse_expr();
+                        expect_punct("]");
+                        expect_punct("[");
+                        e->right = parse_expr();
+                        expect_punct("]");
+                        return e;
+                }
+                if (accept_word("input")) {
+                        expect_punct("(");
+                        expect_punct(")");
+                        return new_expr(E_INPUT);
+                }
+                tpos++;
+                return const_expr(symbolic(lookup(t->text, t->len)));
+        }
+        fail("expected an expression");
+        return NULL;
+}
+
+/* folds e1 op e2 when both are constants; symbols allow only + and - */
+static Expr *fold(Binop op, Expr *l, Expr *r)
+{
+        if (l->kind != E_CONST || r->kind != E_CONST)
+                return NULL;
+        Const a = l->value, b = r->value;
+        if (op == B_ADD && (a.sym < 0 || b.sym < 0)) {
+                Const c = { a.sym < 0 ? b.sym : a.sym, a.addend + b.addend };
+                return const_expr(c);
+        }
+        if (op == B_SUB && b.sym < 0) {
+                Const c = { a.sym, a.addend - b.addend };
+                return const_expr(c);
+        }
+        if (a.sym >= 0 || b.sym >= 0)
+                return NULL;
+        uint32_t x = a.addend, y = b.addend, v = 0;
+        switch (op) {
+        case B_ADD: v = x + y; break;
+        case B_SUB: v = x - y; break;
+        case B_MUL: v = x * y; break;
+        case B_DIV: if (y == 0) fail("division by zero"); v = x / y; break;
+        case B_MOD: if (y == 0) fail("division by zero"); v = x % y; break;
+        case B_AND: v = x & y; break;
+        case B_OR: v = x | y; break;
+        case B_NAND: v = ~(x & y); break;
+        case B_XOR: v = x ^ y; break;
+        }
+        return const_expr(absolute(v));
+}
+
+static Expr *binary(Binop op, Expr *l, Expr *r)
+{
+        Expr *folded = fold(op, l, r);
+        if (folded)
+                return folded;
+        Expr *e = new_expr(E_BINOP);
+        e->op = op;
+        e->left = l;
+        e->right = r;
+        return e;
+}
+
+static Expr *parse_unary(void)
+{
+        Expr *e = parse_primary();
+        if (e->kind == E_NEG && e->left->kind == E_CONST
+            && e->left->value.sym < 0)
+                return const_expr(absolute(-e->left->value.addend));
+        if (e->kind == E_NOT && e->left->kind == E_CONST
+            && e->left->value.sym < 0)
+                return const_expr(absolute(~e->left->value.addend));
+        return e;
+}
+
+static Expr *parse_mul(void)
+{
+        Expr *e = parse_unary();
+        for (;;) {
+                if (accept_punct("*"))
+                        e = binary(B_MUL, e, parse_unary());
+                else if (accept_punct("/"))
+                        e = binary(B_DIV, e, parse_unary());
+                else if (accept_word("mod"))
+                        e = binary(B_MOD, e, parse_unary());
+                else
+                        return e;
+        }
+}
+
+static Expr *parse_add(void)
+{
+        Expr *e = parse_mul();
+        for (;;) {
+                if (accept_punct("+"))
+                        e = binary(B_ADD, e, parse_mul());
+                else if (accept_punct("-"))
+                        e = binary(B_SUB, e, parse_mul());
+                else
+                        return e;
+        }
+}
+
+static Expr *parse_expr(void)
+{
+        Expr *e = parse_add();
+        for (;;) {
+                if (accept_punct("&"))
+                        e = binary(B_AND, e, parse_add());
+                else if (accept_punct("|"))
+                        e = binary(B_OR, e, parse_add());
+                else if (accept_word("nand"))
+                        e = binary(B_NAND, e, parse_add());
+                else if (accept_word("xor"))
+                        e = binary(B_XOR, e, parse_add());
+                else
+                        return e;
+        }
+}
+
+/*
+ * per-file register conventions and the per-statement pool of
+ * registers a macro expansion may clobber
+ */
+static unsigned temps_mask;     /* from .temps */
+static int zero_reg = NO_REG;   /* from .zero */
+
+static unsigned pool_mask;      /* temps plus "using" registers */
+static unsigned free_mask;      /* pool registers not holding a value */
+static unsigned owned_mask;     /* registers handed out by alloc */
+
+static int alloc_reg(void)
+{
+        for (int r = 0; r < NUM_REGS; ++r) {
+                if (free_mask & (1u << r)) {
+                        free_mask &= ~(1u << r);
+                        owned_mask |= 1u << r;
+                        return r;
+                }
+        }
+        fail("not enough temporary registers (add some with 'using')");
+        return NO_REG;
+}
+
+static void release(int r)
+{
+        if (r != NO_REG && (owned_mask & (1u << r))) {
+                owned_mask &= ~(1u << r);
+                free_mask |= 1u << r;
+        }
+}
+
+/* a register operand that this statement may overwrite */
+static bool clobberable(int r)
+{
+        return (owned_mask & (1u << r)) || (pool_mask & (1u << r));
+}
+
+static void mark_operands(Expr *e)
+{
+        if (e == NULL)
+                return;
+        if (e->kind == E_REG)
+                free_mask &= ~(1u << e->reg);
+        mark_operands(e->left);
+        mark_operands(e->right);
+}
+
+static bool is_zero(Expr *e)
+{
+        return (e->kind == E_CONST && e->value.sym < 0
+                && e->value.addend == 0)
+                || (e->kind == E_REG && e->reg == zero_reg);
+}
+
+static void copy_reg(int dest, int src)
+{
+        if (dest == src)
+                return;
+        if (zero_reg != NO_REG) {
+                emit3(ADD, dest, src, zero_reg);
+        } else {
+                emit3(NAND, dest, src, src);
+                emit3(NAND, dest, dest, dest);
+        }
+}
+
+/* loads a constant into dest, using a scratch register if it is large */
+static void load_const(int dest, Const value)
+{
+        uint32_t v = value.addend;
+        if (value.sym >= 0 || v <= LV_MAX) {
+                emit_lv(dest, value);
+        } else if (~v <= LV_MAX) {
+                emit_lv(dest, absolute(~v));
+                emit3(NAND, dest, dest, dest);
+        } else if (v == 0x80000000u) {
+                emit_lv(dest, absolute(1u << 15));
+                emit3(MUL, dest, dest, dest);
+                emit3(ADD, dest, dest, dest);
+        } else {
+                int t = alloc_reg();
+                emit_lv(dest, absolute(v >> 16));
+                emit_lv(t, absolute(1u << 16));
+                emit3(MUL, dest, dest, t);
+                emit_lv(t, absolute(v & 0xffff));
+                emit3(ADD, dest, dest, t);
+                release(t);
+        }
+}
+
+static int eval(Expr *e, int dest);
+
+/* returns a register holding the zero word */
+static int zero_value(void)
+{
+        if (zero_reg != NO_REG)
+                return zero_reg;
+        int r = alloc_reg();
+        emit_lv(r, absolute(0));
+        return r;
+}
+
+static int pick(int dest)
+{
+        return dest != NO_REG ? dest : alloc_reg();
+}
+
+/* picks a result register, reusing an operand's temporary if possible */
+static int pick_reusing(int dest, int a, int b)
+{
+        if (dest != NO_REG)
+                return dest;
+        if (a != NO_REG && (owned_mask & (1u << a)))
+                return a;
+        if (b != NO_REG && (owned_mask & (1u << b)))
+                return b;
+        return alloc_reg();
+}
+
+/* dest := l - r, using the identity l - r = ~(~l + r) */
+static void emit_sub(int dest, int l, int r)
+{
+        if (dest == r && l != r) {
+                int t = alloc_reg();
+                emit_sub(t, l, r);
+                copy_reg(dest, t);
+                release(t);
+                return;
+        }
+        emit3(NAND, dest, l, l);
+        emit3(ADD, dest, dest, r);
+        emit3(NAND, dest, dest, dest);
+}
+
+static int eval_binop(Expr *e, int dest)
+{
+        int l = eval(e->left, NO_REG);
+        int r = eval(e->right, NO_REG);
+        int d = pick_reusing(dest, l, r);
+        int t;
+
+        switch (e->op) {
+        case B_ADD: emit3(ADD, d, l, r); break;
+        case B_MUL: emit3(MUL, d, l, r); break;
+        case B_DIV: emit3(DIV, d, l, r); break;
+        case B_NAND: emit3(NAND, d, l, r); break;
+        case B_SUB: emit_sub(d, l, r); break;
+        case B_AND:
+                emit3(NAND, d, l, r);
+                emit3(NAND, d, d, d);
+                break;
+        case B_OR:
+                t = alloc_reg();
+                emit3(NAND, t, r, r);
+                emit3(NAND, d, l, l);
+                emit3(NAND, d, d, t);
+                release(t);
+                break;
+        case B_XOR:
+                t = alloc_reg();
+                emit3(NAND, t, l, r);
+                {
+                        int u = alloc_reg();
+                        emit3(NAND, u, l, t);
+                        emit3(NAND, t, r, t);
+                        emit3(NAND, d, u, t);
+                        release(u);
+                }
+                release(t);
+                break;
+        case B_MOD:
+                t = alloc_reg();
+                emit3(DIV, t, l, r);
+                emit3(MUL, t, t, r);
+                emit_sub(d, l, t);
+                release(t);
+                break;
+        }
+        if (l != d)
+                release(l);
+        if (r != d)
+                release(r);
+        return d;
+}
+
+/*
+ * evaluates e into dest, or into any register if dest is NO_REG;
+ * returns the register holding the value
+ */
+static int eval(Expr *e, int dest)
+{
+        int d, s, o, t;
+        switch (e->kind) {
+        case E_REG:
+                if (dest == NO_REG)
+                        return e->reg;
+                copy_reg(dest, e->reg);
+                return dest;
+        case E_CONST:
+                if (dest == NO_REG && zero_reg != NO_REG && is_zero(e))
+                        return zero_reg;
+                d = pick(dest);
+                load_const(d, e->value);
+                return d;
+        case E_MEM:
+                s = eval(e->left, NO_REG);
+                o = eval(e->right, NO_REG);
+                d = pick_reusing(dest, o, s);
+                emit3(SLOAD, d, s, o);
+                if (s != d)
+                        release(s);
+                if (o != d)
+                        release(o);
+                return d;
+        case E_NOT:
+                s = eval(e->left, NO_REG);
+                d = pick_reusing(dest, s, NO_REG);
+                emit3(NAND, d, s, s);
+                if (s != d)
+                        release(s);
+                return d;
+        case E_NEG:
+                s = eval(e->left, NO_REG);
+                d = pick_reusing(dest, s, NO_REG);
+                t = alloc_reg();
+                emit_lv(t, absolute(1));
+                emit3(NAND, d, s, s);
+                emit3(ADD, d, d, t);
+                release(t);
+                if (s != d)
+                        release(s);
+                return d;
+        case E_BINOP:
+                return eval_binop(e, dest);
+        case E_INPUT:
+                d = pick(dest);
+                emit3(IN, 0, 0, d);
+                return d;
+        }
+        return NO_REG;
+}
+
+/* parses "using rX, rY" at the end of a statement */
+static void parse_using(void)
+{
+        if (accept_word("using")) {
+                do {
+                        pool_mask |= 1u << expect_reg();
+                } while (accept_punct(","));
+        }
+        if (peek()->kind != T_END)
+                fail("junk at end of line");
+}
+
+/*
+ * starts a statement: every temp and "using" register is free except
+ * those read as operands, which stay live until consumed
+ */
+static void begin_statement(Expr **operands, int n)
+{
+        int save = tpos;
+        while (peek()->kind != T_END && !is_word("using"))
+                tpos++;
+        pool_mask = temps_mask;
+        parse_using();
+        tpos = save;
+
+        free_mask = pool_mask;
+        owned_mask = 0;
+        for (int i = 0; i < n; ++i)
+                mark_operands(operands[i]);
+        if (zero_reg != NO_REG)
+                free_mask &= ~(1u << zero_reg);
+}
+
+static void end_statement(void)
+{
+        parse_using();
+}
+
+/* jump through a register: LOADP with segment zero */
+static void emit_jump(int target)
+{
+        int z = zero_value();
+        emit3(LOADP, 0, z, target);
+        release(z);
+}
+
+static void stmt_goto(void)
+{
+        Expr *target = parse_expr();
+        int link = NO_REG;
+        Expr *program = NULL;
+
+        if (accept_word("linking"))
+                link = expect_reg();
+        else if (accept_word("in")) {
+                expect_word("program");
+                program = parse_expr();
+        }
+        Expr *ops[] = { target, program };
+        begin_statement(ops, 2);
+
+        int t = eval(target, NO_REG);
+        if (program) {
+                int s = eval(program, NO_REG);
+                emit3(LOADP, 0, s, t);
+        } else if (link != NO_REG) {
+                if (t == link)
+                        fail("cannot link into the jump register");
+                int ret = new_local_symbol();
+                emit_lv(link, symbolic(ret));
+                emit_jump(t);
+                define_symbol(ret);
+        } else {
+                emit_jump(t);
+        }
+        end_statement();
+}
+
+typedef enum Relation { R_NE, R_LTU, R_LTS } Relation;
+
+/*
+ * sets x to maj(x, y, z) bit by bit; x and y are clobbered and one
+ * more register is needed, borrowing the zero register if necessary
+ */
+static void emit_majority(int x, int y, int z)
+{
+        int t;
+        bool borrowed = false;
+        if (free_mask) {
+                t = alloc_reg();
+        } else if (zero_reg != NO_REG) {
+                t = zero_reg;
+                borrowed = true;
+        } else {
+                t = alloc_reg();
+        }
+        emit3(NAND, t, x, y);
+        emit3(NAND, x, x, x);
+        emit3(NAND, y, y, y);
+        emit3(NAND, x, x, y);
+        emit3(NAND, x, x, z);
+        emit3(NAND, x, t, x);
+        if (borrowed)
+                emit_lv(zero_reg, absolute(0));
+        else
+                release(t);
+}
+
+/*
+ * returns a register that is nonzero iff (a rel b) holds;
+ * a < b is the sign bit of maj(~a, b, a - b) unsigned and of
+ * maj(a, ~b, a - b) signed
+ */
+static int eval_condition(Relation rel, Expr *a, Expr *b)
+{
+        if (rel == R_NE && is_zero(b))
+                return eval(a, NO_REG);
+        if (rel == R_NE && is_zero(a))
+                return eval(b, NO_REG);
+        if (rel == R_LTU && is_zero(b))
+                return zero_value();
+        if (rel == R_LTS && is_zero(b)) {
+                int ra = eval(a, NO_REG);
+                int c = alloc_reg();
+                load_const(c, absolute(0x80000000u));
+                emit3(DIV, c, ra, c);
+                release(ra);
+                return c;
+        }
+
+        int ra = eval(a, NO_REG);
+        int rb = eval(b, NO_REG);
+        if (ra == rb)           /* x != x and x < x are both false */
+                return zero_value();
+
+        int d = alloc_reg();
+        emit_sub(d, ra, rb);
+        if (rel == R_NE) {
+                release(ra);
+                release(rb);
+                return d;
+        }
+
+        int x = ra, y = rb;
+        if (rel == R_LTS) {
+                if (!clobberable(y))
+                        y = alloc_reg();
+                emit3(NAND, y, rb, rb);
+                if (!clobberable(x)) {
+                        x = alloc_reg();
+                        copy_reg(x, ra);
+                }
+        } else {
+                if (!clobberable(x))
+                        x = alloc_reg();
+                emit3(NAND, x, ra, ra);
+                if (!clobberable(y)) {
+                        y = alloc_reg();
+                        copy_reg(y, rb);
+                }
+        }
+        emit_majority(x, y, d);
+        release(y);
+        release(d);
+        if (!(owned_mask & (1u << x))) {
+                /* x is a "using" operand; keep it out of the free pool */
+                free_mask &= ~(1u << x);
+        }
+        int c = alloc_reg();
+        load_const(c, absolute(0x80000000u));
+        emit3(DIV, x, x, c);
+        release(c);
+        return x;
+}
+
+static void stmt_if(void)
+{
+        expect_punct("(");
+        Expr *a = parse_expr();
+
+        if (accept_punct(")")) {
+                /* if (rC) rA := rB is a conditional move */
+                int ra = expect_reg();
+                expect_punct(":=");
+                int rb = expect_reg();
+                if (a->kind != E_REG)
+                        fail("conditional move needs a register condition");
+                emit3(CMOV, ra, rb, a->reg);
+                end_statement();
+                return;
+        }
+
+        static const struct { const char *s; Relation rel; bool swap, neg; }
+        relops[] = {
+                { "!=", R_NE, false, false }, { "==", R_NE, false, true },
+                { "<", R_LTU, false, false }, { ">", R_LTU, true, false },
+                { ">=", R_LTU, false, true }, { "<=", R_LTU, true, true },
+                { "<s", R_LTS, false, false }, { ">s", R_LTS, true, false },
+                { ">=s", R_LTS, false, true }, { "<=s", R_LTS, true, true },
+        };
+        int which = -1;
+        for (unsigned i = 0; i < sizeof(relops) / sizeof(relops[0]); ++i)
+                if (accept_punct(relops[i].s))
+                        which = i;
+        if (which < 0)
+                fail("expected a comparison");
+        Expr *b = parse_expr();
+        expect_punct(")");
+        expect_word("goto");
+        Expr *target = parse_expr();
+
+        if (relops[which].swap) {
+                Expr *tmp = a;
+                a = b;
+                b = tmp;
+        }
+        Expr *ops[] = { a, b, target };
+        begin_statement(ops, 3);
+        if (target->kind == E_REG)
+                free_mask &= ~(1u << target->reg);
+
+        int c = eval_condition(relops[which].rel, a, b);
+
+        /* the operands are consumed; only c and the target stay live */
+        free_mask = pool_mask & ~owned_mask & ~(1u << c);
+        if (target->kind == E_REG)
+                free_mask &= ~(1u << target->reg);
+        if (zero_reg != NO_REG)
+                free_mask &= ~(1u << zero_reg);
+
+        int fall = new_local_symbol();
+        int x = alloc_reg();
+        int y;
+        bool borrowed = false;
+        if (!relops[which].neg && target->kind == E_REG) {
+                /* x := fall; if (c) x := target */
+                emit_lv(x, symbolic(fall));
+                y = target->reg;
+        } else {
+                /* y may be the zero register, set back before the jump */
+                if (free_mask == 0 && zero_reg != NO_REG) {
+                        y = zero_reg;
+                        borrowed = true;
+                } else {
+                        y = alloc_reg();
+                }
+                if (!relops[which].neg) {
+                        emit_lv(x, symbolic(fall));
+                        eval(target, y);
+                } else {
+                        eval(target, x);
+                        emit_lv(y, symbolic(fall));
+                }
+        }
+        emit3(CMOV, x, y, c);
+        if (borrowed)
+                emit_lv(zero_reg, absolute(0));
+        emit_jump(x);
+        define_symbol(fall);
+        end_statement();
+}
+
+static void stmt_output(void)
+{
+        if (peek()->kind == T_STRING) {
+                Token *t = &toks[tpos++];
+                begin_statement(NULL, 0);
+                int r = alloc_reg();
+                for (size_t i = 0; i < t->len; ++i) {
+                        emit_lv(r, absolute((unsigned char)t->text[i]));
+                        emit3(OUT, 0, 0, r);
+                }
+                end_statement();
+                return;
+        }
+        Expr *e = parse_expr();
+        begin_statement(&e, 1);
+        emit3(OUT, 0, 0, eval(e, NO_REG));
+        end_statement();
+}
+
+/* push e on stack rS / pop rX off stack rS / pop stack rS */
+static void stmt_push(void)
+{
+        Expr *e = parse_expr();
+        expect_word("on");
+        expect_word("stack");
+        int sp = expect_reg();
+        begin_statement(&e, 1);
+        free_mask &= ~(1u << sp);
+
+        int v = eval(e, NO_REG);
+        int t = alloc_reg();
+        emit_lv(t, absolute(0));
+        emit3(NAND, t, t, t);
+        emit3(ADD, sp, sp, t);
+        release(t);
+        int z = zero_value();
+        emit3(SSTORE, z, sp, v);
+        release(z);
+        release(v);
+        end_statement();
+}
+
+static void stmt_pop(void)
+{
+        int dest = NO_REG;
+        if (!accept_word("stack")) {
+                dest = expect_reg();
+                expect_word("off");
+                expect_word("stack");
+        }
+        int sp = expect_reg();
+        begin_statement(NULL, 0);
+        free_mask &= ~(1u << sp);
+        if (dest != NO_REG) {
+                free_mask &= ~(1u << dest);
+                int z = zero_value();
+                emit3(SLOAD, dest, z, sp);
+                release(z);
+        }
+        int t = alloc_reg();
+        emit_lv(t, absolute(1));
+        emit3(ADD, sp, sp, t);
+        release(t);
+        end_statement();
+}
+
+static void stmt_assign_reg(int dest)
+{
+        if (accept_word("map")) {
+                expect_word("segment");
+                expect_punct("(");
+                Expr *size = parse_expr();
+                expect_word("words");
+                expect_punct(")");
+                begin_statement(&size, 1);
+                int s = eval(size, NO_REG);
+                emit3(MAP, 0, dest, s);
+                release(s);
+                end_statement();
+                return;
+        }
+        Expr *e = parse_expr();
+        begin_statement(&e, 1);
+        free_mask &= ~(1u << dest);
+        eval(e, dest);
+        end_statement();
+}
+
+static void stmt_store(void)
+{
+        /* "m" "[" already seen */
+        Expr *seg = parse_expr();
+        expect_punct("]");
+        expect_punct("[");
+        Expr *off = parse_expr();
+        expect_punct("]");
+        expect_punct(":=");
+        Expr *e = parse_expr();
+        Expr *ops[] = { seg, off, e };
+        begin_statement(ops, 3);
+
+        int v = eval(e, NO_REG);
+        int s = eval(seg, NO_REG);
+        int o = eval(off, NO_REG);
+        emit3(SSTORE, s, o, v);
+        release(s);
+        release(o);
+        release(v);
+        end_statement();
+}
+
+static void directive(void)
+{
+        Token *t = &toks[tpos++];
+        Expr *e;
+
+        if (t->len == 8 && strncmp(t->text, ".section", 8) == 0) {
+                Token *name = &toks[tpos++];
+                if (name->kind != T_IDENT)
+                        fail("expected a section name");
+                set_section(name->text, name->len);
+        } else if (t->len == 6 && strncmp(t->text, ".temps", 6) == 0) {
+                temps_mask = 0;
+                while (peek()->kind == T_REG) {
+                        temps_mask |= 1u << expect_reg();
+                        if (!accept_punct(","))
+                                break;
+                }
+        } else if (t->len == 5 && strncmp(t->text, ".zero", 5) == 0) {
+                zero_reg = accept_word("off") ? NO_REG : expect_reg();
+        } else if (t->len == 5 && strncmp(t->text, ".data", 5) == 0) {
+                e = parse_expr();
+                if (e->kind != E_CONST)
+                        fail(".data needs a constant");
+                emit_word(e->value.addend);
+                if (e->value.sym >= 0)
+                        add_reloc(e->value, false);
+        } else if (t->len == 6 && strncmp(t->text, ".space", 6) == 0) {
+                e = parse_expr();
+                if (e->kind != E_CONST || e->value.sym >= 0)
+                        fail(".space needs a number");
+                Section *s = &sections[cur_section];
+                s->words = grow(s->words, &s->cap,
+                                s->len + e->value.addend, sizeof(uint32_t));
+                memset(s->words + s->len, 0,
+                       e->value.addend * sizeof(uint32_t));
+                s->len += e->value.addend;
+        } else {
+                fail("unknown directive '%.*s'", (int)t->len, t->text);
+        }
+        if (peek()->kind != T_END)
+                fail("junk at end of line");
+}
+
+static void statement(void)
+{
+        nexprs = 0;
+
+        /* labels */
+        while (peek()->kind == T_IDENT && toks[tpos + 1].kind == T_PUNCT
+               && strcmp(toks[tpos + 1].punct, ":") == 0) {
+                define_symbol(lookup(peek()->text, peek()->len));
+                tpos += 2;
+        }
+        Token *t = peek();
+        if (t->kind == T_END)
+                return;
+
+        if (t->kind == T_IDENT && t->text[0] == '.') {
+                directive();
+        } else if (accept_word("halt")) {
+                emit3(HALT, 0, 0, 0);
+                end_statement();
+        } else if (accept_word("goto")) {
+                stmt_goto();
+        } else if (accept_word("if")) {
+                stmt_if();
+        } else if (accept_word("output")) {
+                stmt_output();
+        } else if (accept_word("push")) {
+                stmt_push();
+        } else if (accept_word("pop")) {
+                stmt_pop();
+        } else if (accept_word("unmap")) {
+                Expr *e = parse_expr();
+                if (e->kind == E_MEM)
+                        fail("write 'unmap rX', not 'unmap m[rX]'");
+                begin_statement(&e, 1);
+                int r = eval(e, NO_REG);
+                emit3(UNMAP, 0, 0, r);
+                release(r);
+                end_statement();
+        } else if (is_word("m") && toks[tpos + 1].kind == T_PUNCT
+                   && strcmp(toks[tpos + 1].punct, "[") == 0) {
+                tpos += 2;
+                stmt_store();
+        } else if (t->kind == T_REG) {
+                int dest = expect_reg();
+                expect_punct(":=");
+                stmt_assign_reg(dest);
+        } else {
+                fail("unrecognized statement");
+        }
+}
+
+static char *read_file(const char *path)
+{
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL) {
+                perror(path);
+                exit(1);
+        }
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        rewind(fp);
+        char *buf = malloc(size + 1);
+        if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size) {
+                fprintf(stderr, "umasm: cannot read %s\n", path);
+                exit(1);
+        }
+        buf[size] = '\0';
+        fclose(fp);
+        return buf;
+}
+
+static void assemble_file(const char *path)
+{
+        char *text = read_file(path);
+        cur_file = path;
+        cur_line = 0;
+        temps_mask = 0;
+        zero_reg = NO_REG;
+        set_section("text", 4);
+
+        char *line = text;
+        while (*line) {
+                char *end = strchr(line, '\n');
+                if (end)
+                        *end = '\0';
+                cur_line++;
+                tokenize(line);
+                statement();
+                if (!end)
+                        break;
+                line = end + 1;
+        }
+        /* text is kept: symbol names and strings point into it */
+}
+
+static int section_rank(Section *s)
+{
+        if (strcmp(s->name, "init") == 0)
+                return 0;
+        if (strcmp(s->name, "text") == 0)
+                return 1;
+        return 2;
+}
+
+static void layout(void)
+{
+        uint32_t base = 0;
+        for (int rank = 0; rank < 3; ++rank) {
+                for (size_t i = 0; i < nsections; ++i) {
+                        if (section_rank(&sections[i]) != rank)
+                                continue;
+                        sections[i].base = base;
+                        base += sections[i].len;
+                }
+        }
+}
+
+static uint32_t address_of(int sym)
+{
+        Symbol *s = &symbols[sym];
+        return sections[s->section].base + s->offset;
+}
+
+static void link_image(void)
+{
+        layout();
+        for (size_t i = 0; i < nsymbols; ++i) {
+                if (symbols[i].section < 0) {
+                        fprintf(stderr, "umasm: undefined label '%s'\n",
+                                symbols[i].name);
+                        exit(1);
+                }
+        }
+        for (size_t i = 0; i < nrelocs; ++i) {
+                Reloc *r = &relocs[i];
+                uint32_t v = address_of(r->value.sym) + r->value.addend;
+                uint32_t *w = &sections[r->section].words[r->offset];
+                if (r->lv) {
+                        if (v > LV_MAX) {
+                                cur_file = r->file;
+                                cur_line = r->line;
+                                fail("address %u does not fit in a "
+                                     "load value", v);
+                        }
+                        *w |= v;
+                } else {
+                        *w = v;
+                }
+        }
+}
+
+static void write_image(FILE *out)
+{
+        for (int rank = 0; rank < 3; ++rank) {
+                for (size_t i = 0; i < nsections; ++i) {
+                        Section *s = &sections[i];
+                        if (section_rank(s) != rank)
+                                continue;
+                        /* big-endian in place: the words are not used again */
+                        for (size_t j = 0; j < s->len; ++j)
+                                s->words[j] = htonl(s->words[j]);
+                        fwrite(s->words, sizeof(uint32_t), s->len, out);
+                }
+        }
+}
+
+static int by_address(const void *a, const void *b)
+{
+        int i = *(const int *)a, j = *(const int *)b;
+        uint32_t x = address_of(i), y = address_of(j);
+        if (x != y)
+                return (x > y) - (x < y);
+        return (i > j) - (i < j);       /* labels at one address in order */
+}
+
+static void write_map(FILE *out)
+{
+        int *order = malloc(nsymbols * sizeof(int) + 1);
+        size_t n = 0;
+        for (size_t i = 0; i < nsymbols; ++i)
+                if (symbols[i].name != NULL)
+                        order[n++] = i;
+        qsort(order, n, sizeof(int), by_address);
+        for (size_t i = 0; i < n; ++i)
+                fprintf(out, "%08x %s\n", address_of(order[i]),
+                        symbols[order[i]].name);
+        free(order);
+}
+
+static FILE *open_output(const char *path)
+{
+        FILE *fp = fopen(path, "wb");
+        if (fp == NULL) {
+                perror(path);
+                exit(1);
+        }
+        return fp;
+}
+
+int main(int argc, char *argv[])
+{
+        const char *out_path = NULL, *map_path = NULL;
+        int i;
+        for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+                if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+                        out_path = argv[++i];
+                else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+                        map_path = argv[++i];
+                else
+                        break;
+        }
+        if (i == argc) {
+                fprintf(stderr,
+                        "usage: %s [-o image.um] [-m image.sym] file.ums ...\n",
+                        argv[0]);
+                return 1;
+        }
+        for (; i < argc; ++i)
+                assemble_file(argv[i]);
+        link_image();
+
+        FILE *out = out_path ? open_output(out_path) : stdout;
+        write_image(out);
+        if (out != stdout)
+                fclose(out);
+        if (map_path) {
+                FILE *map = open_output(map_path);
+                write_map(map);
+                fclose(map);
+        }
+        return 0;
+}